@@ -23,6 +23,9 @@
 
 #define TOUPCAM_CAPT_NAME   "toupcam"
 
+// max time of waiting for frame after exposure end, seconds
+#define TOUPCAM_READOUT_TM  (2.)
+
 extern camera Toupcam;
 
 #endif
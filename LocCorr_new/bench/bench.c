@@ -0,0 +1,74 @@
+/*
+ * This file is part of the loccorr project.
+ * Copyright 2021 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// benchmark: replay recorded frames through full processing pipeline and check centroids digest
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cmdlnopts.h"
+#include "config.h"
+#include "debug.h"
+#include "improc.h"
+#include "replay.h"
+
+#define BENCH_OUTPJPEG      "/tmp/loccorr_bench.jpg"
+
+static int help = 0;
+static int npasses = 1;
+static char *digest = NULL;
+static glob_pars G = {
+    .configname = DEFAULT_CONFFILE,
+    .outputjpg = BENCH_OUTPJPEG,
+};
+
+static sl_option_t cmdlnopts[] = {
+    {"help",    NO_ARGS,    NULL,   'h',    arg_int,    APTR(&help),        _("show this help")},
+    {"confname",NEED_ARG,   NULL,   'c',    arg_string, APTR(&G.configname),_("name of configuration file (default: ./loccorr.conf)")},
+    {"input",   NEED_ARG,   NULL,   'i',    arg_string, APTR(&G.replay),    _("directory or file with recorded images")},
+    {"jpegout", NEED_ARG,   NULL,   'j',    arg_string, APTR(&G.outputjpg), _("output jpeg file location (default: '" BENCH_OUTPJPEG "')")},
+    {"logXY",   NEED_ARG,   NULL,   'L',    arg_string, APTR(&G.logXYname), _("file to log XY coordinates of selected star")},
+    {"passes",  NEED_ARG,   NULL,   'n',    arg_int,    APTR(&npasses),     _("amount of passes over images sequence (default: 1)")},
+    {"realtime",NO_ARGS,    NULL,   'r',    arg_int,    APTR(&G.realtime),  _("replay images at recorded timestamps (files modification time)")},
+    {"digest",  NEED_ARG,   NULL,   'd',    arg_string, APTR(&digest),      _("expected centroids digest (hex): exit with error if differs")},
+   end_option
+};
+
+int main(int argc, char **argv){
+    sl_init();
+    sl_helpstring("Usage: %s [args]\n\n\tWhere args are:\n");
+    sl_parseargs(&argc, &argv, cmdlnopts);
+    if(help || argc > 0 || !G.replay) sl_showhelp(-1, cmdlnopts);
+    GP = &G;
+    if(!chkconfig(G.configname)) WARNX("Wrong/absent configuration file, use defaults");
+    if(G.logXYname) openXYlog(G.logXYname);
+    uint64_t h;
+    int n = replay_run(G.replay, G.realtime, npasses, &h);
+    closeXYlog();
+    if(n < 1) return 1;
+    if(digest){
+        uint64_t expected = strtoull(digest, NULL, 16);
+        if(expected != h){
+            WARNX("Digest mismatch: expected %016" PRIx64 ", got %016" PRIx64, expected, h);
+            return 2;
+        }
+        green("Digest OK\n");
+    }
+    return 0;
+}
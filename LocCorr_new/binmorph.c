@@ -52,6 +52,303 @@ static void morph_init(){
     }
 }
 
+/*
+ * =================== SCRATCH ARENA ===================>
+ */
+
+static void *arena_block(size_t size){
+    void *p = NULL;
+    if(posix_memalign(&p, IL_ARENA_ALIGN, size)) ERR("Can't allocate %zd bytes", size);
+    return p;
+}
+
+/**
+ * @brief il_Arena_reset - release all allocations of previous frame
+ * @param a    - arena
+ * @param size - expected amount of memory for next frame (main block could be enlarged,
+ *               also it grows up to amount requested after previous reset)
+ */
+void il_Arena_reset(il_Arena *a, size_t size){
+    if(!a) return;
+    while(a->extra){ // first bytes of extra block are pointer to next
+        void *next = *(void**)a->extra;
+        free(a->extra);
+        a->extra = next;
+    }
+    if(size < a->need) size = a->need;
+    if(size > a->size){
+        size = (size + IL_ARENA_ALIGN - 1) / IL_ARENA_ALIGN * IL_ARENA_ALIGN;
+        DBG("Enlarge arena from %zd to %zd bytes", a->size, size);
+        free(a->base);
+        a->base = arena_block(size);
+        a->size = size;
+    }
+    a->used = a->need = 0;
+}
+
+/**
+ * @brief il_Arena_alloc - get aligned uninitialized memory valid until next reset
+ * @param a    - arena
+ * @param size - amount of bytes
+ * @return pointer to memory (never NULL)
+ */
+void *il_Arena_alloc(il_Arena *a, size_t size){
+    size = (size + IL_ARENA_ALIGN - 1) / IL_ARENA_ALIGN * IL_ARENA_ALIGN;
+    if(!size) size = IL_ARENA_ALIGN;
+    a->need += size;
+    if(a->used + size <= a->size){
+        void *p = a->base + a->used;
+        a->used += size;
+        return p;
+    }
+    // main block is full: allocate extra block, main would be enlarged at next reset
+    uint8_t *blk = arena_block(size + IL_ARENA_ALIGN);
+    *(void**)blk = a->extra;
+    a->extra = blk;
+    return blk + IL_ARENA_ALIGN;
+}
+
+// the same as il_Arena_alloc, but memory is zeroed
+void *il_Arena_calloc(il_Arena *a, size_t nmemb, size_t size){
+    void *p = il_Arena_alloc(a, nmemb * size);
+    memset(p, 0, nmemb * size);
+    return p;
+}
+
+// free all memory of arena
+void il_Arena_free(il_Arena *a){
+    if(!a) return;
+    a->need = 0;
+    il_Arena_reset(a, 0);
+    free(a->base);
+    *a = (il_Arena){0};
+}
+
+/*
+ * <=================== SCRATCH ARENA ===================
+ */
+
+/*
+ * =================== ROWS STREAMING ===================>
+ */
+
+// all operations below make output row from three input rows: upper, current and lower (zero row outside of image)
+typedef enum{
+    MORPH_EROSION,
+    MORPH_DILATION,
+    MORPH_FILTER4,
+    MORPH_FILTER8
+} morph_op;
+
+// what to write into output after the last operation
+typedef enum{
+    MORPH_RESULT,       // result itself
+    MORPH_IMAGE_MINUS,  // image & ~result (top hat)
+    MORPH_MINUS_IMAGE   // result & ~image (bottom hat)
+} morph_out;
+
+// masks for the last byte of row
+typedef struct{
+    uint8_t erosion;    // clear the rightmost pixel
+    uint8_t dilation;   // clear the first pixel out of image
+} lastmasks;
+
+static lastmasks get_lastmasks(int W){
+    int w = (W + 7) / 8 - 1, rest = 7 - (W - w*8);
+    return (lastmasks){
+        .erosion = (uint8_t)~(1 << (rest + 1)),
+        .dilation = (rest < 0) ? 0xff : (uint8_t)~(1 << rest)
+    };
+}
+
+static void morph_row(morph_op op, const uint8_t *up, const uint8_t *cur, const uint8_t *down,
+                      uint8_t *out, int W0, lastmasks m){
+    int w = W0 - 1;
+    uint8_t p, inp;
+    switch(op){
+        case MORPH_EROSION:
+            p = ER[cur[0]] & up[0] & down[0];
+            if(!(cur[1] & 0x80)) p &= 0xfe;
+            out[0] = p & 0x7f;
+            for(int x = 1; x < w; ++x){
+                p = ER[cur[x]] & up[x] & down[x];
+                if(!(cur[x-1] & 1)) p &= 0x7f;
+                if(!(cur[x+1] & 0x80)) p &= 0xfe;
+                out[x] = p;
+            }
+            p = ER[cur[w]] & up[w] & down[w];
+            if(!(cur[w-1] & 1)) p &= 0x7f;
+            out[w] = p & m.erosion;
+        break;
+        case MORPH_DILATION:
+            p = DIL[cur[0]] | up[0] | down[0];
+            if(cur[1] & 0x80) p |= 1;
+            out[0] = p;
+            for(int x = 1; x < w; ++x){
+                p = DIL[cur[x]] | up[x] | down[x];
+                if(cur[x+1] & 0x80) p |= 1;
+                if(cur[x-1] & 1) p |= 0x80;
+                out[x] = p;
+            }
+            p = DIL[cur[w]] | up[w] | down[w];
+            if(cur[w-1] & 1) p |= 0x80;
+            out[w] = p & m.dilation;
+        break;
+        case MORPH_FILTER4:
+            inp = cur[0];
+            p = (inp << 1) | (inp >> 1) | up[0] | down[0];
+            if(cur[1] & 0x80) p |= 1;
+            out[0] = inp & p;
+            for(int x = 1; x < w; ++x){
+                inp = cur[x];
+                p = (inp << 1) | (inp >> 1) | up[x] | down[x];
+                if(cur[x+1] & 0x80) p |= 1;
+                if(cur[x-1] & 1) p |= 0x80;
+                out[x] = inp & p;
+            }
+            inp = cur[w];
+            p = (inp << 1) | (inp >> 1) | up[w] | down[w];
+            if(cur[w-1] & 1) p |= 0x80;
+            out[w] = inp & p;
+        break;
+        case MORPH_FILTER8:
+            for(int x = 0; x <= w; ++x){
+                inp = cur[x];
+                p = (inp << 1) | (inp >> 1) | up[x] | (up[x] << 1) | (up[x] >> 1)
+                    | down[x] | (down[x] << 1) | (down[x] >> 1);
+                if(x < w && ((cur[x+1] | up[x+1] | down[x+1]) & 0x80)) p |= 1;
+                if(x > 0 && ((cur[x-1] | up[x-1] | down[x-1]) & 1)) p |= 0x80;
+                out[x] = inp & p;
+            }
+        break;
+    }
+}
+
+// rows of one horizontal band of image
+typedef struct{
+    const uint8_t *image;   // input
+    const uint8_t *zero;    // zero row (outside of image)
+    uint8_t *window;        // three last rows of each operation
+    const uint8_t *halo;    // copy of K input rows above and below band (for in-place operations)
+    int W0, H;
+    int y0, y1;             // band's rows
+    int K;                  // amount of operations
+} morphband;
+
+// row `y` of operation `k` result (0 - input image)
+static inline const uint8_t *band_row(const morphband *b, int k, int y){
+    if(y < 0 || y >= b->H) return b->zero;
+    if(k) return &b->window[((size_t)(k-1)*3 + y%3) * b->W0];
+    if(b->halo){
+        if(y < b->y0) return &b->halo[(size_t)(y - b->y0 + b->K) * b->W0];
+        if(y >= b->y1) return &b->halo[(size_t)(y - b->y1 + b->K) * b->W0];
+    }
+    return &b->image[(size_t)y * b->W0];
+}
+
+static void band_flush(const morphband *b, uint8_t *dst, int y, morph_out out){
+    const uint8_t *res = band_row(b, b->K, y), *in = &b->image[(size_t)y * b->W0];
+    uint8_t *o = &dst[(size_t)y * b->W0];
+    switch(out){
+        case MORPH_RESULT:
+            memcpy(o, res, b->W0);
+        break;
+        case MORPH_IMAGE_MINUS:
+            for(int x = 0; x < b->W0; ++x) o[x] = in[x] & ~res[x];
+        break;
+        case MORPH_MINUS_IMAGE:
+            for(int x = 0; x < b->W0; ++x) o[x] = res[x] & ~in[x];
+        break;
+    }
+}
+
+/**
+ * @brief morph_band - stream rows of band through chain of operations
+ *      row `r` of operation `k` is calculated at step `t = r + k - 1`, when rows r-1..r+1 of previous
+ *      operation are ready; output row `y` is written at step y+K+1, when input row `y` isn't needed anymore
+ */
+static void morph_band(const morphband *b, const morph_op *ops, uint8_t *dst, morph_out out, lastmasks m){
+    int K = b->K, lo1 = b->y0 - K + 1, hi1 = b->y1 + K - 1;
+    if(lo1 < 0) lo1 = 0;
+    if(hi1 > b->H) hi1 = b->H;
+    int nextflush = b->y0, tend = hi1 + K - 2;
+    for(int t = lo1; t <= tend; ++t){
+        for(int k = 1; k <= K; ++k){
+            int r = t - k + 1, lo = b->y0 - K + k, hi = b->y1 + K - k;
+            if(r < lo || r >= hi || r < 0 || r >= b->H) continue;
+            morph_row(ops[k-1], band_row(b, k-1, r-1), band_row(b, k-1, r), band_row(b, k-1, r+1),
+                      (uint8_t*)band_row(b, k, r), b->W0, m);
+        }
+        for(; nextflush < b->y1 && nextflush <= t - K - 1; ++nextflush) band_flush(b, dst, nextflush, out);
+    }
+    for(; nextflush < b->y1; ++nextflush) band_flush(b, dst, nextflush, out);
+}
+
+/**
+ * @brief morph_stream - make chain of operations without full-size intermediate images
+ *      (image is divided by horizontal bands processed in parallel)
+ * @param image - input image
+ * @param dst   - output image (could be `image`)
+ * @param W, H  - size of image (in pixels)
+ * @param ops   - operations
+ * @param K     - their amount
+ * @param out   - what to write into `dst`
+ * @return dst
+ */
+static uint8_t *morph_stream(uint8_t *image, uint8_t *dst, int W, int H, const morph_op *ops, int K, morph_out out){
+    if(!ER) morph_init();
+    int W0 = (W + 7) / 8, inplace = (dst == image);
+    lastmasks m = get_lastmasks(W);
+    int nbands = omp_get_max_threads();
+    if(nbands > H / (4*K)) nbands = H / (4*K); // halo shouldn't be larger than band itself
+    if(nbands < 1) nbands = 1;
+    size_t bandsz = (size_t)(3*K + (inplace ? 2*K : 0)) * W0;
+    // zero row and per-band windows and halo
+    uint8_t *scratch = MALLOC(uint8_t, W0 + nbands * bandsz);
+    morphband bands[nbands];
+    for(int i = 0; i < nbands; ++i){
+        morphband *b = &bands[i];
+        *b = (morphband){.image = image, .zero = scratch, .window = scratch + W0 + i * bandsz,
+            .W0 = W0, .H = H, .y0 = (int)((int64_t)H * i / nbands), .y1 = (int)((int64_t)H * (i + 1) / nbands), .K = K};
+        if(!inplace) continue;
+        // input rows of neighbours would be overwritten: copy them before start
+        uint8_t *halo = b->window + 3 * K * W0;
+        b->halo = halo;
+        for(int y = b->y0 - K; y < b->y0; ++y)
+            if(y >= 0) memcpy(&halo[(size_t)(y - b->y0 + K) * W0], &image[(size_t)y * W0], W0);
+        for(int y = b->y1; y < b->y1 + K; ++y)
+            if(y < H) memcpy(&halo[(size_t)(y - b->y1 + K) * W0], &image[(size_t)y * W0], W0);
+    }
+    #pragma omp parallel for num_threads(nbands)
+    for(int i = 0; i < nbands; ++i) morph_band(&bands[i], ops, dst, out, m);
+    FREE(scratch);
+    return dst;
+}
+
+/**
+ * @brief morphN - N operations `first` followed by N operations `second` (if not 0) by rows
+ * @param image - input image
+ * @param dst   - output (could be `image`)
+ * @param W, H  - image size
+ * @param N     - amount of each operation
+ * @param first, second - operations
+ * @param nsecond - amount of `second` operations (0 or N)
+ * @param out   - what to write into `dst`
+ * @return dst
+ */
+static uint8_t *morphN(uint8_t *image, uint8_t *dst, int W, int H, int N, morph_op first, int nsecond, morph_out out){
+    morph_op *ops = MALLOC(morph_op, N + nsecond);
+    for(int i = 0; i < N; ++i) ops[i] = first;
+    for(int i = N; i < N + nsecond; ++i) ops[i] = (first == MORPH_EROSION) ? MORPH_DILATION : MORPH_EROSION;
+    morph_stream(image, dst, W, H, ops, N + nsecond, out);
+    FREE(ops);
+    return dst;
+}
+
+/*
+ * <=================== ROWS STREAMING ===================
+ */
+
 /*
  * =================== MORPHOLOGICAL OPERATIONS ===================>
  */
@@ -65,7 +362,24 @@ static void morph_init(){
 uint8_t *il_filter4(uint8_t *image, int W, int H){
     //FNAME();
     if(W < MINWIDTH || H < MINHEIGHT) return NULL;
-    uint8_t *ret = MALLOC(uint8_t, W*H);
+    uint8_t *ret = MALLOC(uint8_t, ((W + 7) / 8) * H);
+    return il_filter4_to(image, ret, W, H);
+}
+
+/**
+ * Remove all non-4-connected pixels
+ * @param image (i) - input image
+ * @param dst (o)   - output image (W0*H bytes, could be `image`)
+ * @param W, H      - size of binarized image (in pixels)
+ * @return dst
+ */
+uint8_t *il_filter4_to(uint8_t *image, uint8_t *dst, int W, int H){
+    if(W < MINWIDTH || H < MINHEIGHT || !dst) return NULL;
+    if(dst == image){ // in-place: by rows
+        morph_op op = MORPH_FILTER4;
+        return morph_stream(image, dst, W, H, &op, 1, MORPH_RESULT);
+    }
+    uint8_t *ret = dst;
     int W0 = (W + 7) / 8; // width in bytes
     int w = W0-1, h = H-1;
     {
@@ -96,7 +410,24 @@ uint8_t *il_filter4(uint8_t *image, int W, int H){
 uint8_t *il_filter8(uint8_t *image, int W, int H){
     //FNAME();
     if(W < MINWIDTH || H < MINHEIGHT) return NULL;
-    uint8_t *ret = MALLOC(uint8_t, W*H);
+    uint8_t *ret = MALLOC(uint8_t, ((W + 7) / 8) * H);
+    return il_filter8_to(image, ret, W, H);
+}
+
+/**
+ * Remove all non-8-connected pixels (single points)
+ * @param image (i) - input image
+ * @param dst (o)   - output image (W0*H bytes, could be `image`)
+ * @param W, H      - size of binarized image (in pixels)
+ * @return dst
+ */
+uint8_t *il_filter8_to(uint8_t *image, uint8_t *dst, int W, int H){
+    if(W < MINWIDTH || H < MINHEIGHT || !dst) return NULL;
+    if(dst == image){ // in-place: by rows
+        morph_op op = MORPH_FILTER8;
+        return morph_stream(image, dst, W, H, &op, 1, MORPH_RESULT);
+    }
+    uint8_t *ret = dst;
     int W0 = (W + 7) / 8; // width in bytes
     int w = W0-1, h = H-1;
     {
@@ -124,11 +455,28 @@ uint8_t *il_filter8(uint8_t *image, int W, int H){
 uint8_t *il_dilation(uint8_t *image, int W, int H){
     //FNAME();
     if(W < MINWIDTH || H < MINHEIGHT) return NULL;
+    uint8_t *ret = MALLOC(uint8_t, ((W + 7) / 8) * H);
+    return il_dilation_to(image, ret, W, H);
+}
+
+/**
+ * Make morphological operation of il_dilation
+ * @param image (i) - input image
+ * @param dst (o)   - output image (W0*H bytes, could be `image`)
+ * @param W, H      - size of image (pixels)
+ * @return dst
+ */
+uint8_t *il_dilation_to(uint8_t *image, uint8_t *dst, int W, int H){
+    if(W < MINWIDTH || H < MINHEIGHT || !dst) return NULL;
+    if(dst == image){ // in-place: by rows
+        morph_op op = MORPH_DILATION;
+        return morph_stream(image, dst, W, H, &op, 1, MORPH_RESULT);
+    }
     int W0 = (W + 7) / 8; // width in bytes
-    int w = W0-1, h = H-1, rest = 7 - (W - w*8);
-    uint8_t lastmask = ~(1<<rest);
+    int w = W0-1, h = H-1;
+    uint8_t lastmask = get_lastmasks(W).dilation;
     if(!DIL) morph_init();
-    uint8_t *ret = MALLOC(uint8_t, W0*H);
+    uint8_t *ret = dst;
     {
     // top of image, y = 0
     #define IM_UP
@@ -157,11 +505,30 @@ uint8_t *il_dilation(uint8_t *image, int W, int H){
 uint8_t *il_erosion(uint8_t *image, int W, int H){
     //FNAME();
     if(W < MINWIDTH || H < MINHEIGHT) return NULL;
+    uint8_t *ret = MALLOC(uint8_t, ((W + 7) / 8) * H);
+    return il_erosion_to(image, ret, W, H);
+}
+
+/**
+ * Make morphological operation of il_erosion by cross 3x3 pixels
+ * @param image (i) - input image
+ * @param dst (o)   - output image (W0*H bytes, could be `image`)
+ * @param W, H      - size of image (in pixels)
+ * @return dst
+ */
+uint8_t *il_erosion_to(uint8_t *image, uint8_t *dst, int W, int H){
+    if(W < MINWIDTH || H < MINHEIGHT || !dst) return NULL;
+    if(dst == image){ // in-place: by rows
+        morph_op op = MORPH_EROSION;
+        return morph_stream(image, dst, W, H, &op, 1, MORPH_RESULT);
+    }
     if(!ER) morph_init();
     int W0 = (W + 7) / 8; // width in bytes
-    int w = W0-1, h = H-1, rest = 8 - (W - w*8);
-    uint8_t lastmask = ~(1<<rest);
-    uint8_t *ret = MALLOC(uint8_t, W0*H);
+    int w = W0-1, h = H-1;
+    uint8_t lastmask = get_lastmasks(W).erosion;
+    uint8_t *ret = dst;
+    memset(ret, 0, W0); // first & last rows are always empty
+    memset(&ret[W0*h], 0, W0);
     //DBG("rest=%d, mask:0x%x", rest, lastmask);
     OMP_FOR()
     for(int y = 1; y < h; y++){ // reset first & last rows of image
@@ -191,8 +558,9 @@ uint8_t *il_erosionN(uint8_t *image, int W, int H, int N){
     //FNAME();
     if(W < 1 || H < 1) return NULL;
     if(W < MINWIDTH || H < MINHEIGHT || N < 1){
-        uint8_t *copy = MALLOC(uint8_t, W*H);
-        memcpy(copy, image, W*H);
+        int sz = ((W + 7) / 8) * H;
+        uint8_t *copy = MALLOC(uint8_t, sz);
+        memcpy(copy, image, sz);
         return copy;
     }
     uint8_t *cur = image, *next = NULL;
@@ -208,8 +576,9 @@ uint8_t *il_dilationN(uint8_t *image, int W, int H, int N){
     //FNAME();
     if(W < 1 || H < 1) return NULL;
     if(W < MINWIDTH || H < MINHEIGHT || N < 1){
-        uint8_t *copy = MALLOC(uint8_t, W*H);
-        memcpy(copy, image, W*H);
+        int sz = ((W + 7) / 8) * H;
+        uint8_t *copy = MALLOC(uint8_t, sz);
+        memcpy(copy, image, sz);
         return copy;
     }
     uint8_t *cur = image, *next = NULL;
@@ -221,50 +590,97 @@ uint8_t *il_dilationN(uint8_t *image, int W, int H, int N){
     return next;
 }
 
+// output buffer of i'th from N steps: buffers are swapped so that the last one writes into `dst`
+#define PINGPONG(i, N, dst, tmp)    ((((N) - (i)) & 1) ? (dst) : (tmp))
+
+// Make il_erosion N times into `dst` using `tmp` as intermediate buffer (could be NULL if N < 2 or in-place)
+uint8_t *il_erosionN_to(uint8_t *image, uint8_t *dst, uint8_t *tmp, int W, int H, int N){
+    if(W < 1 || H < 1 || !dst || (N > 1 && !tmp && dst != image)) return NULL;
+    if(W < MINWIDTH || H < MINHEIGHT || N < 1){
+        if(dst != image) memcpy(dst, image, ((W + 7) / 8) * H);
+        return dst;
+    }
+    if(dst == image) return morphN(image, dst, W, H, N, MORPH_EROSION, 0, MORPH_RESULT);
+    uint8_t *cur = image;
+    for(int i = 0; i < N; ++i){
+        uint8_t *next = PINGPONG(i, N, dst, tmp);
+        il_erosion_to(cur, next, W, H);
+        cur = next;
+    }
+    return dst;
+}
+
+// Make il_dilation N times into `dst` using `tmp` as intermediate buffer (could be NULL if N < 2 or in-place)
+uint8_t *il_dilationN_to(uint8_t *image, uint8_t *dst, uint8_t *tmp, int W, int H, int N){
+    if(W < 1 || H < 1 || !dst || (N > 1 && !tmp && dst != image)) return NULL;
+    if(W < MINWIDTH || H < MINHEIGHT || N < 1){
+        if(dst != image) memcpy(dst, image, ((W + 7) / 8) * H);
+        return dst;
+    }
+    if(dst == image) return morphN(image, dst, W, H, N, MORPH_DILATION, 0, MORPH_RESULT);
+    uint8_t *cur = image;
+    for(int i = 0; i < N; ++i){
+        uint8_t *next = PINGPONG(i, N, dst, tmp);
+        il_dilation_to(cur, next, W, H);
+        cur = next;
+    }
+    return dst;
+}
+
 // Ntimes opening
 uint8_t *il_openingN(uint8_t *image, int W, int H, int N){
     //FNAME();
     if(W < MINWIDTH || H < MINHEIGHT || N < 1) return NULL;
-    uint8_t *er = il_erosionN(image, W, H, N);
-    uint8_t *op = il_dilationN(er, W, H, N);
-    FREE(er);
-    return op;
+    uint8_t *op = MALLOC(uint8_t, ((W + 7) / 8) * H);
+    return il_openingN_to(image, op, W, H, N);
 }
 
 // Ntimes closing
 uint8_t *il_closingN(uint8_t *image, int W, int H, int N){
     //FNAME();
     if(W < MINWIDTH || H < MINHEIGHT || N < 1) return NULL;
-    uint8_t *di = il_dilationN(image, W, H, N);
-    uint8_t *cl = il_erosionN(di, W, H, N);
-    FREE(di);
-    return cl;
+    uint8_t *cl = MALLOC(uint8_t, ((W + 7) / 8) * H);
+    return il_closingN_to(image, cl, W, H, N);
 }
 
 // top hat operation: image - opening(image)
 uint8_t *il_topHat(uint8_t *image, int W, int H, int N){
     //FNAME();
     if(W < MINWIDTH || H < MINHEIGHT || N < 1) return NULL;
-    uint8_t *op = il_openingN(image, W, H, N);
-    int W0 = (W + 7) / 8; // width in bytes
-    int wh = W0 * H;
-    OMP_FOR()
-    for(int i = 0; i < wh; ++i)
-        op[i] = image[i] & (~op[i]);
-    return op;
+    uint8_t *op = MALLOC(uint8_t, ((W + 7) / 8) * H);
+    return il_topHat_to(image, op, W, H, N);
 }
 
 // bottom hat operation: closing(image) - image
 uint8_t *il_botHat(uint8_t *image, int W, int H, int N){
     //FNAME();
     if(W < MINWIDTH || H < MINHEIGHT || N < 1) return NULL;
-    uint8_t *op = il_closingN(image, W, H, N);
-    int W0 = (W + 7) / 8; // width in bytes
-    int wh = W0 * H;
-    OMP_FOR()
-    for(int i = 0; i < wh; ++i)
-        op[i] &= ~image[i];
-    return op;
+    uint8_t *op = MALLOC(uint8_t, ((W + 7) / 8) * H);
+    return il_botHat_to(image, op, W, H, N);
+}
+
+// fused Ntimes opening into `dst` (could be `image`): rows pass through 2N rolling windows of 3 rows
+uint8_t *il_openingN_to(uint8_t *image, uint8_t *dst, int W, int H, int N){
+    if(W < MINWIDTH || H < MINHEIGHT || N < 1 || !dst) return NULL;
+    return morphN(image, dst, W, H, N, MORPH_EROSION, N, MORPH_RESULT);
+}
+
+// fused Ntimes closing into `dst` (could be `image`)
+uint8_t *il_closingN_to(uint8_t *image, uint8_t *dst, int W, int H, int N){
+    if(W < MINWIDTH || H < MINHEIGHT || N < 1 || !dst) return NULL;
+    return morphN(image, dst, W, H, N, MORPH_DILATION, N, MORPH_RESULT);
+}
+
+// fused top hat into `dst` (could be `image`)
+uint8_t *il_topHat_to(uint8_t *image, uint8_t *dst, int W, int H, int N){
+    if(W < MINWIDTH || H < MINHEIGHT || N < 1 || !dst) return NULL;
+    return morphN(image, dst, W, H, N, MORPH_EROSION, N, MORPH_IMAGE_MINUS);
+}
+
+// fused bottom hat into `dst` (could be `image`)
+uint8_t *il_botHat_to(uint8_t *image, uint8_t *dst, int W, int H, int N){
+    if(W < MINWIDTH || H < MINHEIGHT || N < 1 || !dst) return NULL;
+    return morphN(image, dst, W, H, N, MORPH_DILATION, N, MORPH_MINUS_IMAGE);
 }
 
 /*
@@ -274,24 +690,25 @@ uint8_t *il_botHat(uint8_t *image, int W, int H, int N){
 /*
  * =================== LOGICAL OPERATIONS ===================>
  */
-#if 0
 /**
  * Logical AND of two images
  * @param im1, im2 (i) - two images
  * @param W, H         - their size (of course, equal for both images)
  * @return allocated memory area with   image = (im1 AND im2)
  */
-uint8_t *imand(uint8_t *im1, uint8_t *im2, int W, int H){
-    uint8_t *ret = MALLOC(uint8_t, W*H);
-    int y;
+uint8_t *il_imand(uint8_t *im1, uint8_t *im2, int W, int H){
+    uint8_t *ret = MALLOC(uint8_t, ((W + 7) / 8) * H);
+    return il_imand_to(im1, im2, ret, W, H);
+}
+
+// image = (im1 AND im2) into `dst` (could be one of inputs)
+uint8_t *il_imand_to(const uint8_t *im1, const uint8_t *im2, uint8_t *dst, int W, int H){
+    if(!im1 || !im2 || !dst || W < 1 || H < 1) return NULL;
+    int wh = ((W + 7) / 8) * H;
     OMP_FOR()
-    for(y = 0; y < H; y++){
-        int x, S = y*W;
-        uint8_t *rptr = &ret[S], *p1 = &im1[S], *p2 = &im2[S];
-        for(x = 0; x < W; x++)
-            *rptr++ = *p1++ & *p2++;
-    }
-    return ret;
+    for(int i = 0; i < wh; ++i)
+        dst[i] = im1[i] & im2[i];
+    return dst;
 }
 
 /**
@@ -300,19 +717,20 @@ uint8_t *imand(uint8_t *im1, uint8_t *im2, int W, int H){
  * @param W, H         - their size (of course, equal for both images)
  * @return allocated memory area with    image = (im1 AND (!im2))
  */
-uint8_t *substim(uint8_t *im1, uint8_t *im2, int W, int H){
-    uint8_t *ret = MALLOC(uint8_t, W*H);
-    int y;
+uint8_t *il_substim(uint8_t *im1, uint8_t *im2, int W, int H){
+    uint8_t *ret = MALLOC(uint8_t, ((W + 7) / 8) * H);
+    return il_substim_to(im1, im2, ret, W, H);
+}
+
+// image = (im1 AND (!im2)) into `dst` (could be one of inputs)
+uint8_t *il_substim_to(const uint8_t *im1, const uint8_t *im2, uint8_t *dst, int W, int H){
+    if(!im1 || !im2 || !dst || W < 1 || H < 1) return NULL;
+    int wh = ((W + 7) / 8) * H;
     OMP_FOR()
-    for(y = 0; y < H; y++){
-        int x, S = y*W;
-        uint8_t *rptr = &ret[S], *p1 = &im1[S], *p2 = &im2[S];
-        for(x = 0; x < W; x++)
-            *rptr++ = *p1++ & (~*p2++);
-    }
-    return ret;
+    for(int i = 0; i < wh; ++i)
+        dst[i] = im1[i] & ~im2[i];
+    return dst;
 }
-#endif
 /*
  * <=================== LOGICAL OPERATIONS ===================
  */
@@ -345,6 +763,27 @@ static inline void remark(size_t newval, size_t oldval, size_t *assoc){
     }
 }
 
+// common part of il_cclabel4 and il_cclabel8: labels and boxes in heap
+static size_t *cclabel(uint8_t *Img, int W, int H, il_ConnComps **CC, bool conn8){
+    if(W < MINWIDTH || H < MINHEIGHT) return NULL;
+    il_Arena a = {0};
+    il_ConnComps cc;
+    size_t *labels = MALLOC(size_t, W*H);
+    if(!(conn8 ? il_cclabel8_to(Img, W, H, labels, &cc, &a) : il_cclabel4_to(Img, W, H, labels, &cc, &a))){
+        FREE(labels);
+        il_Arena_free(&a);
+        return NULL;
+    }
+    if(CC){
+        *CC = MALLOC(il_ConnComps, 1);
+        (*CC)->Nobj = cc.Nobj;
+        (*CC)->boxes = MALLOC(il_Box, cc.Nobj);
+        memcpy((*CC)->boxes, cc.boxes, cc.Nobj * sizeof(il_Box));
+    }
+    il_Arena_free(&a);
+    return labels;
+}
+
 /**
  * label 4-connected components on image
  * (slow algorythm, but easy to parallel)
@@ -355,23 +794,65 @@ static inline void remark(size_t newval, size_t oldval, size_t *assoc){
  * @return an array of labeled components
  */
 size_t *il_cclabel4(uint8_t *Img, int W, int H, il_ConnComps **CC){
+    return cclabel(Img, W, H, CC, false);
+}
+
+// the same for 8-connected components (single pixels are removed)
+size_t *il_cclabel8(uint8_t *Img, int W, int H, il_ConnComps **CC){
+    return cclabel(Img, W, H, CC, true);
+}
+
+/**
+ * label 4- or 8-connected components on image without heap allocations;
+ * pixels which can't belong to any component (non 4-connected or single) are
+ * filtered out on the fly, so image stays untouched
+ *
+ * @param I (i)      - image ("packed")
+ * @param W,H        - size of the image (W - width in pixels)
+ * @param labels (o) - labeled components (W*H elements)
+ * @param CC (o)     - connected components boxes (allocated in arena, could be NULL)
+ * @param a          - arena for temporary arrays and boxes
+ * @return labels or NULL if failed
+ */
+static size_t *cclabel_to(uint8_t *Img, int W, int H, size_t *labels, il_ConnComps *CC, il_Arena *a, bool conn8){
     size_t *assoc;
-    if(W < MINWIDTH || H < MINHEIGHT) return NULL;
-    uint8_t *f = il_filter4(Img, W, H); // remove all non 4-connected pixels
-    //DBG("convert to size_t");
-    size_t *labels = bin2ST(f, W, H);
-    FREE(f);
-    //DBG("Calculate");
-    size_t Nmax = W*H/4; // max number of 4-connected labels
-    assoc = MALLOC(size_t, Nmax); // allocate memory for "remark" array
+    if(W < MINWIDTH || H < MINHEIGHT || !labels || !a) return NULL;
+    int W0 = (W + 7) / 8;
+    lastmasks m = get_lastmasks(W);
+    // zero row for borders and current row of filtered pixels
+    uint8_t *zero = il_Arena_calloc(a, W0, 1), *frow = il_Arena_alloc(a, W0);
+    morph_op filter = conn8 ? MORPH_FILTER8 : MORPH_FILTER4;
+    size_t Nmax = W*H/4; // max number of temporary labels (for 8-connected it's even less)
+    assoc = il_Arena_alloc(a, Nmax * sizeof(size_t)); // allocate memory for "remark" array
     size_t last_assoc_idx = 1; // last index filled in assoc array
     for(int y = 0; y < H; ++y){
+        // remove all non 4-connected (or single) pixels of current row
+        const uint8_t *irow = &Img[y*W0];
+        morph_row(filter, y ? irow - W0 : zero, irow, (y < H-1) ? irow + W0 : zero, frow, W0, m);
         bool found = false;
         size_t *ptr = &labels[y*W];
         size_t curmark = 0; // mark of pixel to the left
         for(int x = 0; x < W; ++x, ++ptr){
-            if(!*ptr){found = false; continue;} // empty pixel
+            uint8_t byte = frow[x >> 3];
+            if(!byte && !(x & 7) && x + 8 <= W){ // 8 empty pixels
+                memset(ptr, 0, 8 * sizeof(size_t));
+                ptr += 7; x += 7;
+                found = false;
+                continue;
+            }
+            if(!(byte & (0x80 >> (x & 7)))){*ptr = 0; found = false; continue;} // empty pixel
             size_t U = (y) ? ptr[-W] : 0; // upper mark
+            // diagonal neighbours matter only when there's no upper one (else they're already
+            // connected with it); upper-left one is connected with left pixel if it exists
+            if(conn8 && !U && y){
+                size_t UR = (x < W-1) ? ptr[-W+1] : 0;
+                size_t UL = (!found && x) ? ptr[-W-1] : 0;
+                if(UL && UR && UL != UR){
+                    TEST("(%d, %d): remark %zd --> %zd\n", x, y, UR, UL);
+                    remark(UR, UL, assoc);
+                }
+                U = UL ? UL : UR;
+            }
             if(found){ // there's a pixel to the left
                 if(U && U != curmark){ // meet old mark -> remark one of them in assoc[]
                     TEST("(%d, %d): remark %zd --> %zd\n", x, y, U, curmark);
@@ -390,7 +871,7 @@ size_t *il_cclabel4(uint8_t *Img, int W, int H, il_ConnComps **CC){
             *ptr = curmark;
         }
     }
-    size_t *indexes = MALLOC(size_t, last_assoc_idx); // new indexes
+    size_t *indexes = il_Arena_calloc(a, last_assoc_idx, sizeof(size_t)); // new indexes
     size_t cidx = 1;
     TEST("\n\n\nRebuild indexes\n\n");
     for(size_t i = 1; i < last_assoc_idx; ++i){
@@ -422,15 +903,18 @@ size_t *il_cclabel4(uint8_t *Img, int W, int H, il_ConnComps **CC){
     for(size_t i = 1; i < last_assoc_idx; ++i)
         printf("%zd\t%zd\t%zd\n",i,assoc[i],indexes[i]);
     #endif
-    il_Box *boxes = MALLOC(il_Box, cidx);
+    il_Box *boxes = il_Arena_calloc(a, cidx, sizeof(il_Box));
     OMP_FOR()
     for(size_t i = 1; i < cidx; ++i){ // init borders
         boxes[i].xmin = W;
         boxes[i].ymin = H;
     }
-#pragma omp parallel shared(boxes)
+    // per-thread boxes are taken from arena before parallel section
+    int nthreads = omp_get_max_threads();
+    il_Box *t_boxes = il_Arena_calloc(a, cidx * nthreads, sizeof(il_Box));
+#pragma omp parallel shared(boxes) num_threads(nthreads)
     {
-        il_Box *l_boxes = MALLOC(il_Box, cidx);
+        il_Box *l_boxes = &t_boxes[cidx * omp_get_thread_num()];
         for(size_t i = 1; i < cidx; ++i){ // init borders
             l_boxes[i].xmin = W;
             l_boxes[i].ymin = H;
@@ -459,10 +943,7 @@ size_t *il_cclabel4(uint8_t *Img, int W, int H, il_ConnComps **CC){
                 if(ob->ymin > ib->ymin) ob->ymin = ib->ymin;
                 ob->area += ib->area;
             }
-        FREE(l_boxes);
     }
-    FREE(assoc);
-    FREE(indexes);
 #ifdef TESTMSGS
     for(size_t i = 1; i < cidx; ++i){
         printf("%8zd\t%6d\t(%4d..%4d, %4d..%4d)\t%.2f\n", i, boxes[i].area,
@@ -471,24 +952,18 @@ size_t *il_cclabel4(uint8_t *Img, int W, int H, il_ConnComps **CC){
     }printf("\n\n");
 #endif
     if(CC){
-        *CC = MALLOC(il_ConnComps, 1);
-        (*CC)->Nobj = cidx; (*CC)->boxes = boxes;
-    }else{
-        FREE(boxes);
+        CC->Nobj = cidx; CC->boxes = boxes;
     }
     return labels;
 }
 
-#if 0
-// label 8-connected components, look cclabel4
-size_t *cclabel8(size_t *labels, int W, int H, size_t *Nobj){
-    if(W < MINWIDTH || H < MINHEIGHT) return NULL;
-    #define LABEL_8
-    #include "cclabling.h"
-    #undef LABEL_8
-    return labels;
+size_t *il_cclabel4_to(uint8_t *Img, int W, int H, size_t *labels, il_ConnComps *CC, il_Arena *a){
+    return cclabel_to(Img, W, H, labels, CC, a, false);
+}
+
+size_t *il_cclabel8_to(uint8_t *Img, int W, int H, size_t *labels, il_ConnComps *CC, il_Arena *a){
+    return cclabel_to(Img, W, H, labels, CC, a, true);
 }
-#endif
 
 /*
  * <=================== CONNECTED COMPONENTS LABELING ===================
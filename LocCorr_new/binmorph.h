@@ -43,6 +43,23 @@ typedef struct{
     il_Box *boxes;
 } il_ConnComps;
 
+// alignment of arena allocations
+#define IL_ARENA_ALIGN  (64)
+
+// scratch memory for temporary arrays of one frame: all allocations are released at once by il_Arena_reset()
+typedef struct{
+    uint8_t *base;      // main block
+    size_t size;        // its size
+    size_t used;        // occupied part of main block
+    size_t need;        // total size requested after last reset
+    void *extra;        // list of blocks allocated when main block was full
+} il_Arena;
+
+void il_Arena_reset(il_Arena *a, size_t size);
+void *il_Arena_alloc(il_Arena *a, size_t size);
+void *il_Arena_calloc(il_Arena *a, size_t nmemb, size_t size);
+void il_Arena_free(il_Arena *a);
+
 
 // morphological operations:
 uint8_t *il_dilation(uint8_t *image, int W, int H);
@@ -53,12 +70,34 @@ uint8_t *il_openingN(uint8_t *image, int W, int H, int N);
 uint8_t *il_closingN(uint8_t *image, int W, int H, int N);
 uint8_t *il_topHat(uint8_t *image, int W, int H, int N);
 uint8_t *il_botHat(uint8_t *image, int W, int H, int N);
+// the same with caller-provided output `dst` (and temporary `tmp` for N times operations), W0*H bytes each;
+// `dst` could be `image` (then `tmp` isn't used)
+uint8_t *il_dilation_to(uint8_t *image, uint8_t *dst, int W, int H);
+uint8_t *il_dilationN_to(uint8_t *image, uint8_t *dst, uint8_t *tmp, int W, int H, int N);
+uint8_t *il_erosion_to(uint8_t *image, uint8_t *dst, int W, int H);
+uint8_t *il_erosionN_to(uint8_t *image, uint8_t *dst, uint8_t *tmp, int W, int H, int N);
+// fused composites: rows are streamed through small windows without intermediate images
+uint8_t *il_openingN_to(uint8_t *image, uint8_t *dst, int W, int H, int N);
+uint8_t *il_closingN_to(uint8_t *image, uint8_t *dst, int W, int H, int N);
+uint8_t *il_topHat_to(uint8_t *image, uint8_t *dst, int W, int H, int N);
+uint8_t *il_botHat_to(uint8_t *image, uint8_t *dst, int W, int H, int N);
+
+// logical operations
+uint8_t *il_imand(uint8_t *im1, uint8_t *im2, int W, int H);
+uint8_t *il_substim(uint8_t *im1, uint8_t *im2, int W, int H);
+uint8_t *il_imand_to(const uint8_t *im1, const uint8_t *im2, uint8_t *dst, int W, int H);
+uint8_t *il_substim_to(const uint8_t *im1, const uint8_t *im2, uint8_t *dst, int W, int H);
 
 // clear non 4-connected pixels
 uint8_t *il_filter4(uint8_t *image, int W, int H);
 // clear single pixels
 uint8_t *il_filter8(uint8_t *image, int W, int H);
+uint8_t *il_filter4_to(uint8_t *image, uint8_t *dst, int W, int H);
+uint8_t *il_filter8_to(uint8_t *image, uint8_t *dst, int W, int H);
 
 size_t *il_cclabel4(uint8_t *Img, int W, int H, il_ConnComps **CC);
+size_t *il_cclabel4_to(uint8_t *Img, int W, int H, size_t *labels, il_ConnComps *CC, il_Arena *a);
+size_t *il_cclabel8(uint8_t *Img, int W, int H, il_ConnComps **CC);
+size_t *il_cclabel8_to(uint8_t *Img, int W, int H, size_t *labels, il_ConnComps *CC, il_Arena *a);
 
 #endif // BINMORPH_H__
@@ -0,0 +1,460 @@
+/*
+ * This file is part of the loccorr project.
+ * Copyright 2021 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <float.h> // FLT_EPSILON
+#include <glob.h>
+#include <libgen.h> // dirname
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "calib.h"
+#include "cmdlnopts.h"
+#include "config.h"
+#include "debug.h"
+#include "fits.h"
+#include "median.h"
+
+// master dark for one exptime/gain bucket
+typedef struct{
+    float exptime;      // exposition time and gain of darks
+    float gain;
+    int width;          // image size
+    int height;
+    int nframes;        // amount of combined frames
+    Imtype *dark;       // master dark
+    int Nbad;           // amount of bad (hot) pixels
+    int *badx;          // X coordinates of bad pixels (sorted by Y, then by X)
+    int *badrow;        // indexes of first bad pixel in each row in `badx` (H+1 values)
+} masterdark;
+
+static pthread_mutex_t dark_mutex = PTHREAD_MUTEX_INITIALIZER;
+static masterdark darks[DARK_BUCKETS] = {0};
+static int Ndarks = 0;      // amount of master darks
+static int lastbucket = 0;  // index of last replaced bucket
+static int lastused = -1;   // index of last applied dark
+
+// dark acquisition
+static struct{
+    int N;              // amount of frames to gather (0 - no acquisition)
+    int got;            // amount of gathered frames
+    float exptime;
+    float gain;
+    int width;
+    int height;
+    uint16_t *acc;      // accumulator
+} acq = {0};
+
+static void freedark(masterdark *d){
+    FREE(d->dark);
+    FREE(d->badx);
+    FREE(d->badrow);
+    memset(d, 0, sizeof(masterdark));
+}
+
+// find best master dark for given parameters; @return its index or -1
+static int finddark(int W, int H, float exptime, float gain){
+    int idx = -1;
+    float bestdiff = 0.f;
+    for(int i = 0; i < Ndarks; ++i){
+        masterdark *d = &darks[i];
+        if(d->width != W || d->height != H) continue;
+        if(fabsf(d->gain - gain) > DARK_GAINTOL) continue;
+        float diff = fabsf(d->exptime - exptime);
+        if(diff > DARK_EXPTOL * d->exptime) continue;
+        if(idx < 0 || diff < bestdiff){
+            idx = i; bestdiff = diff;
+        }
+    }
+    return idx;
+}
+
+/**
+ * @brief mkbadmap - find hot pixels of master dark: all pixels over median + theconf.hotthres
+ * @param d - master dark (with `dark` filled)
+ * @return FALSE if failed
+ */
+static int mkbadmap(masterdark *d){
+    int W = d->width, H = d->height, wh = W * H;
+    Imtype *tmp = MALLOC(Imtype, wh);
+    memcpy(tmp, d->dark, wh * sizeof(Imtype));
+    int thres = calc_median(tmp, wh) + theconf.hotthres;
+    FREE(tmp);
+    d->badrow = MALLOC(int, H + 1);
+    int Nbad = 0;
+    for(int i = 0; i < wh; ++i) if(d->dark[i] > thres) ++Nbad;
+    if(Nbad){
+        d->badx = MALLOC(int, Nbad);
+    }
+    d->Nbad = Nbad;
+    Nbad = 0;
+    for(int y = 0; y < H; ++y){
+        d->badrow[y] = Nbad;
+        const Imtype *drow = &d->dark[y*W];
+        for(int x = 0; x < W; ++x) if(drow[x] > thres) d->badx[Nbad++] = x;
+    }
+    d->badrow[H] = Nbad;
+    DBG("Dark median+thres=%d, %d hot pixels", thres, Nbad);
+    return TRUE;
+}
+
+/*
+ * Master darks are stored in directory of configuration file as FITS files
+ * DARK_PREFIX<exptime>_<gain>.fits: the first HDU is dark itself (rows in order of camera frames),
+ * the second (if there are hot pixels) - 2xNbad integer image with their (x, y) coordinates
+ */
+
+// directory of master darks
+static const char *darkdir(){
+    static char dir[FILENAME_MAX] = {0};
+    if(!*dir){
+        char conf[FILENAME_MAX];
+        snprintf(conf, FILENAME_MAX, "%s", (GP && GP->configname) ? GP->configname : DEFAULT_CONFFILE);
+        snprintf(dir, FILENAME_MAX, "%s", dirname(conf));
+    }
+    return dir;
+}
+
+static void darkfilename(char *buf, int buflen, const masterdark *d){
+    snprintf(buf, buflen, "%s/" DARK_PREFIX "%g_%g.fits", darkdir(), d->exptime, d->gain);
+}
+
+static void rmdarkfile(const masterdark *d){
+    char name[FILENAME_MAX];
+    darkfilename(name, FILENAME_MAX, d);
+    if(unlink(name) == 0) LOGMSG("Master dark %s removed", name);
+}
+
+// save master dark `d` (replace file with the same exptime and gain)
+static void savedark(const masterdark *d){
+    char name[FILENAME_MAX];
+    name[0] = '!'; // cfitsio: overwrite existing file
+    darkfilename(name + 1, FILENAME_MAX - 1, d);
+    int status = 0; // cfitsio functions do nothing when status isn't zero
+    fitsfile *fp;
+    long naxes[2] = {d->width, d->height};
+    float exptime = d->exptime, gain = d->gain;
+    int nframes = d->nframes;
+    fits_create_file(&fp, name, &status);
+    if(status) goto rtn;
+    fits_create_img(fp, BYTE_IMG, 2, naxes, &status);
+    fits_write_key(fp, TFLOAT, "EXPTIME", &exptime, "exposition time, ms", &status);
+    fits_write_key(fp, TFLOAT, "GAIN", &gain, "gain", &status);
+    fits_write_key(fp, TINT, "NFRAMES", &nframes, "amount of combined frames", &status);
+    fits_write_img(fp, TBYTE, 1, (long long)d->width * d->height, d->dark, &status);
+    if(d->Nbad){
+        long hn[2] = {2, d->Nbad};
+        int *xy = MALLOC(int, 2 * d->Nbad);
+        for(int y = 0; y < d->height; ++y)
+            for(int i = d->badrow[y]; i < d->badrow[y+1]; ++i){
+                xy[2*i] = d->badx[i]; xy[2*i+1] = y;
+            }
+        fits_create_img(fp, LONG_IMG, 2, hn, &status);
+        fits_write_key(fp, TSTRING, "EXTNAME", "HOTPIX", "(x, y) of hot pixels", &status);
+        fits_write_img(fp, TINT, 1, 2 * (long long)d->Nbad, xy, &status);
+        FREE(xy);
+    }
+    fits_close_file(fp, &status);
+rtn:
+    if(status){
+        fits_report_error(stderr, status);
+        LOGWARN("Can't save master dark %s", name + 1);
+    }else LOGMSG("Master dark saved to %s", name + 1);
+}
+
+/**
+ * @brief rdhotpix - read list of hot pixels from current HDU
+ * @return FALSE if failed or list is wrong
+ */
+static int rdhotpix(fitsfile *fp, masterdark *d, int *status){
+    int naxis = 0;
+    long hn[2] = {0};
+    fits_get_img_dim(fp, &naxis, status);
+    fits_get_img_size(fp, 2, hn, status);
+    if(*status || naxis != 2 || hn[0] != 2 || hn[1] < 1) return FALSE;
+    int Nbad = (int)hn[1], W = d->width, H = d->height;
+    int *xy = MALLOC(int, 2 * Nbad);
+    fits_read_img(fp, TINT, 1, 2 * (long long)Nbad, NULL, xy, NULL, status);
+    int ret = !*status;
+    d->badx = MALLOC(int, Nbad);
+    d->badrow = MALLOC(int, H + 1);
+    int y = 0, lasty = -1;
+    for(int i = 0; i < Nbad && ret; ++i){ // list is sorted by Y, then by X
+        int x = xy[2*i], yi = xy[2*i+1];
+        if(x < 0 || x >= W || yi < lasty || yi >= H || (yi == lasty && x <= d->badx[i-1])){ ret = FALSE; break; }
+        lasty = yi;
+        while(y <= yi) d->badrow[y++] = i;
+        d->badx[i] = x;
+    }
+    while(y <= H) d->badrow[y++] = Nbad;
+    d->Nbad = Nbad;
+    FREE(xy);
+    if(!ret){
+        FREE(d->badx); FREE(d->badrow);
+        d->Nbad = 0;
+    }
+    return ret;
+}
+
+/**
+ * @brief loaddark - read master dark from file
+ * @param name - file name
+ * @param d (o) - master dark
+ * @return FALSE if failed
+ */
+static int loaddark(const char *name, masterdark *d){
+    int status = 0, naxis = 0, nhdus = 0, hdutype;
+    long naxes[2] = {0};
+    fitsfile *fp;
+    memset(d, 0, sizeof(masterdark));
+    fits_open_file(&fp, name, READONLY, &status);
+    if(status){
+        fits_report_error(stderr, status);
+        return FALSE;
+    }
+    fits_get_img_dim(fp, &naxis, &status);
+    fits_get_img_size(fp, 2, naxes, &status);
+    fits_read_key(fp, TFLOAT, "EXPTIME", &d->exptime, NULL, &status);
+    fits_read_key(fp, TFLOAT, "GAIN", &d->gain, NULL, &status);
+    fits_read_key(fp, TINT, "NFRAMES", &d->nframes, NULL, &status);
+    if(!status && naxis == 2 && naxes[0] > 0 && naxes[1] > 0){
+        d->width = naxes[0];
+        d->height = naxes[1];
+        d->dark = MALLOC(Imtype, naxes[0] * naxes[1]);
+        fits_read_img(fp, TBYTE, 1, naxes[0] * naxes[1], NULL, d->dark, NULL, &status);
+    }
+    int ret = (!status && d->dark);
+    if(ret){ // hot pixels list or find them again if absent or broken
+        fits_get_num_hdus(fp, &nhdus, &status);
+        if(nhdus < 2 || fits_movabs_hdu(fp, 2, &hdutype, &status) || !rdhotpix(fp, d, &status)){
+            status = 0;
+            mkbadmap(d);
+        }
+    }else if(status) fits_report_error(stderr, status);
+    status = 0;
+    fits_close_file(fp, &status);
+    if(!ret) freedark(d);
+    return ret;
+}
+
+// store accumulated dark as master
+static void mkmaster(){
+    int idx = -1;
+    for(int i = 0; i < Ndarks; ++i){ // replace master dark with the same parameters
+        masterdark *d = &darks[i];
+        if(d->width == acq.width && d->height == acq.height && fabsf(d->exptime - acq.exptime) <= FLT_EPSILON
+            && fabsf(d->gain - acq.gain) <= FLT_EPSILON){ idx = i; break; }
+    }
+    if(idx < 0){ // new bucket
+        if(Ndarks < DARK_BUCKETS) idx = Ndarks++;
+        else{
+            idx = lastbucket++;
+            if(lastbucket >= DARK_BUCKETS) lastbucket = 0;
+            rmdarkfile(&darks[idx]); // the oldest one shouldn't return after restart
+        }
+    }
+    masterdark *d = &darks[idx];
+    freedark(d);
+    d->exptime = acq.exptime;
+    d->gain = acq.gain;
+    d->width = acq.width;
+    d->height = acq.height;
+    d->nframes = acq.N;
+    int wh = acq.width * acq.height, N = acq.N, N2 = N / 2;
+    d->dark = MALLOC(Imtype, wh);
+    OMP_FOR()
+    for(int i = 0; i < wh; ++i) d->dark[i] = (Imtype)((acq.acc[i] + N2) / N);
+    mkbadmap(d);
+    LOGMSG("New master dark #%d: exptime=%g, gain=%g, %dx%d, %d frames, %d hot pixels",
+        idx, d->exptime, d->gain, d->width, d->height, N, d->Nbad);
+    savedark(d);
+    FREE(acq.acc);
+    acq.N = 0;
+}
+
+// add next frame to accumulator
+static void accumulate(const Image *I, float exptime, float gain){
+    int wh = I->width * I->height;
+    if(acq.got && (acq.width != I->width || acq.height != I->height
+        || fabsf(acq.exptime - exptime) > FLT_EPSILON || fabsf(acq.gain - gain) > FLT_EPSILON)){
+        LOGWARN("Image parameters changed during dark acquisition; start again");
+        WARNX("Image parameters changed during dark acquisition; start again");
+        acq.got = 0;
+        FREE(acq.acc);
+    }
+    if(!acq.got){
+        acq.width = I->width;
+        acq.height = I->height;
+        acq.exptime = exptime;
+        acq.gain = gain;
+        acq.acc = MALLOC(uint16_t, wh);
+    }
+    uint16_t *acc = acq.acc;
+    const Imtype *data = I->data;
+    #pragma omp parallel for simd
+    for(int i = 0; i < wh; ++i) acc[i] += data[i];
+    DBG("Got %d dark of %d", acq.got + 1, acq.N);
+    if(++acq.got == acq.N) mkmaster();
+}
+
+/**
+ * @brief applydark - subtract master dark (saturating) and replace bad pixels by mean of nearest good neighbours
+ *      in one pass by rows
+ * @param I - image
+ * @param d - master dark
+ */
+static void applydark(Image *I, const masterdark *d){
+    int W = I->width, H = I->height;
+    OMP_FOR()
+    for(int y = 0; y < H; ++y){
+        Imtype *row = &I->data[y*W];
+        const Imtype *drow = &d->dark[y*W];
+        #pragma omp simd
+        for(int x = 0; x < W; ++x){
+            Imtype v = row[x], dk = drow[x];
+            row[x] = (v > dk) ? v - dk : 0;
+        }
+        int first = d->badrow[y], last = d->badrow[y+1];
+        for(int i = first; i < last; ++i){
+            int x = d->badx[i], l = x - 1, r = x + 1, il = i - 1, ir = i + 1;
+            // skip neighbouring bad pixels
+            while(l >= 0 && il >= first && d->badx[il] == l){ --l; --il; }
+            while(r < W && ir < last && d->badx[ir] == r){ ++r; ++ir; }
+            if(l >= 0 && r < W) row[x] = (row[l] + row[r] + 1) / 2;
+            else if(l >= 0) row[x] = row[l];
+            else if(r < W) row[x] = row[r];
+            else row[x] = 0;
+        }
+    }
+}
+
+/**
+ * @brief dark_process - calibrate image by master dark or add it to dark accumulator
+ * @param I - image
+ * @param exptime, gain - parameters of image
+ * @return TRUE if image consumed by dark acquisition (shouldn't be processed further)
+ */
+int dark_process(Image *I, float exptime, float gain){
+    if(!I || !I->data) return FALSE;
+    int ret = FALSE;
+    pthread_mutex_lock(&dark_mutex);
+    if(acq.N){
+        accumulate(I, exptime, gain);
+        ret = TRUE;
+    }else if(theconf.usedark){
+        lastused = finddark(I->width, I->height, exptime, gain);
+        if(lastused > -1){
+            applydark(I, &darks[lastused]);
+            Image_minmax(I);
+        }
+    }else lastused = -1;
+    pthread_mutex_unlock(&dark_mutex);
+    return ret;
+}
+
+/**
+ * @brief dark_acquire - start acquisition of new master dark
+ * @param nframes - amount of frames
+ * @return FALSE if `nframes` is wrong
+ */
+int dark_acquire(int nframes){
+    if(nframes < 1 || nframes > DARK_NMAX) return FALSE;
+    pthread_mutex_lock(&dark_mutex);
+    FREE(acq.acc);
+    acq.got = 0;
+    acq.N = nframes;
+    pthread_mutex_unlock(&dark_mutex);
+    LOGMSG("Start acquisition of %d darks", nframes);
+    return TRUE;
+}
+
+// remove all master darks and stop acquisition
+void dark_clear(){
+    pthread_mutex_lock(&dark_mutex);
+    for(int i = 0; i < Ndarks; ++i){
+        rmdarkfile(&darks[i]);
+        freedark(&darks[i]);
+    }
+    Ndarks = 0;
+    lastbucket = 0;
+    lastused = -1;
+    FREE(acq.acc);
+    acq.N = 0;
+    acq.got = 0;
+    pthread_mutex_unlock(&dark_mutex);
+    LOGMSG("All master darks cleared");
+}
+
+/**
+ * @brief dark_load - replace master darks by saved ones
+ * @return amount of loaded darks
+ */
+int dark_load(){
+    char pattern[FILENAME_MAX];
+    snprintf(pattern, FILENAME_MAX, "%s/" DARK_PREFIX "*.fits", darkdir());
+    glob_t g;
+    if(glob(pattern, 0, NULL, &g)){
+        DBG("No saved master darks");
+        return 0;
+    }
+    pthread_mutex_lock(&dark_mutex);
+    for(int i = 0; i < Ndarks; ++i) freedark(&darks[i]);
+    Ndarks = 0;
+    lastbucket = 0;
+    lastused = -1;
+    for(size_t i = 0; i < g.gl_pathc && Ndarks < DARK_BUCKETS; ++i){
+        masterdark *d = &darks[Ndarks];
+        if(!loaddark(g.gl_pathv[i], d)){
+            LOGWARN("Can't load master dark %s", g.gl_pathv[i]);
+            continue;
+        }
+        LOGMSG("Master dark %s loaded: exptime=%g, gain=%g, %dx%d, %d frames, %d hot pixels",
+            g.gl_pathv[i], d->exptime, d->gain, d->width, d->height, d->nframes, d->Nbad);
+        ++Ndarks;
+    }
+    int N = Ndarks;
+    pthread_mutex_unlock(&dark_mutex);
+    globfree(&g);
+    return N;
+}
+
+/**
+ * @brief darkstatus - return JSON with master darks status
+ * @param messageid - value of "messageid"
+ * @param buf       - buffer for string
+ * @param buflen    - length of `buf`
+ * @return buf
+ */
+char *darkstatus(const char *messageid, char *buf, int buflen){
+    if(!buf || buflen < 2) return NULL;
+    if(!messageid) messageid = "unknown";
+    pthread_mutex_lock(&dark_mutex);
+    int l = snprintf(buf, buflen, "{ \"%s\": \"%s\", \"usedark\": %d, \"acquiring\": %d, \"acquired\": %d, "
+            "\"applied\": %d, \"darks\": [", MESSAGEID, messageid, theconf.usedark, acq.N, acq.got, lastused);
+    for(int i = 0; i < Ndarks && l < buflen; ++i){
+        masterdark *d = &darks[i];
+        l += snprintf(buf + l, buflen - l, "%s{ \"exptime\": %g, \"gain\": %g, \"width\": %d, \"height\": %d, "
+            "\"nframes\": %d, \"hotpixels\": %d }", i ? ", " : "", d->exptime, d->gain,
+            d->width, d->height, d->nframes, d->Nbad);
+    }
+    if(l < buflen) snprintf(buf + l, buflen - l, "] }\n");
+    pthread_mutex_unlock(&dark_mutex);
+    return buf;
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of the loccorr project.
+ * Copyright 2021 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#ifndef CALIB_H__
+#define CALIB_H__
+
+#include "imagefile.h"
+
+// max amount of master darks (exptime/gain buckets)
+#define DARK_BUCKETS        (8)
+// max amount of frames to combine into master dark (sum should fit into uint16_t)
+#define DARK_NMAX           (256)
+// relative exptime tolerance for choosing dark: |t-tdark|/tdark < DARK_EXPTOL
+#define DARK_EXPTOL         (0.1)
+// gain tolerance (absolute)
+#define DARK_GAINTOL        (0.5)
+// prefix of master darks files (in directory of configuration file)
+#define DARK_PREFIX         "dark_"
+
+int dark_process(Image *I, float exptime, float gain);
+int dark_acquire(int nframes);
+void dark_clear();
+int dark_load();
+char *darkstatus(const char *messageid, char *buf, int buflen);
+
+#endif // CALIB_H__
@@ -17,12 +17,16 @@
  */
 
 #include <float.h> // FLT_EPSILON
+#include <inttypes.h> // PRIu64
 #include <math.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "calib.h"
 #include "cameracapture.h"
 #include "cmdlnopts.h"
 #include "config.h"
@@ -47,10 +51,27 @@ static frameformat stepformat;
 typedef struct{
     Imtype minval, maxval, bkg;
     float avg, xc, yc;
+    float fxc, fyc; // fast (unstacked) centroid
     ptstat_t stat;
 } imdata_t;
 
-static imdata_t lastimdata = {0};
+static imdata_t lastimdata = {.fxc = -1.f, .fyc = -1.f};
+
+// frames co-adding
+static struct{
+    int N;              // amount of accumulated frames
+    int width;          // size of frames
+    int height;
+    float xref;         // fast centroid of first frame (for shift-and-add)
+    float yref;
+    double tstart;      // exposure start of first frame
+    float exptime;      // exposition and gain of all frames in stack
+    float gain;
+    uint16_t *acc;      // accumulator
+    uint16_t *cnt;      // amount of frames added to each pixel (NULL if frames aren't shifted)
+} coadd = {0};
+static _Atomic uint64_t Nstacked = 0; // amount of stacked frames processed
+static _Atomic uint64_t Ndropped = 0; // amount of frames lost by camera/driver or not processed
 
 static void changeformat(){
     if(!theCam) return;
@@ -110,130 +131,203 @@ void camdisconnect(){
     if(theCam) theCam->disconnect();
 }
 
-static void calcexpgain(float newexp){
-    DBG("recalculate exposition: oldexp=%g, oldgain=%g, newexp=%g", exptime, gain, newexp);
-    float newgain = gain;
-#if 0
-    while(newexp*1.25 > theconf.minexp){ // increase gain first
-        if(newgain < gainmax - 0.9999){
-            newgain += 1.;
-            newexp /= 1.25;
-        }else break;
-    }
-    while(newexp < theconf.minexp){
-        if(1.25*newexp < theconf.maxexp && newgain > 0.9999){
-            newgain -= 1.;
-            newexp *= 1.25;
-        }else break;
-    }
-#endif
-    if(newexp > exptime){ // need to increase exptime - try to increase gain first
-        if(newgain < gainmax - 0.9999f){
-            newgain += 1.f;
-            newexp = exptime; // leave exptime unchanged
-        }else if(newgain < gainmax) newgain = gainmax;
-    }else{ // decrease -> decrease gain if exptime too small
-        if(newexp < theconf.minexp){
-            if(newgain > 1.f) newgain -= 1.f;
-            else newgain = 0.f;
-        }
-    }
+// gain in camera units -> amplification factor and back
+static double gain2amp(float g){
+    if(theCam->lineargain) return (g > 1.f) ? g : 1.;
+    return pow(10., g / 20.);
+}
+static float amp2gain(double a){
+    if(theCam->lineargain) return (a > 1.) ? (float)a : 1.f;
+    return (a > 1.) ? (float)(20. * log10(a)) : 0.f;
+}
 
-    if(newexp < theconf.minexp) newexp = theconf.minexp;
-    else if(newexp > theconf.maxexp) newexp = theconf.maxexp;
-    LOGDBG("recalc exp from %g to %g; gain from %g to %g", exptime, newexp, gain, newgain);
+/**
+ * @brief autoexp - calculate exposition and gain in one step by tracked star photometry
+ *      (signal is linear by exptime*amplification, so needed factor is target/peak)
+ * @param I - processed image with photometry of tracked star in I->stat
+ */
+static void autoexp(const Image *I){
+    // frame captured before last change of parameters: wait for new ones
+    if(fabsf(I->exptime - exptime) > FLT_EPSILON || fabsf(I->gain - gain) > FLT_EPSILON) return;
+    int havestar = (I->stat.flux > 0.f);
+    double peak = havestar ? I->stat.peak : I->maxval; // without star only brightest pixel is known
+    double k, signal = peak - I->background;
+    if(signal < 1.) signal = 1.;
+    if(peak >= HISTOSZ - 2) k = AUTOEXP_SATUR; // saturated: real peak is unknown
+    else k = theconf.exppeak / signal;
+    double kmax = havestar ? AUTOEXP_KMAX : AUTOEXP_KNOSTAR;
+    if(k > kmax) k = kmax;
+    else if(k < 1. / kmax) k = 1. / kmax;
+    if(k < 1. + theconf.exphyst && k > 1. / (1. + theconf.exphyst)) return; // good enough
+    // needed exptime at minimal gain; use gain only when exptime is over maximum
+    double total = I->exptime * gain2amp(I->gain) * k;
+    float newexp = (float)total, newgain = amp2gain(1.);
+    if(newexp > theconf.maxexp){
+        newexp = theconf.maxexp;
+        newgain = amp2gain(total / theconf.maxexp);
+        if(newgain > gainmax) newgain = gainmax;
+    }else if(newexp < theconf.minexp) newexp = theconf.minexp;
+    DBG("peak=%g, bkg=%d, star=%d, k=%g: exp %g -> %g, gain %g -> %g", peak, I->background,
+        havestar, k, exptime, newexp, gain, newgain);
+    LOGDBG("autoexp: peak=%g, k=%g; exp from %g to %g; gain from %g to %g", peak, k, exptime, newexp, gain, newgain);
     exptime = newexp;
     gain = newgain;
-    DBG("New values: exp=%g, gain=%g", exptime, gain);
 }
 
-//convertedImage.pData, convertedImage.cols, convertedImage.rows, convertedImage.stride
-static void recalcexp(Image *I){
-#ifdef EBUG
-    green("RECALCEXP\n"); fflush(stdout);
-#endif
-    // check if user changed exposition values
-    if(exptime < theconf.minexp){
-        exptime = theconf.minexp;
-        LOGDBG("recalcexp(): minimal exptime");
-        return;
-    }
-    else if(exptime > theconf.maxexp){
-        exptime = theconf.maxexp;
-        LOGDBG("recalcexp(): maximal exptime");
-        return;
+/*
+ * calculate fast centroid on each captured frame; it is used to shift frames before co-adding
+ * and to calculate corrections without delay of stacking (if `fastcorr`)
+ */
+static void fastcentroid(Image *I){
+    float x = lastimdata.fxc, y = lastimdata.fyc;
+    if(x < 0.f || y < 0.f){ // lost: start from last full-processed centroid
+        getcenter(&x, &y);
+        x -= theconf.xoff; y -= theconf.yoff;
     }
-    size_t histogram[HISTOSZ];
-    if(!get_histogram(I, histogram)){
-        WARNX("Can't calculate histogram");
-        LOGWARN("recalcexp(): can't calculate histogram");
-        return;
+    if(!quickCentroid(I, &x, &y)) x = y = -1.f;
+    lastimdata.fxc = x; lastimdata.fyc = y;
+}
+
+static void coadd_reset(){
+    FREE(coadd.acc);
+    FREE(coadd.cnt);
+    coadd.N = 0;
+}
+
+/**
+ * @brief coadd_frame - add next frame into co-adding accumulator (shifted by fast centroid if `coaddshift`)
+ * @param I - captured frame
+ * @return mean of `ncoadd` frames or NULL if not ready yet
+ */
+static Image *coadd_frame(const Image *I){
+    int W = I->width, H = I->height, wh = W * H;
+    if(coadd.N && (coadd.width != W || coadd.height != H || !coadd.cnt != !theconf.coaddshift ||
+        fabsf(coadd.exptime - I->exptime) > FLT_EPSILON || fabsf(coadd.gain - I->gain) > FLT_EPSILON)){
+        DBG("Parameters changed: start new stack");
+        coadd_reset();
     }
-    int idx100;
-    size_t sum100 = 0;
-    for(idx100 = HISTOSZ-1; idx100 >= 0; --idx100){
-        sum100 += histogram[idx100];
-        if(sum100 > 100) break;
+    if(!coadd.N){
+        coadd.acc = MALLOC(uint16_t, wh);
+        if(theconf.coaddshift){
+            coadd.cnt = MALLOC(uint16_t, wh);
+        }
+        coadd.width = W;
+        coadd.height = H;
+        coadd.xref = lastimdata.fxc;
+        coadd.yref = lastimdata.fyc;
+        coadd.tstart = I->tstart;
+        coadd.exptime = I->exptime;
+        coadd.gain = I->gain;
     }
-    DBG("Sum100=%zd, idx100=%d", sum100, idx100);
-    if(idx100 > 230 && idx100 < 253){
-        DBG("idx100=%d - good", idx100);
-        return; // good values
+    int dx = 0, dy = 0;
+    if(coadd.cnt && coadd.xref >= 0.f && lastimdata.fxc >= 0.f){
+        dx = (int)roundf(coadd.xref - lastimdata.fxc);
+        dy = (int)roundf(coadd.yref - lastimdata.fyc);
+        if(I->orient == IMORIENT_TOPDOWN) dy = -dy; // centroids are in FITS coordinates
+        if(abs(dx) >= W || abs(dy) >= H) dx = dy = 0;
     }
-    if(idx100 > 253){ // exposure too long
-        DBG("Exp too long");
-        calcexpgain(exptime * 0.3f);
-    }else{ // exposure too short
-        if(idx100 > 5){
-            DBG("Exp too short");
-            calcexpgain(exptime * 230.f / (float)idx100);
-        }else{
-            DBG("increase exptime 50 times");
-            calcexpgain(exptime * 50.f);
+    // acc(x, y) += I(x - dx, y - dy)
+    int xmin = (dx > 0) ? dx : 0, xmax = (dx < 0) ? W + dx : W;
+    int ymin = (dy > 0) ? dy : 0, ymax = (dy < 0) ? H + dy : H;
+    uint16_t *acc = coadd.acc, *cnt = coadd.cnt;
+    OMP_FOR()
+    for(int y = ymin; y < ymax; ++y){
+        uint16_t *arow = &acc[y*W];
+        const Imtype *irow = &I->data[(y - dy)*W - dx];
+        #pragma omp simd
+        for(int x = xmin; x < xmax; ++x) arow[x] += irow[x];
+        if(cnt){ // pixels out of [xmin, xmax)x[ymin, ymax) have less frames
+            uint16_t *crow = &cnt[y*W];
+            #pragma omp simd
+            for(int x = xmin; x < xmax; ++x) ++crow[x];
         }
     }
+    if(++coadd.N < theconf.ncoadd) return NULL;
+    DBG("Stack of %d frames ready", coadd.N);
+    Image *S = Image_new(W, H);
+    S->orient = I->orient;
+    S->tstart = coadd.tstart;
+    S->tend = I->tend;
+    S->exptime = coadd.exptime; // the same for all frames
+    S->gain = coadd.gain;
+    int N = coadd.N, N2 = N / 2;
+    Imtype *data = S->data;
+    if(cnt){
+        #pragma omp parallel for simd
+        for(int i = 0; i < wh; ++i) data[i] = cnt[i] ? (Imtype)((acc[i] + cnt[i]/2) / cnt[i]) : 0;
+    }else{
+        #pragma omp parallel for simd
+        for(int i = 0; i < wh; ++i) data[i] = (Imtype)((acc[i] + N2) / N);
+    }
+    Image_minmax(S);
+    coadd_reset();
+    ++Nstacked;
+    return S;
+}
+
+void framering_init(framering *r){
+    memset(r, 0, sizeof(framering));
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->cond, NULL);
 }
 
-static int needs_exposure_adjustment(const Image *I, float curr_x, float curr_y) {
-    static float last_avg_intensity = -1.f;
-    static float last_centroid_x = -1.f, last_centroid_y = -1.f;
-    float avg = I->avg_intensity;
-    float dx = fabsf(curr_x - last_centroid_x);
-    float dy = fabsf(curr_y - last_centroid_y);
-    //LOGDBG("avg: %g, curr_x: %g, curr_y: %g", avg, curr_x, curr_y);
-    // don't change brightness if average value in 5..50
-    if(avg > 5.f && avg < 50.f){
-        last_avg_intensity = avg;
-        return FALSE;
+/**
+ * @brief framering_put - put next frame into ring (the oldest frame is thrown away if ring is full)
+ * @param r - ring
+ * @param I - frame (ring takes ownership)
+ * @return TRUE if the oldest frame was thrown away
+ */
+int framering_put(framering *r, Image *I){
+    if(!r || !I) return FALSE;
+    int dropped = FALSE;
+    pthread_mutex_lock(&r->mutex);
+    if(r->head - r->tail >= FRAMERING_LEN){ // overflow: will be seen as gap in `seqno`
+        Image_free(&r->frames[r->tail % FRAMERING_LEN]);
+        ++r->tail;
+        dropped = TRUE;
     }
-    // Adjust if intensity changes >10% or centroid moves >20px or no x/y centroids
-    if(curr_x < 0.f || curr_y < 0.f){ // star wasn't detected
-        int ret = FALSE;
-        if(fabsf(avg - last_avg_intensity) > 0.1f * last_avg_intensity ||
-            avg < 0.001f || avg > 200.f){
-            LOGDBG("Need adj: image too bad");
-            ret = TRUE;
-        }
-        last_avg_intensity = avg;
-        return ret;
+    r->frames[r->head++ % FRAMERING_LEN] = I;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+    return dropped;
+}
+
+/**
+ * @brief framering_get - get the oldest frame from ring
+ * @param r - ring
+ * @param timeout - max time to wait for frame, seconds
+ * @return frame or NULL if timeout
+ */
+Image *framering_get(framering *r, double timeout){
+    if(!r) return NULL;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    double t = ts.tv_sec + ts.tv_nsec * 1e-9 + timeout;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - (double)ts.tv_sec) * 1e9);
+    Image *I = NULL;
+    pthread_mutex_lock(&r->mutex);
+    while(r->head == r->tail){
+        if(pthread_cond_timedwait(&r->cond, &r->mutex, &ts)) break;
     }
-    if(fabsf(avg - last_avg_intensity) > 0.1f * last_avg_intensity ||
-        dx > 20.f || dy > 20.f){
-        DBG("avg_cur=%g, avg_last=%g, dx=%g, dy=%g", avg, last_avg_intensity, dx, dy);
-        LOGDBG("avg_cur=%g, avg_last=%g, dx=%g, dy=%g", avg, last_avg_intensity, dx, dy);
-        last_avg_intensity = avg;
-        last_centroid_x = curr_x;
-        last_centroid_y = curr_y;
-        LOGDBG("Need adj: changed conditions");
-        return TRUE;
+    if(r->head != r->tail){
+        I = r->frames[r->tail % FRAMERING_LEN];
+        r->frames[r->tail++ % FRAMERING_LEN] = NULL;
     }
-    return FALSE;
+    pthread_mutex_unlock(&r->mutex);
+    return I;
+}
+
+// throw away all frames (e.g. after exposure changed)
+void framering_clear(framering *r){
+    if(!r) return;
+    pthread_mutex_lock(&r->mutex);
+    for(; r->tail != r->head; ++r->tail) Image_free(&r->frames[r->tail % FRAMERING_LEN]);
+    pthread_mutex_unlock(&r->mutex);
 }
 
-static pthread_mutex_t capt_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int iCaptured = -1; // index of last captured image
-static Image* Icap[2] = {0}; // buffer for last captured images
-// main capture thread fills empty buffers and wait until processed thread free's one of them
+static framering procring; // captured frames waiting for processing
+// main capture thread puts frames into ring (throwing away the oldest if processing is too slow)
 static void *procthread(void* v){
     typedef void (*procfn_t)(Image*);
     void (*process)(Image*) = (procfn_t)v;
@@ -242,12 +336,24 @@ static void *procthread(void* v){
     int imno = 0;
 #endif
     while(!stopwork){
-        pthread_mutex_lock(&capt_mutex);
-        if(Icap[iCaptured]){
-            DBG("===== got image #%d, iCaptured=#%d @ %g", imno++, iCaptured, sl_dtime() - t0);
-            Image *oIma = Icap[iCaptured]; // take image here and free buffer
-            Icap[iCaptured] = NULL;
-            pthread_mutex_unlock(&capt_mutex);
+        Image *oIma = framering_get(&procring, PROCRING_TIMEOUT);
+        if(oIma){
+            DBG("===== got image #%d @ %g", imno++, sl_dtime() - t0);
+            if(dark_process(oIma, oIma->exptime, oIma->gain)){ // image is a part of new master dark
+                Image_free(&oIma);
+                continue;
+            }
+            if(theconf.ncoadd > 1){
+                fastcentroid(oIma);
+                if(theconf.fastcorr) fastDeviation(lastimdata.fxc, lastimdata.fyc);
+                Image *S = coadd_frame(oIma);
+                Image_free(&oIma);
+                if(!S) continue; // stack isn't ready yet
+                oIma = S;
+            }else if(coadd.N){
+                coadd_reset();
+                lastimdata.fxc = lastimdata.fyc = -1.f;
+            }
             if(process){
                 if(theconf.medfilt){
                     Image *X = get_median(oIma, theconf.medseed);
@@ -265,7 +371,7 @@ static void *procthread(void* v){
                 getcenter(&lastimdata.xc, &lastimdata.yc);
             }
             if(theconf.expmethod == EXPAUTO){
-                if(needs_exposure_adjustment(oIma, lastimdata.xc, lastimdata.yc)) recalcexp(oIma);
+                autoexp(oIma);
             }else{
                 if(fabs(theconf.exptime - exptime) > FLT_EPSILON)
                     exptime = theconf.exptime;
@@ -274,16 +380,9 @@ static void *procthread(void* v){
                 if(fabs(theconf.brightness - brightness) > FLT_EPSILON)
                     brightness = theconf.brightness;
             }
-            //Icap[iCaptured] = NULL;
-            //pthread_mutex_unlock(&capt_mutex);
             Image_free(&oIma);
             DBG("===== cleared image data @ %g", sl_dtime() - t0);
-        }else{
-            //DBG("===== NO image data");
-            pthread_mutex_unlock(&capt_mutex);
         }
-        //DBG("===== NEXT!");
-        usleep(1000);
     }
     return NULL;
 }
@@ -295,6 +394,7 @@ int camcapture(void (*process)(Image*)){
     static float oldbrightness = 0.;
     Image *oIma = NULL;
     pthread_t proc_thread;
+    framering_init(&procring);
     if(pthread_create(&proc_thread, NULL, procthread, (void*)process)){
         LOGERR("pthread_create() for image processing failed");
         ERR("pthread_create()");
@@ -342,6 +442,8 @@ int camcapture(void (*process)(Image*)){
                 theconf.exptime = exptime;
             }else{
                 WARNX("Can't change exposition time to %gms", exptime);
+                LOGWARN("Can't change exposition time to %gms", exptime);
+                exptime = oldexptime;
             }
         }
         DBG("T=%g", sl_dtime() - t0);
@@ -374,33 +476,27 @@ int camcapture(void (*process)(Image*)){
             }
             continue;
         }else errctr = 0;
+        // drivers which know exposure time bounds set them, else use time of capture() return
+        if(oIma->tend <= 0.) oIma->tend = sl_dtime();
+        if(oIma->tstart <= 0.) oIma->tstart = oIma->tend - exptime / 1000.;
+        oIma->exptime = oldexptime;
+        oIma->gain = oldgain;
+        static uint64_t lastseqno = 0;
+        if(oIma->seqno > lastseqno + 1 && lastseqno) Ndropped += oIma->seqno - lastseqno - 1;
+        lastseqno = oIma->seqno; // (numbering restarts after reconnection)
         DBG("---- Grabbed #%d @ %g", imno++, sl_dtime() - t0);
-        pthread_mutex_lock(&capt_mutex);
-        if(iCaptured < 0) iCaptured = 0;
-        else iCaptured = !iCaptured;
-        if(Icap[iCaptured]){ // try current value if previous is still busy
-            DBG("---- iCap=%d busy!", iCaptured);
-            iCaptured = !iCaptured;
+        if(framering_put(&procring, oIma)){
+            DBG("---- processing is too slow, the oldest frame dropped");
+            ++Ndropped;
         }
-        if(!Icap[iCaptured]){ // previous buffer is free
-            DBG("---- take iCaptured=%d", iCaptured);
-            Icap[iCaptured] = oIma;
-            oIma = NULL;
-        }else{ // clear our image - there's no empty buffers
-            DBG("---- no free buffers for iCap=%d", iCaptured);
-            Image_free(&oIma);
-        }
-        pthread_mutex_unlock(&capt_mutex);
+        oIma = NULL;
         DBG("T=%g", sl_dtime() - t0);
     }
-    pthread_cancel(proc_thread);
     if(oIma) Image_free(&oIma);
-    for(int i = 0; i < 2; ++i){
-        if(Icap[i]) Image_free(&Icap[i]);
-    }
     camdisconnect();
     DBG("CAMCAPTURE: out");
-    pthread_join(proc_thread, NULL);
+    pthread_join(proc_thread, NULL); // it checks `stopwork` at least each PROCRING_TIMEOUT
+    framering_clear(&procring);
     return 1;
 }
 
@@ -427,11 +523,14 @@ char *camstatus(const char *messageid, char *buf, int buflen){
     snprintf(buf, buflen, "{ \"%s\": \"%s\", \"camstatus\": \"%sconnected\", \"impath\": \"%s\", \"imctr\": %llu, "
          "\"fps\": %.3f, \"expmethod\": \"%s\", \"exptime\": %g, \"gain\": %g, \"maxgain\": %g, \"brightness\": %g, "
          "\"xcenter\": %.1f, \"ycenter\": %.1f , \"minval\": %d, \"maxval\": %d, \"background\": %d, "
-         "\"average\": %.1f, \"xc\": %.1f, \"yc\": %.1f, \"xsigma\": %.1f, \"ysigma\": %.1f, \"area\": %d }\n",
+         "\"average\": %.1f, \"xc\": %.1f, \"yc\": %.1f, \"xsigma\": %.1f, \"ysigma\": %.1f, \"area\": %d, "
+         "\"ncoadd\": %d, \"stacked\": %" PRIu64 ", \"dropped\": %" PRIu64 ", \"fastxc\": %.1f, \"fastyc\": %.1f }\n",
          MESSAGEID, messageid, connected ? "" : "dis", impath, ImNumber, getFramesPerS(),
          (theconf.expmethod == EXPAUTO) ? "auto" : "manual", exptime, gain, gainmax, brightness,
          xc, yc, lastimdata.minval, lastimdata.maxval, lastimdata.bkg, lastimdata.avg,
          lastimdata.stat.xc, lastimdata.stat.yc, lastimdata.stat.xsigma, lastimdata.stat.ysigma,
-         lastimdata.stat.area);
+         lastimdata.stat.area, theconf.ncoadd, Nstacked, Ndropped,
+         (lastimdata.fxc < 0.f) ? -1.f : lastimdata.fxc + theconf.xoff,
+         (lastimdata.fyc < 0.f) ? -1.f : lastimdata.fyc + theconf.yoff);
     return buf;
 }
@@ -19,10 +19,21 @@
 #ifndef CAMERACAPTURE_H__
 #define CAMERACAPTURE_H__
 
+#include <pthread.h>
+
 #include "imagefile.h" // Image
 
 // max capture errors contract to make reconnection
 #define MAX_CAPT_ERRORS     (10)
+// automatic exposition: decrease factor for saturated star and max change factor by one step
+#define AUTOEXP_SATUR       (0.3)
+#define AUTOEXP_KMAX        (50.)
+// max change factor when star not found (only brightest pixel is known)
+#define AUTOEXP_KNOSTAR     (4.)
+// length of frames ring for continuous acquisition
+#define FRAMERING_LEN       (4)
+// max time of waiting for next frame in processing thread, seconds
+#define PROCRING_TIMEOUT    (0.1)
 
 // format of single frame
 typedef struct{
@@ -39,6 +50,7 @@ typedef struct{
     int (*setexp)(float e);
     int (*setgain)(float g);
     float (*getmaxgain)();  // get max available gain value
+    int lineargain;         // gain is an amplification factor (else - dB)
     // geometry (if TRUE, all args are changed to suitable values)
     int (*setgeometry)(frameformat *fmt);
     // get limits of geometry: maximal values and steps
@@ -46,6 +58,20 @@ typedef struct{
     //int (*getgeometry)(frameformat *fmt);
 } camera;
 
+// frames delivered by SDK callbacks in continuous acquisition mode
+typedef struct{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    Image *frames[FRAMERING_LEN];
+    uint64_t head;          // next frame to put
+    uint64_t tail;          // next frame to get
+} framering;
+
+void framering_init(framering *r);
+int framering_put(framering *r, Image *I);
+Image *framering_get(framering *r, double timeout);
+void framering_clear(framering *r);
+
 int setCamera(camera *cptr);
 void camdisconnect();
 int camcapture(void (*process)(Image *));
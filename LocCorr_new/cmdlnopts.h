@@ -51,6 +51,7 @@ typedef struct{
     char *logXYname;        // file to log XY coordinates of first point
     char *configname;       // name of configuration file (default: ./loccorr.conf)
     char *outputjpg;        // output jpeg name
+    char *replay;           // directory or file to replay (offline processing)
     int steppersport;       // port of local motors CAN server
     int equalize;           // make historam equalization of saved jpeg
 //    int medradius;          // radius of median filter (r=1 -> 3x3, r=2 -> 5x5 etc.)
@@ -64,6 +65,8 @@ typedef struct{
     int xoff; int yoff;     // offset by X and Y axes
     int width; int height;  // target width and height of image
     int ioport;             // port for IO commands
+    int realtime;           // replay frames at recorded timestamps
+    int stpsim;             // run internal steppers server simulator
     double throwpart;       // fraction of black pixels to throw away when make histogram eq
     double intensthres;     // threshold by total object intensity when sorting = |I1-I2|/(I1+I2), default: 0.01
     double maxexp;          // max exposition time (ms)
@@ -39,6 +39,7 @@ configuration theconf = {
     .minwh=0.9,
     .Nerosions=DEFAULT_NEROSIONS,
     .Ndilations=DEFAULT_NDILATIONS,
+    .cclabel8=0,
     .xoff=0,
     .yoff=0,
     .width=0,
@@ -64,8 +65,28 @@ configuration theconf = {
     .minexp=EXPOS_MIN,
     .exptime=EXPOS_MIN*2,
     .gain=20.,
+    .exppeak=DEFAULT_EXPPEAK,
+    .exphyst=DEFAULT_EXPHYST,
     .intensthres=DEFAULT_INTENSTHRES,
     .medseed=MIN_MEDIAN_SEED,
+    .hotthres=DEFAULT_HOTTHRES,
+    .ncoadd=1,
+    .fastaver=DEFAULT_NAVERAGE,
+    .fasttol=DEFAULT_FASTTOL,
+    .dirworkers=2,
+    .dirbacklog=8,
+    .dirpolicy=DIRPOLICY_ORDER,
+    .simnstars=1,
+    .simfwhm=4.,
+    .simflux=2.,
+    .simsky=0.1,
+    .simnoise=2.,
+    .simpeperiod=60.,
+    .simtransp=1.,
+    .stpsimspeed=4000,
+    .stpsimaccel=8000,
+    .stpsimscale=0.01,
+    .stpsimangle=30.,
 };
 
 static int isSorted = 0; // ==1 when `parvals` are sorted
@@ -89,6 +110,8 @@ static confparam parvals[] = {
      "amount of dilations on binarized image"},
     {"neros", PAR_INT, (void*)&theconf.Nerosions, 0, 1., MAX_NEROS,
      "amount of erosions after dilations"},
+    {"cclabel8", PAR_INT, (void*)&theconf.cclabel8, 0, 0., 1.,
+     "label 8-connected (1) or 4-connected (0) objects"},
     {"xoffset", PAR_INT, (void*)&theconf.xoff, 0, 0., MAX_OFFSET,
      "X offset of subimage"},
     {"yoffset", PAR_INT, (void*)&theconf.yoff, 0, 0., MAX_OFFSET,
@@ -141,6 +164,12 @@ static confparam parvals[] = {
      "V axis I PID parameter"},
     {"pidvd", PAR_DOUBLE, (void*)&theconf.PIDV_D, 0, PID_I_MIN, PID_I_MAX,
      "V axis D PID parameter"},
+    {"rlslambda", PAR_DOUBLE, (void*)&theconf.rlslambda, 0, 0., 1.,
+     "forgetting factor of online Kxu..Kyv estimator (0 - turn off estimation)"},
+    {"ffmode", PAR_INT, (void*)&theconf.ffmode, 0, 0., 2.,
+     "feed-forward drift model: 0 - off, 1 - linear, 2 - linear + periodic"},
+    {"ffperiod", PAR_DOUBLE, (void*)&theconf.ffperiod, 0, 0., FF_PERIOD_MAX,
+     "period of feed-forward periodic term (e.g. worm period), seconds"},
     {"eqthrowpart", PAR_DOUBLE, (void*)&theconf.throwpart, 0, 0., MAX_THROWPART,
      "a part of low intensity pixels to throw away when histogram equalized"},
     {"minexp", PAR_DOUBLE, (void*)&theconf.minexp, 0, 0., EXPOS_MAX,
@@ -149,6 +178,10 @@ static confparam parvals[] = {
      "maximal exposition time"},
     {"exptime", PAR_DOUBLE, (void*)&theconf.exptime, 0, EXPOS_MIN, EXPOS_MAX,
      "exposition time (you can change it only when expmethod==1)"},
+    {"exppeak", PAR_DOUBLE, (void*)&theconf.exppeak, 0, EXPPEAK_MIN, EXPPEAK_MAX,
+     "automatic exposition: target peak value of tracked star over background"},
+    {"exphyst", PAR_DOUBLE, (void*)&theconf.exphyst, 0, 0., EXPHYST_MAX,
+     "automatic exposition: relative dead band around target peak"},
     {"intensthres", PAR_DOUBLE, (void*)&theconf.intensthres, 0, 0., 1.,
      "threshold by total object intensity when sorting = |I1-I2|/(I1+I2)"},
     {"gain", PAR_DOUBLE, (void*)&theconf.gain, 0, GAIN_MIN, GAIN_MAX,
@@ -167,6 +200,68 @@ static confparam parvals[] = {
      "fixed background level"},
     {"writedi", PAR_INT, (void*)&theconf.writedebugimgs, 0, 0., 1.,
      "write debug images (binary/erosion/opening)"},
+    {"ensemble", PAR_INT, (void*)&theconf.ensemble, 0, 0., ENSEMBLE_MAX,
+     "amount of stars for ensemble centroid (0 or 1 - use only the first star)"},
+    {"usedark", PAR_INT, (void*)&theconf.usedark, 0, 0., 1.,
+     "subtract master dark and interpolate hot pixels (1) or not (0)"},
+    {"hotthres", PAR_INT, (void*)&theconf.hotthres, 0, HOTTHRES_MIN, HOTTHRES_MAX,
+     "hot pixels threshold: dark value over its median"},
+    {"ncoadd", PAR_INT, (void*)&theconf.ncoadd, 0, 1., NCOADD_MAX,
+     "amount of frames to co-add before processing (1 - no co-adding)"},
+    {"coaddshift", PAR_INT, (void*)&theconf.coaddshift, 0, 0., 1.,
+     "shift frames by fast centroid before co-adding (1) or not (0)"},
+    {"fastcorr", PAR_INT, (void*)&theconf.fastcorr, 0, 0., 1.,
+     "when co-adding, calculate corrections by fast centroid of each frame (1) or by stacked frames (0)"},
+    {"fastaver", PAR_INT, (void*)&theconf.fastaver, 0, 1., NAVER_MAX,
+     "amount of fast centroids for average calculation"},
+    {"fasttol", PAR_DOUBLE, (void*)&theconf.fasttol, 0, 0., FASTTOL_MAX,
+     "max RMS of averaged fast centroids, pixels (worse values are ignored)"},
+    {"dirworkers", PAR_INT, (void*)&theconf.dirworkers, 0, 1., DIRWORKERS_MAX,
+     "directory mode: amount of image decoding threads (applied on start)"},
+    {"dirbacklog", PAR_INT, (void*)&theconf.dirbacklog, 0, 1., DIRBACKLOG_MAX,
+     "directory mode: max amount of files waiting for decoding or processing (applied on start)"},
+    {"dirpolicy", PAR_INT, (void*)&theconf.dirpolicy, 0, DIRPOLICY_ORDER, DIRPOLICY_NEWEST,
+     "directory mode: process all files in order (0) or only the newest decoded image (1)"},
+    {"simnstars", PAR_INT, (void*)&theconf.simnstars, 0, 1., SIM_NSTARS_MAX,
+     "camera simulator: amount of stars (the first is main)"},
+    {"simprofile", PAR_INT, (void*)&theconf.simprofile, 0, 0., 1.,
+     "camera simulator: stars profile, 0 - Gaussian, 1 - Moffat"},
+    {"simhotpix", PAR_INT, (void*)&theconf.simhotpix, 0, 0., SIM_HOTPIX_MAX,
+     "camera simulator: amount of hot pixels"},
+    {"simfps", PAR_INT, (void*)&theconf.simfps, 0, 0., SIM_FPS_MAX,
+     "camera simulator: max frame rate (0 - limited by exptime only)"},
+    {"simfwhm", PAR_DOUBLE, (void*)&theconf.simfwhm, 0, SIM_FWHM_MIN, SIM_FWHM_MAX,
+     "camera simulator: stars FWHM, pixels"},
+    {"simflux", PAR_DOUBLE, (void*)&theconf.simflux, 0, 0., SIM_FLUX_MAX,
+     "camera simulator: main star peak value, ADU per ms at zero gain"},
+    {"simsky", PAR_DOUBLE, (void*)&theconf.simsky, 0, 0., SIM_FLUX_MAX,
+     "camera simulator: sky level, ADU per ms"},
+    {"simgradient", PAR_DOUBLE, (void*)&theconf.simgradient, 0, -SIM_FLUX_MAX, SIM_FLUX_MAX,
+     "camera simulator: sky gradient by X, ADU per ms per 1000 pixels"},
+    {"simnoise", PAR_DOUBLE, (void*)&theconf.simnoise, 0, 0., SIM_NOISE_MAX,
+     "camera simulator: read noise RMS, ADU"},
+    {"simdriftx", PAR_DOUBLE, (void*)&theconf.simdriftx, 0, -SIM_DRIFT_MAX, SIM_DRIFT_MAX,
+     "camera simulator: stars drift by X, pixels per second"},
+    {"simdrifty", PAR_DOUBLE, (void*)&theconf.simdrifty, 0, -SIM_DRIFT_MAX, SIM_DRIFT_MAX,
+     "camera simulator: stars drift by Y, pixels per second"},
+    {"simpeamp", PAR_DOUBLE, (void*)&theconf.simpeamp, 0, 0., SIM_PEAMP_MAX,
+     "camera simulator: periodic error (by X) amplitude, pixels"},
+    {"simpeperiod", PAR_DOUBLE, (void*)&theconf.simpeperiod, 0, 0., SIM_PEPER_MAX,
+     "camera simulator: periodic error period, seconds"},
+    {"simseeing", PAR_DOUBLE, (void*)&theconf.simseeing, 0, 0., SIM_PEAMP_MAX,
+     "camera simulator: seeing jitter RMS, pixels"},
+    {"simtransp", PAR_DOUBLE, (void*)&theconf.simtransp, 0, 0., 1.,
+     "camera simulator: atmosphere transparency"},
+    {"stpsimspeed", PAR_INT, (void*)&theconf.stpsimspeed, 0, 1., STPSIM_SPEED_MAX,
+     "steppers simulator: max speed, steps per second"},
+    {"stpsimaccel", PAR_INT, (void*)&theconf.stpsimaccel, 0, 1., STPSIM_ACCEL_MAX,
+     "steppers simulator: acceleration, steps per second^2"},
+    {"stpsimscale", PAR_DOUBLE, (void*)&theconf.stpsimscale, 0, -STPSIM_SCALE_MAX, STPSIM_SCALE_MAX,
+     "steppers simulator: star moving, pixels per step"},
+    {"stpsimangle", PAR_DOUBLE, (void*)&theconf.stpsimangle, 0, -360., 360.,
+     "steppers simulator: angle between U and X axes, degrees"},
+    {"stpsimstall", PAR_DOUBLE, (void*)&theconf.stpsimstall, 0, 0., 1.,
+     "steppers simulator: probability of stall per second of moving"},
     {NULL,  0,  NULL, 0, 0., 0., NULL}
 };
 
@@ -415,7 +510,7 @@ int saveconf(const char *confname){
         ++par;
     }
     DBG("%s saved", confname);
-    LOGDBG("Configuration file '%s' saved (my PID=%zd)", confname, getpid());
+    LOGDBG("Configuration file '%s' saved (my PID=%d)", confname, getpid());
     fclose(f);
     return TRUE;
 }
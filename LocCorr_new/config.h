@@ -42,6 +42,32 @@
 #define BRIGHT_MAX      (100.)
 // max average images counter
 #define NAVER_MAX       (25)
+// max amount of stars for ensemble centroid
+#define ENSEMBLE_MAX    (10)
+// max amount of co-added frames (sum should fit into uint16_t)
+#define NCOADD_MAX      (256)
+// max RMS of averaged fast centroids
+#define FASTTOL_MAX     (50.)
+#define DEFAULT_FASTTOL (2.)
+// hot pixels threshold (over dark median)
+#define HOTTHRES_MIN    (1)
+#define HOTTHRES_MAX    (255)
+#define DEFAULT_HOTTHRES (20)
+// camera simulator parameters
+#define SIM_NSTARS_MAX  (10000)
+#define SIM_HOTPIX_MAX  (100000)
+#define SIM_FPS_MAX     (10000.)
+#define SIM_FWHM_MIN    (0.5)
+#define SIM_FWHM_MAX    (100.)
+#define SIM_FLUX_MAX    (1e5)
+#define SIM_DRIFT_MAX   (1000.)
+#define SIM_PEAMP_MAX   (1000.)
+#define SIM_PEPER_MAX   (1e5)
+#define SIM_NOISE_MAX   (255.)
+// steppers simulator parameters
+#define STPSIM_SPEED_MAX    (100000)
+#define STPSIM_ACCEL_MAX    (1000000)
+#define STPSIM_SCALE_MAX    (100.)
 // coefficients to convert dx,dy to du,dv
 #define KUVMIN           (-5000.)
 #define KUVMAX           (5000.)
@@ -54,10 +80,24 @@
 #define FIXED_BK_MIN    (0)
 #define FIXED_BK_MAX    (255)
 
+// automatic exposition: target peak of tracked star over background and relative dead band
+#define EXPPEAK_MIN     (10.)
+#define EXPPEAK_MAX     (250.)
+#define DEFAULT_EXPPEAK (150.)
+#define EXPHYST_MAX     (1.)
+#define DEFAULT_EXPHYST (0.3)
+
 // exposition methods: 0 - auto, 1 - fixed
 #define EXPAUTO         (0)
 #define EXPMANUAL       (1)
 
+// directory mode: max amount of decoding workers and backlog length
+#define DIRWORKERS_MAX  (32)
+#define DIRBACKLOG_MAX  (256)
+// backlog policy: 0 - process all files in order, 1 - newest file wins
+#define DIRPOLICY_ORDER (0)
+#define DIRPOLICY_NEWEST (1)
+
 // roundness parameter
 #define MINWH           (0.01)
 #define MAXWH           (100.)
@@ -72,6 +112,8 @@
 #define PID_D_MIN       (0.)
 #define PID_D_MAX       (5.)
 #define PID_D_DEFAULT   (0.05)
+// feed-forward drift model: max period of periodic term, seconds
+#define FF_PERIOD_MAX   (1e5)
 
 // messageID field name
 #define MESSAGEID       "messageid"
@@ -87,6 +129,7 @@ typedef struct{
     int maxarea;
     int Nerosions;      // amount of erosions/dilations
     int Ndilations;
+    int cclabel8;       // ==1 to label 8-connected objects (else 4-connected)
     int xoff;           // subimage offset
     int yoff;
     int width;          // subimage size
@@ -101,6 +144,23 @@ typedef struct{
     int fixedbkg;       // don't calculate background, use fixed value instead
     int background;     // value of background
     int writedebugimgs; // write debugging images: binary/erosion/opening
+    int ensemble;       // amount of stars for ensemble centroid (<2 - use only the first star)
+    int usedark;        // ==1 to subtract master dark and fix hot pixels
+    int hotthres;       // hot pixels threshold (over median of dark)
+    int ncoadd;         // amount of frames to co-add before processing (<2 - don't co-add)
+    int coaddshift;     // ==1 to shift frames by fast centroid before co-adding
+    int fastcorr;       // ==1 to calculate corrections by fast centroid of each frame when co-adding
+    int fastaver;       // amount of fast centroids for average calculation
+    int simnstars;      // camera simulator: amount of stars (the first is main)
+    int simprofile;     // stars profile: 0 - Gaussian, 1 - Moffat
+    int simhotpix;      // amount of hot pixels
+    int simfps;         // max frame rate (0 - limited by exptime only)
+    int dirworkers;     // directory mode: amount of decoding threads
+    int dirbacklog;     // max amount of files in decoding pipeline
+    int dirpolicy;      // backlog policy: DIRPOLICY_ORDER or DIRPOLICY_NEWEST
+    int ffmode;         // feed-forward drift model: 0 - off, 1 - linear, 2 - linear + periodic
+    int stpsimspeed;    // steppers simulator: max speed, steps per second
+    int stpsimaccel;    // acceleration, steps per second^2
     // dU = Kxu*dX + Kyu*dY; dV = Kxv*dX + Kyv*dY
     double Kxu; double Kyu;
     double Kxv; double Kyv;
@@ -113,10 +173,31 @@ typedef struct{
     double exptime;     // exposure time
     double gain;        // gain value in manual mode
     double brightness;  // brightness @camera
+    double exppeak;     // automatic exposition: target peak of tracked star over background, ADU
+    double exphyst;     // don't change exposition while peak differs from target less than by this part
+    double fasttol;     // max RMS of averaged fast centroids (else they considered to be wrong), pix
     double intensthres; // threshold for stars intensity comparison: fabs(Ia-Ib)/(Ia+Ib) > thres -> stars differs
     // PID regulator for axes U and V
     double PIDU_P; double PIDU_I; double PIDU_D;
     double PIDV_P; double PIDV_I; double PIDV_D;
+    double rlslambda;   // forgetting factor of online K estimator (0 - don't estimate)
+    double ffperiod;    // period of feed-forward periodic term, seconds
+    // camera simulator
+    double simfwhm;     // stars FWHM, pixels
+    double simflux;     // main star peak value, ADU per ms (at zero gain)
+    double simsky;      // sky level, ADU per ms
+    double simgradient; // sky gradient by X, ADU per ms per 1000 pixels
+    double simnoise;    // read noise RMS, ADU
+    double simdriftx;   // drift of stars, pixels per second
+    double simdrifty;
+    double simpeamp;    // periodic error (by X) amplitude, pixels
+    double simpeperiod; // and period, seconds
+    double simseeing;   // seeing jitter RMS, pixels
+    double simtransp;   // atmosphere transparency (0..1)
+    // steppers simulator
+    double stpsimscale; // star moving by U/V, pixels per step
+    double stpsimangle; // angle between U and X axes, degrees (V is perpendicular to U)
+    double stpsimstall; // probability of stall per second of moving
 } configuration;
 
 typedef enum{
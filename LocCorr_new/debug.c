@@ -16,14 +16,288 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifdef EBUG
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "debug.h"
 
+// one record of asynchronous logger
+typedef struct{
+    atomic_size_t seq;          // sequence number of ring cell
+    sl_log_t *log;
+    sl_loglevel_e level;
+    int timest;                 // add timestamp
+    double t;                   // time of call
+    const char *fmt;
+    int nargs;
+    alog_arg args[ALOG_MAXARGS];
+    char strs[ALOG_STRPOOL];    // copies of string arguments
+} alog_rec;
+
+static alog_rec ring[ALOG_RINGSZ];
+static atomic_size_t enqpos = 0, deqpos = 0;
+static atomic_size_t Ndropped = 0;  // messages lost due to ring overflow
+static atomic_bool alog_run = 0;    // writer thread is running
+static atomic_bool alog_stopping = 0;
+static pthread_t alog_thread;
+static pthread_mutex_t alog_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void alog_chkfmt(_U_ const char *fmt, ...){}
+
+/**
+ * @brief alog_format - format record (the same as printf does)
+ * @param r - record
+ * @param buf - output buffer
+ * @param buflen - its length
+ */
+static void alog_format(const alog_rec *r, char *buf, size_t buflen){
+    const char *f = r->fmt;
+    char spec[32];
+    size_t l = 0;
+    int argn = 0;
+    while(*f && l < buflen - 1){
+        if(*f != '%'){
+            buf[l++] = *f++;
+            continue;
+        }
+        if(f[1] == '%'){
+            buf[l++] = '%';
+            f += 2;
+            continue;
+        }
+        // flags, width, precision, length modifier and conversion
+        size_t sl = 0;
+        spec[sl++] = *f++;
+        int lng = 0; // 0 - int, 1 - long, 2 - long long, 3 - size_t, 4 - long double
+        int bad = FALSE;
+        for(; *f && strchr("-+ #0123456789.*", *f); ++f){
+            if(sl >= sizeof(spec) - 12){ bad = TRUE; break; }
+            if(*f != '*'){
+                spec[sl++] = *f;
+                continue;
+            }
+            // width or precision is the next argument
+            if(argn >= r->nargs){ bad = TRUE; break; }
+            const alog_arg *a = &r->args[argn++];
+            int v = (a->type == ALOG_UINT) ? (int)a->u : (int)a->i;
+            if(v < 0 && spec[sl-1] == '.') --sl; // negative precision is the same as omitted
+            else sl += sprintf(spec + sl, "%d", v);
+        }
+        for(; *f && strchr("hlLqjzt", *f); ++f){
+            switch(*f){
+                case 'l': ++lng; break;
+                case 'q': case 'j': lng = 2; break;
+                case 'z': case 't': lng = 3; break;
+                case 'L': lng = 4; break;
+                default: break;
+            }
+            if(sl >= sizeof(spec) - 2){ bad = TRUE; break; }
+            spec[sl++] = *f;
+        }
+        if(bad || !*f) break;
+        spec[sl++] = *f;
+        spec[sl] = 0;
+        char conv = *f++;
+        if(argn >= r->nargs) break;
+        const alog_arg *a = &r->args[argn++];
+        int n = 0, L = (int)(buflen - l);
+        unsigned long long u = (a->type == ALOG_INT) ? (unsigned long long)a->i : a->u;
+        long long i = (a->type == ALOG_UINT) ? (long long)a->u : a->i;
+        switch(conv){
+            case 'd': case 'i': case 'c':
+                if(lng == 0 || conv == 'c') n = snprintf(buf + l, L, spec, (int)i);
+                else if(lng == 1 || lng == 3) n = snprintf(buf + l, L, spec, (long)i);
+                else n = snprintf(buf + l, L, spec, i);
+            break;
+            case 'u': case 'x': case 'X': case 'o':
+                if(lng == 0) n = snprintf(buf + l, L, spec, (unsigned)u);
+                else if(lng == 1 || lng == 3) n = snprintf(buf + l, L, spec, (unsigned long)u);
+                else n = snprintf(buf + l, L, spec, u);
+            break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                if(lng == 4) n = snprintf(buf + l, L, spec, (long double)a->d);
+                else n = snprintf(buf + l, L, spec, a->d);
+            break;
+            case 's':
+                n = snprintf(buf + l, L, spec, (a->type == ALOG_STR && a->s) ? a->s : "(null)");
+            break;
+            case 'p':
+                n = snprintf(buf + l, L, spec, a->p);
+            break;
+            default: // unsupported conversion: print as is
+                n = snprintf(buf + l, L, "%s", spec);
+        }
+        if(n < 0) break;
+        l += ((size_t)n < buflen - l) ? (size_t)n : buflen - l - 1;
+    }
+    buf[l] = 0;
+}
+
+// write one record
+static void alog_write(const alog_rec *r){
+    char msg[ALOG_MSGLEN];
+    alog_format(r, msg, sizeof(msg));
+    if(!r->timest){
+        sl_putlogt(0, r->log, r->level, "%s", msg);
+        return;
+    }
+    // time of call, not time of writing
+    char strtm[64];
+    time_t t = (time_t)r->t;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    size_t l = strftime(strtm, sizeof(strtm), "%Y/%m/%d-%H:%M:%S", &tm);
+    snprintf(strtm + l, sizeof(strtm) - l, ".%06d", (int)((r->t - (double)t) * 1e6));
+    sl_putlogt(0, r->log, r->level, "%s\t%s", strtm, msg);
+}
+
+// get next record from ring, @return FALSE if empty
+static int alog_pop(){
+    size_t pos = atomic_load_explicit(&deqpos, memory_order_relaxed);
+    alog_rec *r;
+    while(1){
+        r = &ring[pos & (ALOG_RINGSZ - 1)];
+        size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(dif == 0){
+            if(atomic_compare_exchange_weak_explicit(&deqpos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        }else if(dif < 0) return FALSE;
+        else pos = atomic_load_explicit(&deqpos, memory_order_relaxed);
+    }
+    alog_write(r);
+    atomic_store_explicit(&r->seq, pos + ALOG_RINGSZ, memory_order_release);
+    return TRUE;
+}
+
+static void *alog_writer(_U_ void *arg){
+    size_t lost = 0;
+    while(1){
+        int got = 0;
+        while(alog_pop()) ++got;
+        size_t d = atomic_load(&Ndropped);
+        if(d != lost){
+            LOGWARN("Async logger: %zd messages lost (ring overflow)", d - lost);
+            lost = d;
+        }
+        if(!got){
+            if(atomic_load(&alog_stopping)) break;
+            usleep(ALOG_PERIOD);
+        }
+    }
+    return NULL;
+}
+
+// forked child have no writer thread
+static void alog_atfork(){
+    atomic_store(&alog_run, 0);
+    atomic_store(&alog_stopping, 0);
+    pthread_mutex_init(&alog_mutex, NULL);
+}
+
+// init ring and run writer thread
+static void alog_start(){
+    static int first = 1;
+    pthread_mutex_lock(&alog_mutex);
+    if(atomic_load(&alog_run)){
+        pthread_mutex_unlock(&alog_mutex);
+        return;
+    }
+    for(size_t i = 0; i < ALOG_RINGSZ; ++i) atomic_store_explicit(&ring[i].seq, i, memory_order_relaxed);
+    atomic_store(&enqpos, 0);
+    atomic_store(&deqpos, 0);
+    atomic_store(&alog_stopping, 0);
+    if(pthread_create(&alog_thread, NULL, alog_writer, NULL)){
+        pthread_mutex_unlock(&alog_mutex);
+        WARN("pthread_create()");
+        return;
+    }
+    if(first){
+        first = 0;
+        atexit(alog_stop);
+        pthread_atfork(NULL, NULL, alog_atfork);
+    }
+    atomic_store_explicit(&alog_run, 1, memory_order_release);
+    pthread_mutex_unlock(&alog_mutex);
+}
+
+/**
+ * @brief alog_push - put record into ring (message is lost if ring is full)
+ * @param log - log to write
+ * @param lvl - message level
+ * @param timest - add timestamp
+ * @param fmt - format string (should be static)
+ * @param args - arguments
+ * @param nargs - their amount
+ */
+void alog_push(sl_log_t *log, sl_loglevel_e lvl, int timest, const char *fmt, const alog_arg *args, int nargs){
+    if(!atomic_load_explicit(&alog_run, memory_order_acquire)){
+        alog_start();
+        if(!atomic_load(&alog_run)){ // can't run thread: write synchronously
+            alog_rec r = {.log = log, .level = lvl, .timest = timest, .t = sl_dtime(), .fmt = fmt,
+                          .nargs = (nargs > ALOG_MAXARGS) ? ALOG_MAXARGS : nargs};
+            memcpy(r.args, args, r.nargs * sizeof(alog_arg));
+            alog_write(&r);
+            return;
+        }
+    }
+    size_t pos = atomic_load_explicit(&enqpos, memory_order_relaxed);
+    alog_rec *r;
+    while(1){
+        r = &ring[pos & (ALOG_RINGSZ - 1)];
+        size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if(dif == 0){
+            if(atomic_compare_exchange_weak_explicit(&enqpos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        }else if(dif < 0){ // full
+            atomic_fetch_add_explicit(&Ndropped, 1, memory_order_relaxed);
+            return;
+        }else pos = atomic_load_explicit(&enqpos, memory_order_relaxed);
+    }
+    r->log = log;
+    r->level = lvl;
+    r->timest = timest;
+    r->t = timest ? sl_dtime() : 0.;
+    r->fmt = fmt;
+    if(nargs > ALOG_MAXARGS) nargs = ALOG_MAXARGS;
+    r->nargs = nargs;
+    size_t spos = 0;
+    for(int i = 0; i < nargs; ++i){
+        r->args[i] = args[i];
+        if(args[i].type != ALOG_STR || !args[i].s) continue;
+        // strings could be changed before writing: copy them
+        if(spos >= ALOG_STRPOOL){
+            r->args[i].s = "...";
+            continue;
+        }
+        char *dst = r->strs + spos;
+        size_t l = strnlen(args[i].s, ALOG_STRPOOL - spos - 1);
+        memcpy(dst, args[i].s, l);
+        dst[l] = 0;
+        r->args[i].s = dst;
+        spos += l + 1;
+    }
+    atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+}
+
+// write all records and stop writer thread
+void alog_stop(){
+    pthread_mutex_lock(&alog_mutex);
+    if(atomic_load(&alog_run)){
+        atomic_store(&alog_stopping, 1);
+        pthread_join(alog_thread, NULL);
+        atomic_store(&alog_run, 0);
+    }
+    pthread_mutex_unlock(&alog_mutex);
+}
+
+#ifdef EBUG
+
 #define DEBUGLOG        "DEBUG.log"
 
 sl_log_t *debuglog = NULL;
@@ -42,7 +316,7 @@ void makedebuglog(){
  */
 void *my_malloc(size_t N, size_t S){
     size_t NS = N*S + sizeof(size_t);
-    sl_putlogt(0, debuglog, LOGLEVEL_ERR, "ALLOCSZ(%zd)", N*S);
+    ALOG(debuglog, LOGLEVEL_ERR, 0, "ALLOCSZ(%zd)", N*S);
     void *p = malloc(NS);
     if(!p) ERR("malloc");
     memset(p, 0, NS);
@@ -52,7 +326,7 @@ void *my_malloc(size_t N, size_t S){
 
 void my_free(void *ptr){
     void *orig = ptr - sizeof(size_t);
-    sl_putlogt(0, debuglog, LOGLEVEL_ERR, "FREESZ(%zd)", *(size_t*)orig);
+    ALOG(debuglog, LOGLEVEL_ERR, 0, "FREESZ(%zd)", *(size_t*)orig);
     free(orig);
 }
 
@@ -25,6 +25,82 @@
 #define TRUE_INLINE  __attribute__((always_inline)) static inline
 #endif
 
+/**** asynchronous logger: caller stores format pointer and binary arguments, formatting & writing in separate thread ****/
+// size of records' ring (power of 2)
+#define ALOG_RINGSZ     (1024)
+// max amount of arguments for one record
+#define ALOG_MAXARGS    (10)
+// storage for copies of string arguments in each record
+#define ALOG_STRPOOL    (128)
+// max length of formatted message
+#define ALOG_MSGLEN     (1024)
+// writer thread sleeping time when ring is empty, us
+#define ALOG_PERIOD     (10000)
+
+typedef enum{
+    ALOG_INT,
+    ALOG_UINT,
+    ALOG_DBL,
+    ALOG_STR,
+    ALOG_PTR
+} alog_type;
+
+typedef struct{
+    alog_type type;
+    union{
+        long long i;
+        unsigned long long u;
+        double d;
+        const char *s;
+        const void *p;
+    };
+} alog_arg;
+
+void alog_push(sl_log_t *log, sl_loglevel_e lvl, int timest, const char *fmt, const alog_arg *args, int nargs);
+void alog_stop();
+// never called: only to check format string by compiler
+void alog_chkfmt(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+TRUE_INLINE alog_arg alog_i(long long x){ return (alog_arg){.type = ALOG_INT, .i = x}; }
+TRUE_INLINE alog_arg alog_u(unsigned long long x){ return (alog_arg){.type = ALOG_UINT, .u = x}; }
+TRUE_INLINE alog_arg alog_d(double x){ return (alog_arg){.type = ALOG_DBL, .d = x}; }
+TRUE_INLINE alog_arg alog_s(const char *x){ return (alog_arg){.type = ALOG_STR, .s = x}; }
+TRUE_INLINE alog_arg alog_p(const void *x){ return (alog_arg){.type = ALOG_PTR, .p = x}; }
+
+#define ALOG_ARG(x) _Generic((x), \
+    _Bool: alog_u, char: alog_i, signed char: alog_i, short: alog_i, int: alog_i, long: alog_i, long long: alog_i, \
+    unsigned char: alog_u, unsigned short: alog_u, unsigned int: alog_u, unsigned long: alog_u, unsigned long long: alog_u, \
+    float: alog_d, double: alog_d, long double: alog_d, \
+    char*: alog_s, const char*: alog_s, default: alog_p)(x)
+
+#define _ALOG_CAT_(a, b)    a ## b
+#define _ALOG_CAT(a, b)     _ALOG_CAT_(a, b)
+#define _ALOG_CNT(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, N, ...) N
+#define _ALOG_M0()
+#define _ALOG_M1(a)         ALOG_ARG(a),
+#define _ALOG_M2(a, ...)    ALOG_ARG(a), _ALOG_M1(__VA_ARGS__)
+#define _ALOG_M3(a, ...)    ALOG_ARG(a), _ALOG_M2(__VA_ARGS__)
+#define _ALOG_M4(a, ...)    ALOG_ARG(a), _ALOG_M3(__VA_ARGS__)
+#define _ALOG_M5(a, ...)    ALOG_ARG(a), _ALOG_M4(__VA_ARGS__)
+#define _ALOG_M6(a, ...)    ALOG_ARG(a), _ALOG_M5(__VA_ARGS__)
+#define _ALOG_M7(a, ...)    ALOG_ARG(a), _ALOG_M6(__VA_ARGS__)
+#define _ALOG_M8(a, ...)    ALOG_ARG(a), _ALOG_M7(__VA_ARGS__)
+#define _ALOG_M9(a, ...)    ALOG_ARG(a), _ALOG_M8(__VA_ARGS__)
+#define _ALOG_M10(a, ...)   ALOG_ARG(a), _ALOG_M9(__VA_ARGS__)
+
+// log level checked here, before any formatting; `fmt` should be a string literal
+#define ALOG(log, lvl, timest, fmt, ...) do{sl_log_t *_alog = (log); \
+    if(_alog && _alog->loglevel >= (lvl)){ \
+        if(0) alog_chkfmt(fmt, ##__VA_ARGS__); \
+        alog_push(_alog, lvl, timest, fmt, (const alog_arg[]){ \
+            _ALOG_CAT(_ALOG_M, _ALOG_CNT(fmt, ##__VA_ARGS__, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0))(__VA_ARGS__) {0}}, \
+            _ALOG_CNT(fmt, ##__VA_ARGS__, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)); \
+    }}while(0)
+
+// debug messages are too frequent to write them synchronously
+#undef LOGDBG
+#define LOGDBG(...)     ALOG(sl_globlog, LOGLEVEL_DBG, 1, __VA_ARGS__)
+
 #ifdef EBUG
 
 extern sl_log_t *debuglog;
@@ -37,9 +113,9 @@ void my_free(void *ptr);
 #undef MALLOC
 #undef FREE
 #undef DBGLOG
-#define _LOG(...)       do{if(!debuglog) makedebuglog(); sl_putlogt(1, debuglog, LOGLEVEL_ERR, __VA_ARGS__);}while(0)
+#define _LOG(...)       do{if(!debuglog) makedebuglog(); ALOG(debuglog, LOGLEVEL_ERR, 1, __VA_ARGS__);}while(0)
 #define DBGLOG(...)     do{_LOG("%s (%s, line %d)", __func__, __FILE__, __LINE__); \
-                           sl_putlogt(0, debuglog, LOGLEVEL_ERR, __VA_ARGS__);}while(0)
+                           ALOG(debuglog, LOGLEVEL_ERR, 0, __VA_ARGS__);}while(0)
 //#define FNAME()         _LOG("%s (%s, line %d)", __func__, __FILE__, __LINE__)
 
 #define _str(x) #x
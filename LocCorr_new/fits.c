@@ -15,25 +15,31 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <fcntl.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "debug.h"
 #include "fits.h"
 
-static int fitsstatus = 0;
+// size of FITS block: the least size of FITS file
+#define FITS_BLOCK      (2880)
 
 /*
  * Macros for error processing when working with cfitsio functions
+ * (`fitsstatus` is local: files could be read by several threads)
  */
 #define TRYFITS(f, ...)							\
-do{ fitsstatus = 0;								\
-    f(__VA_ARGS__, &fitsstatus);				\
+do{ f(__VA_ARGS__, &fitsstatus);				\
     if(fitsstatus){								\
         fits_report_error(stderr, fitsstatus);	\
-        return FALSE;}							\
+        ret = FALSE; goto returning;}			\
 }while(0)
 #define FITSFUN(f, ...)							\
 do{ fitsstatus = 0;								\
@@ -41,80 +47,157 @@ do{ fitsstatus = 0;								\
     if(ret || fitsstatus)						\
         fits_report_error(stderr, fitsstatus);	\
 }while(0)
-#define WRITEKEY(...)							\
-do{ fitsstatus = 0;								\
-    fits_write_key(__VA_ARGS__, &fitsstatus);	\
-    if(status) fits_report_error(stderr, status);\
-}while(0)
 
-// I->data should be allocated!!!
-static inline void convflt2ima(float *f, Image *I){
-    if(!I || !I->data || !f) return;
-    float min = *f, max = min;
-    int wh = I->height * I->width;
-    #pragma omp parallel shared(min, max)
-    {
-        float min_p = min, max_p = min;
-        #pragma omp for nowait
-        for(int i = 0; i < wh; ++i){
-            if(f[i] < min_p) min_p = f[i];
-            else if(f[i] > max_p) max_p = f[i];
-        }
-        #pragma omp critical
-        {
-            if(min > min_p) min = min_p;
-            if(max < max_p) max = max_p;
+/*
+ * stretch data range min..max to 0..255 of I->data
+ * (min and max should be known before scaling, so there are two vectorized passes)
+ */
+#define STRETCH(type)                                                       \
+static void stretch_ ## type(const type *f, Image *I){                      \
+    int wh = I->height * I->width;                                          \
+    type min = *f, max = min;                                               \
+    _Pragma("omp parallel for simd reduction(min:min) reduction(max:max)")  \
+    for(int i = 0; i < wh; ++i){                                            \
+        if(f[i] < min) min = f[i];                                          \
+        if(f[i] > max) max = f[i];                                          \
+    }                                                                       \
+    float W = (max > min) ? 255.f / (float)(max - min) : 0.f;               \
+    Imtype *d = I->data;                                                    \
+    _Pragma("omp parallel for simd")                                        \
+    for(int i = 0; i < wh; ++i) d[i] = (Imtype)(W * (float)(f[i] - min));   \
+}
+STRETCH(uint16_t)
+STRETCH(float)
+
+// file mapped to memory
+typedef struct{
+    void *ptr;
+    size_t size;
+} fmap;
+
+/**
+ * @brief fmap_open - map uncompressed (or tile-compressed) FITS file to memory
+ * @param filename - file name
+ * @param m (o)    - mapping
+ * @return FALSE if file can't be mapped or it is gzipped (then cfitsio should read it by itself)
+ */
+static bool fmap_open(const char *filename, fmap *m){
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return FALSE;
+    struct stat st;
+    bool ret = FALSE;
+    if(0 == fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size >= FITS_BLOCK){
+        // private writeable mapping: cfitsio can't change file anyway
+        void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if(p != MAP_FAILED){
+            const uint8_t *b = (const uint8_t*)p;
+            if(b[0] == 0x1f && b[1] == 0x8b) munmap(p, st.st_size); // gzip
+            else{
+                m->ptr = p;
+                m->size = st.st_size;
+                ret = TRUE;
+            }
         }
     }
-    float W = 255./(max - min);
-    #pragma omp for
-    for(int i = 0; i < wh; ++i){
-         I->data[i] = (Imtype)(W*(f[i] - min));
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief firstimage - move to the first HDU with image (tile-compressed images are stored in extensions)
+ * @param fp        - opened file
+ * @param naxis (o) - amount of axes
+ * @param status    - cfitsio status
+ * @return TRUE if found
+ */
+static bool firstimage(fitsfile *fp, int *naxis, int *status){
+    int nhdus = 0, type;
+    fits_get_num_hdus(fp, &nhdus, status);
+    DBG("Got %d HDUs", nhdus);
+    for(int i = 1; i <= nhdus && !*status; ++i){
+        fits_movabs_hdu(fp, i, &type, status);
+        if(*status || type != IMAGE_HDU) continue;
+        fits_get_img_dim(fp, naxis, status);
+        if(!*status && *naxis > 0) return TRUE;
     }
-    I->maxval = 255;
-    I->minval = 0;
+    return FALSE;
 }
 
+// serializes FITS_read() if cfitsio isn't thread-safe
+static pthread_mutex_t fits_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief FITS_read - read the first image of FITS file
+ * 8-bit images are read as is, 16-bit unsigned (including BZERO=32768 ones) are read into
+ * uint16_t buffer, all others - into float; data range of not 8-bit images is stretched to 0..255;
+ * calls are serialized when cfitsio built without reentrant support
+ * @param filename - file name
+ * @param fits (o) - image
+ * @return TRUE if OK
+ */
 bool FITS_read(const char *filename, Image **fits){
     FNAME();
     bool ret = TRUE;
-    fitsfile *fp;
-    int hdunum;
-    int naxis, dtype;
-    long naxes[2];
-    Image *img = MALLOC(Image, 1);
+    int fitsstatus = 0;
+    fitsfile *fp = NULL;
+    fmap m = {0};
+    int naxis = 0, eqtype;
+    long naxes[2] = {0};
+    Image *img = NULL;
+    void *buf = NULL;
+    int locked = !fits_is_reentrant();
 
-    TRYFITS(fits_open_file, &fp, filename, READONLY);
-    FITSFUN(fits_get_num_hdus, fp, &hdunum);
-    DBG("Got %d HDUs", hdunum);
-    if(hdunum < 1){
-        WARNX(_("Can't read HDU"));
+    if(locked) pthread_mutex_lock(&fits_mutex);
+    if(fmap_open(filename, &m)){
+        DBG("File mapped to memory");
+        TRYFITS(fits_open_memfile, &fp, filename, READONLY, &m.ptr, &m.size, 0, NULL);
+    }else TRYFITS(fits_open_file, &fp, filename, READONLY);
+    if(!firstimage(fp, &naxis, &fitsstatus)){
+        WARNX(_("Can't find image HDU"));
         ret = FALSE;
         goto returning;
     }
-    // get image dimensions
-    TRYFITS(fits_get_img_param, fp, 2, &dtype, &naxis, naxes);
     DBG("Image have %d axis", naxis);
     if(naxis > 2){
         WARNX(_("Images with > 2 dimensions are not supported"));
         ret = FALSE;
         goto returning;
     }
-    img->width = naxes[0];
-    img->height = naxes[1];
-    DBG("got image %ldx%ld pix, bitpix=%d", naxes[0], naxes[1], dtype);
+    // get image dimensions and data type taking into account BZERO/BSCALE
+    TRYFITS(fits_get_img_size, fp, 2, naxes);
+    TRYFITS(fits_get_img_equivtype, fp, &eqtype);
+    if(naxis == 1) naxes[1] = 1;
+    DBG("got image %ldx%ld pix, bitpix=%d", naxes[0], naxes[1], eqtype);
+    img = Image_new(naxes[0], naxes[1]);
+    if(!img){
+        ret = FALSE;
+        goto returning;
+    }
+    img->orient = IMORIENT_BOTTOMUP;
     size_t sz = naxes[0] * naxes[1];
-    img->data = MALLOC(Imtype, sz);
-    float *targ = MALLOC(float, sz);
     int stat = 0;
-    TRYFITS(fits_read_img, fp, TFLOAT, 1, sz, NULL, targ, &stat);
-    if(stat) WARNX(_("Found %d pixels with undefined value"), stat);
-    convflt2ima(targ, img);
-    FREE(targ);
+    if(eqtype == BYTE_IMG){ // straight into image data
+        TRYFITS(fits_read_img, fp, TBYTE, 1, sz, NULL, img->data, &stat);
+    }else if(eqtype == USHORT_IMG){
+        uint16_t nul = 0;
+        buf = MALLOC(uint16_t, sz);
+        TRYFITS(fits_read_img, fp, TUSHORT, 1, sz, &nul, buf, &stat);
+        stretch_uint16_t((uint16_t*)buf, img);
+    }else{
+        float nul = 0.f;
+        buf = MALLOC(float, sz);
+        TRYFITS(fits_read_img, fp, TFLOAT, 1, sz, &nul, buf, &stat);
+        stretch_float((float*)buf, img);
+    }
+    if(stat) WARNX(_("Found pixels with undefined value"));
+    Image_minmax(img);
     DBG("ready");
 
 returning:
-    FITSFUN(fits_close_file, fp);
+    if(fp) FITSFUN(fits_close_file, fp);
+    if(locked) pthread_mutex_unlock(&fits_mutex);
+    if(m.ptr) munmap(m.ptr, m.size);
+    FREE(buf);
     if(!ret || !fits){
         Image_free(&img);
     }else *fits = img;
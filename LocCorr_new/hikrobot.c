@@ -38,9 +38,10 @@ static MV_CC_DEVICE_INFO_LIST stDeviceList;
 static void *handle = NULL;
 static char camname[BUFSIZ] = {0};
 static float exptime = 0.;      // exposition time (in seconds)
-static uint8_t *pdata = NULL;
-static int pdatasz = 0;
 static int lastecode = MV_OK;
+static int grabbing = FALSE;    // continuous acquisition is running
+// frames got by callback
+static framering ring = {.mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
 static frameformat array; // max geometry
 
 static void printErr(){
@@ -198,8 +199,20 @@ static void cam_closecam(){
         ONERR() WARNX("Can't destroy camera handle");
         handle = NULL;
     }
-    FREE(pdata);
-    pdatasz = 0;
+    grabbing = FALSE;
+    framering_clear(&ring);
+}
+
+// called by SDK for each frame
+static void imcallback(unsigned char *pData, MV_FRAME_OUT_INFO_EX *pFrameInfo, _U_ void *pUser){
+    if(!pData || !pFrameInfo) return;
+    double tend = sl_dtime();
+    Image *I = u8toImage(pData, pFrameInfo->nWidth, pFrameInfo->nHeight, pFrameInfo->nWidth);
+    if(!I) return;
+    I->seqno = (uint64_t)pFrameInfo->nFrameNum + 1; // gaps show frames lost
+    I->tend = tend;
+    I->tstart = tend - exptime;
+    framering_put(&ring, I);
 }
 
 static void PrintDeviceInfo(MV_CC_DEVICE_INFO* pstMVDevInfo){
@@ -322,8 +335,6 @@ static int cam_connect(){
         *values[i] = IntValue.nCurValue;
         DBG("%s = %d", names[i], *values[i]);
     }
-    pdatasz = array.h * array.w;
-    DBG("2*w*h = %d", pdatasz);
     if(changeenum("DeviceTemperatureSelector", 0)){
         if(!changefloat("DeviceTemperature", -20.)) WARNX("Can't set camtemp to -20");
     }
@@ -334,7 +345,11 @@ static int cam_connect(){
     ONOK(){DBG("PAYLOAD: %u", stParam.nCurValue);}
 #endif
     */
-    pdata = MALLOC(uint8_t, pdatasz); // allocate max available buffer
+    TRYERR(RegisterImageCallBackEx, imcallback, NULL);
+    ONERR(){
+        WARNX("Can't register image callback");
+        return FALSE;
+    }
     return TRUE;
 }
 
@@ -371,11 +386,13 @@ static int setexp(float e){
         return FALSE;
     }
     exptime = e;
+    framering_clear(&ring); // frames with old exposure
     return TRUE;
 }
 
 static int cam_startexp(){
-    if(!handle || !pdata) return FALSE;
+    if(!handle) return FALSE;
+    framering_clear(&ring);
     DBG("+++++ Start exposition for %gs", exptime);
     MV_CC_StopGrabbing(handle);
     TRY(StartGrabbing);
@@ -393,32 +410,18 @@ static int cam_startexp(){
 }
 
 static Image* capture(){
-    double starttime = sl_dtime();
-    static int isstarted = 0;
-    if(!isstarted){
+    if(!grabbing){
         if(!cam_startexp()) return NULL;
-        isstarted = 1;
-    }
-    MV_FRAME_OUT_INFO_EX stImageInfo = {0}; // last image info
-    DBG("^^^^^^^^^^^^^^^^^^^^ Started capt @ %g", sl_dtime() - starttime);
-    do{
-        usleep(100);
-        double diff = exptime - (sl_dtime() - starttime);
-        if(diff > 0.) continue; // wait until exposure ends
-        DBG("diff = %g", diff);
-        if(diff < -MAX_READOUT_TM){ // wait much longer than exp lasts
-            DBG("^^^^^^^^^^^^^^^^^^^^ OOps, time limit");
-            MV_CC_StopGrabbing(handle);
-            DBG("Restart grabbing");
-            if(!cam_startexp()) isstarted = 0;
-            return NULL;
-        }
-        TRY(GetOneFrameTimeout, pdata, pdatasz, &stImageInfo, 100);
-        ONOK() break;
-    }while(1);
-    DBG("^^^^^^^^^^^^^^^^^^^^ Tcapt=%g, exptime=%g", sl_dtime() - starttime, exptime);
-    Image *captIma = u8toImage(pdata, stImageInfo.nWidth, stImageInfo.nHeight, stImageInfo.nWidth);
-    DBG("^^^^^^^^^^^^^^^^^^^^ return @ %g", sl_dtime() - starttime);
+        grabbing = TRUE;
+    }
+    Image *captIma = framering_get(&ring, exptime + MAX_READOUT_TM);
+    if(!captIma){ // wait much longer than exp lasts
+        DBG("^^^^^^^^^^^^^^^^^^^^ OOps, time limit");
+        MV_CC_StopGrabbing(handle);
+        DBG("Restart grabbing");
+        if(!cam_startexp()) grabbing = FALSE;
+        return NULL;
+    }
     return captIma;
 }
 
@@ -17,6 +17,8 @@
  */
 
 #include <dirent.h>
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
@@ -37,6 +39,7 @@
 #include "hikrobot.h"
 #include "imagefile.h"
 #include "median.h"
+#include "simcam.h"
 #include "Toupcam.h"
 
 typedef struct{
@@ -54,6 +57,8 @@ const imsign signatures[] = {
     {{0xff, 0xd8, 0xff, 0xe0}, 4, T_JPEG},
     {{0xff, 0xd8, 0xff, 0xe1}, 4, T_JPEG},
     {{0x89, 0x50, 0x4e, 0x47}, 4, T_PNG},
+    {"P5", 2, T_PNM}, // raw frames dump: binary PGM
+    {"P6", 2, T_PNM},
    // {{0x49, 0x49, 0x2a, 0x00}, 4, T_TIFF},
     {"", 0, T_WRONG}
 };
@@ -117,6 +122,7 @@ InputType chkinput(const char *name){
 #ifdef TOUPCAM_FOUND
     if(0 == strcmp(name, TOUPCAM_CAPT_NAME)) return T_CAPT_TOUPCAM;
 #endif
+    if(0 == strcmp(name, SIMCAM_CAPT_NAME)) return T_CAPT_SIMULATOR;
     struct stat fd_stat;
     stat(name, &fd_stat);
     if(S_ISDIR(fd_stat.st_mode)){
@@ -141,7 +147,7 @@ InputType chkinput(const char *name){
 }
 
 /**
- * @brief u8toImage - convert uint8_t data to Image structure (flipping upside down for FITS coordinates)
+ * @brief u8toImage - convert uint8_t data (rows from top to bottom) to Image structure
  * @param data      - original image data
  * @param width     - image width
  * @param height    - image height
@@ -151,14 +157,12 @@ InputType chkinput(const char *name){
 Image *u8toImage(const uint8_t *data, int width, int height, int stride){
     //FNAME();
     Image *outp = Image_new(width, height);
-    // flip image updown for FITS coordinate system
-    OMP_FOR()
-    for(int y = 0; y < height; ++y){
-        Imtype *Out = &outp->data[(height-1-y)*width];
-        const uint8_t *In = &data[y*stride];
-        for(int x = 0; x < width; ++x){
-            *Out++ = (Imtype)(*In++);
-        }
+    outp->orient = IMORIENT_TOPDOWN; // keep native order, flip coordinates only
+    if(stride == width) memcpy(outp->data, data, (size_t)width * height);
+    else{
+        OMP_FOR()
+        for(int y = 0; y < height; ++y)
+            memcpy(&outp->data[y*width], &data[y*stride], width);
     }
     Image_minmax(outp);
     return outp;
@@ -208,20 +212,21 @@ Image *Image_read(const char *name){
  * @return data allocated here
  */
 Image *Image_new(int w, int h){
-    static uint64_t cnt = 0;
+    static _Atomic uint64_t cnt = 0; // images could be created by several threads
     if(w < 1 || h < 1) return NULL;
-    DBGLOG("Image_new(%d, #%u)", w*h, cnt);
+    uint64_t n = atomic_fetch_add(&cnt, 1);
+    DBGLOG("Image_new(%d, #%" PRIu64 ")", w*h, n);
     Image *outp = MALLOC(Image, 1);
     outp->width = w;
     outp->height = h;
-    outp->counter = cnt++;
+    outp->counter = n;
     outp->data = MALLOC(Imtype, w*h);
     return outp;
 }
 
 void Image_free(Image **I){
     if(!I || !*I) return;
-    DBGLOG("Image_free(%d, #%d)", (*I)->height * (*I)->width, (*I)->counter);
+    DBGLOG("Image_free(%d, #%" PRIu64 ")", (*I)->height * (*I)->width, (*I)->counter);
     FREE((*I)->data);
     FREE(*I);
 }
@@ -229,11 +234,18 @@ void Image_free(Image **I){
 /**
  * @brief Image_sim - allocate memory for new empty Image with similar size & data type
  * @param i - sample image
- * @return data allocated here (with empty keylist & zeros in data)
+ * @return data allocated here (with zeros in data, timestamps and orientation of `i`)
  */
 Image *Image_sim(const Image *i){
     if(!i) return NULL;
     Image *outp = Image_new(i->width, i->height);
+    if(outp){ // derived image describes the same exposure
+        outp->tstart = i->tstart;
+        outp->tend = i->tend;
+        outp->exptime = i->exptime;
+        outp->gain = i->gain;
+        outp->orient = i->orient;
+    }
     return outp;
 }
 
@@ -317,7 +329,7 @@ int calc_background(Image *img){
 
 
 /**
- * @brief linear - linear transform for preparing file to save as JPEG or other type (mirror image upside down!)
+ * @brief linear - linear transform for preparing file to save as JPEG or other type (rows from top to bottom)
  * @param I - input image
  * @param nchannels - 1 or 3 colour channels
  * @return allocated here image for jpeg/png storing
@@ -333,8 +345,8 @@ uint8_t *linear(const Image *I, int nchannels){ // only 1 and 3 channels support
     if(nchannels == 3){
         OMP_FOR()
         for(int y = 0; y < height; ++y){
-            uint8_t *Out = &outp[(height-1-y)*stride];
-            Imtype *In = &I->data[y*width];
+            uint8_t *Out = &outp[y*stride];
+            const Imtype *In = Image_toprow(I, y);
             for(int x = 0; x < width; ++x){
                 Out[0] = Out[1] = Out[2] = (uint8_t)(W*((float)(*In++) - min));
                 Out += 3;
@@ -343,8 +355,8 @@ uint8_t *linear(const Image *I, int nchannels){ // only 1 and 3 channels support
     }else{
         OMP_FOR()
         for(int y = 0; y < height; ++y){
-            uint8_t *Out = &outp[(height-1-y)*width];
-            Imtype *In = &I->data[y*width];
+            uint8_t *Out = &outp[y*width];
+            const Imtype *In = Image_toprow(I, y);
             for(int x = 0; x < width; ++x){
                 *Out++ = (uint8_t)(W*((float)(*In++) - min));
             }
@@ -354,7 +366,7 @@ uint8_t *linear(const Image *I, int nchannels){ // only 1 and 3 channels support
 }
 
 /**
- * @brief equalize - hystogram equalization (mirror image upside down!)
+ * @brief equalize - hystogram equalization (rows from top to bottom)
  * @param I - input image
  * @param nchannels - 1 or 3 colour channels
  * @param throwpart - which part of black pixels (from all amount) to throw away
@@ -397,8 +409,8 @@ uint8_t *equalize(const Image *I, int nchannels, double throwpart){
     if(nchannels == 3){
         OMP_FOR()
         for(int y = 0; y < height; ++y){
-            uint8_t *Out = &outp[(height-1-y)*stride];
-            Imtype *In = &I->data[y*width];
+            uint8_t *Out = &outp[y*stride];
+            const Imtype *In = Image_toprow(I, y);
             for(int x = 0; x < width; ++x){
                 Out[0] = Out[1] = Out[2] = eq_levls[*In++];
                 Out += 3;
@@ -407,8 +419,8 @@ uint8_t *equalize(const Image *I, int nchannels, double throwpart){
     }else{
         OMP_FOR()
         for(int y = 0; y < height; ++y){
-            uint8_t *Out = &outp[(height-1-y)*width];
-            Imtype *In = &I->data[y*width];
+            uint8_t *Out = &outp[y*width];
+            const Imtype *In = Image_toprow(I, y);
             for(int x = 0; x < width; ++x){
                 *Out++ = eq_levls[*In++];
             }
@@ -418,7 +430,7 @@ uint8_t *equalize(const Image *I, int nchannels, double throwpart){
 }
 
 /**
- * @brief Image_write_jpg - save image as JPG file (flipping upside down)
+ * @brief Image_write_jpg - save image as JPG file
  * @param I - image
  * @param name - filename
  * @param eq == 0 to write linear, != 0 to write equalized image
@@ -529,8 +541,23 @@ uint8_t *Im2bin(const Image *im, Imtype bk){
     if(!im) return NULL;
     int W = im->width, H = im->height;
     if(W < 2 || H < 2) return NULL;
+    uint8_t *ret = MALLOC(uint8_t, ((W + 7) / 8) * H);
+    return Im2bin_to(im, bk, ret);
+}
+
+/**
+ * Convert image into pseudo-packed one in caller-provided buffer
+ * @param im (i)  - image to convert
+ * @param bk      - background level
+ * @param dst (o) - output buffer (W0*H bytes)
+ * @return dst
+ */
+uint8_t *Im2bin_to(const Image *im, Imtype bk, uint8_t *dst){
+    if(!im || !dst) return NULL;
+    int W = im->width, H = im->height;
+    if(W < 2 || H < 2) return NULL;
     int y, W0 = (W + 7) / 8, s1 = (W/8 == W0) ? W0 : W0 - 1;
-    uint8_t *ret = MALLOC(uint8_t, W0 * H);
+    uint8_t *ret = dst;
     OMP_FOR()
     for(y = 0; y < H; ++y){
         Imtype *iptr = &im->data[y*W];
@@ -582,6 +609,13 @@ Image *ST2Im(const size_t *image, int W, int H){
  */
 size_t *bin2ST(const uint8_t *image, int W, int H){
     size_t *ret = MALLOC(size_t, W * H);
+    return bin2ST_to(image, W, H, ret);
+}
+
+// convert "packed" image into caller-provided size_t array `dst` (W*H elements)
+size_t *bin2ST_to(const uint8_t *image, int W, int H, size_t *dst){
+    if(!dst) return NULL;
+    size_t *ret = dst;
     int W0 = (W + 7) / 8, s1 = W0 - 1;
     OMP_FOR()
     for(int y = 0; y < H; y++){
@@ -29,14 +29,22 @@
 
 typedef uint8_t Imtype;
 // 65536 if Imtype is uint16_t
-// WARNING! Check code if you change Imtype: e.g. recalcexp() and other
+// WARNING! Check code if you change Imtype: e.g. autoexp() and other
 #define HISTOSZ (256)
 
-typedef struct{ // statistics: mean, RMS, area
+typedef struct{ // statistics: mean, RMS, area, flux over background and peak value
     float xc; float yc; float xsigma; float ysigma;
     int area;
+    float flux;
+    Imtype peak;
 } ptstat_t;
 
+// order of rows in Image.data
+typedef enum{
+    IMORIENT_BOTTOMUP,  // first row is the bottom one (FITS)
+    IMORIENT_TOPDOWN,   // first row is the top one (cameras and most of image formats)
+} Imorient;
+
 typedef struct{
     int width;			// width
     int height;			// height
@@ -47,6 +55,12 @@ typedef struct{
     Imtype background;  // background value
     ptstat_t stat;      // image statistics
     uint64_t counter;   // image counter
+    uint64_t seqno;     // frame number from camera (0 if unknown)
+    double tstart;      // exposure start and end (sl_dtime(), 0 if unknown)
+    double tend;
+    float exptime;      // exposition (ms) and gain frame was captured with (0 if unknown)
+    float gain;
+    Imorient orient;    // rows order; all coordinates outside of image processing are in FITS system (Y axis up)
 } Image;
 
 // input file/directory type
@@ -59,12 +73,23 @@ typedef enum{
     T_GIF,
     T_JPEG,
     T_PNG,
+    T_PNM,
     T_CAPT_GRASSHOPPER, // capture grasshopper
     T_CAPT_BASLER,
     T_CAPT_HIKROBOT,
     T_CAPT_TOUPCAM,
+    T_CAPT_SIMULATOR,
 } InputType;
 
+// pointer to y'th row counting from the top (as in output JPEG)
+static inline Imtype *Image_toprow(const Image *I, int y){
+    return &I->data[((I->orient == IMORIENT_TOPDOWN) ? y : I->height - 1 - y) * I->width];
+}
+// convert Y coordinate between image data and FITS (Y axis up) system (conversion is symmetric)
+static inline float Image_fitsY(const Image *I, float y){
+    return (I->orient == IMORIENT_TOPDOWN) ? (float)(I->height - 1) - y : y;
+}
+
 void Image_minmax(Image *I);
 uint8_t *linear(const Image *I, int nchannels);
 uint8_t *equalize(const Image *I, int nchannels, double throwpart);
@@ -80,7 +105,9 @@ int calc_background(Image *img);
 Image *u8toImage(const uint8_t *data, int width, int height, int stride);
 Image *bin2Im(const uint8_t *image, int W, int H);
 uint8_t *Im2bin(const Image *im, Imtype bk);
+uint8_t *Im2bin_to(const Image *im, Imtype bk, uint8_t *dst);
 size_t *bin2ST(const uint8_t *image, int W, int H);
+size_t *bin2ST_to(const uint8_t *image, int W, int H, size_t *dst);
 //Image *ST2Im(const size_t *image, int W, int H);
 
 #endif // IMAGEFILE_H__
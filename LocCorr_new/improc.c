@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <inttypes.h>
 #include <math.h>
 #include <stb/stb_image_write.h>
 #include <stdbool.h>
@@ -34,6 +35,8 @@
 #include "imagefile.h"
 #include "improc.h"
 #include "inotify.h"
+#include "latency.h"
+#include "simcam.h"
 #include "steppers.h"
 #include "Toupcam.h"
 
@@ -56,6 +59,7 @@ typedef struct{
     double yc;
     double xsigma;      // STD by horizontal and vertical axes
     double ysigma;
+    Imtype peak;        // max pixel value
 } object;
 
 // functions for Qsort
@@ -100,33 +104,35 @@ int XYcomment(char *cmnt){
     return TRUE;
 }
 
+static int avercounter = 0; // amount of coordinates in averaging window of getDeviation()
+
 static void getDeviation(object *curobj){
     int averflag = 0;
     static double Xc[NAVER_MAX+1], Yc[NAVER_MAX+1];
     double xx = curobj->xc, yy = curobj->yc, xsum2 = 0., ysum2 = 0.;
     double Sx = 0., Sy = 0.;
-    static int counter = 0;
-    Xc[counter] = curobj->xc; Yc[counter] = curobj->yc;
+    latency_stamp(LAT_DEVIATION);
+    Xc[avercounter] = curobj->xc; Yc[avercounter] = curobj->yc;
     if(fXYlog){ // make log record
         fprintf(fXYlog, "%-14.2f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t",
                 sl_dtime() - tstart, curobj->xc, curobj->yc,
                 curobj->xsigma, curobj->ysigma, curobj->WdivH);
     }
-    //DBG("counter = %d", counter);
-    if(++counter < theconf.naverage){
+    //DBG("avercounter = %d", avercounter);
+    if(++avercounter < theconf.naverage){
         goto process_corrections;
     }
     // it's time to calculate average deviations
     xx = 0.; yy = 0.;
-    for(int i = 0; i < counter; ++i){
+    for(int i = 0; i < avercounter; ++i){
         double x = Xc[i], y = Yc[i];
         xx += x; yy += y;
         xsum2 += x*x; ysum2 += y*y;
     }
-    xx /= counter; yy /= counter;
-    Sx = sqrt(xsum2/counter - xx*xx);
-    Sy = sqrt(ysum2/counter - yy*yy);
-    counter = 0;
+    xx /= avercounter; yy /= avercounter;
+    Sx = sqrt(xsum2/avercounter - xx*xx);
+    Sy = sqrt(ysum2/avercounter - yy*yy);
+    avercounter = 0;
 #ifdef EBUG
     green("\n Average centroid: X=%.1f (+-%.1f), Y=%.1f (+-%.1f)\n", xx, Sx, yy, Sy);
 #endif
@@ -137,7 +143,9 @@ process_corrections:
     //LOGDBG("here");
     if(theSteppers){
         DBG("Process corrections");
-        if(theSteppers->proc_corr && averflag){
+        if(theconf.ncoadd > 1 && theconf.fastcorr){
+            DBG("Corrections are made by fast centroids");
+        }else if(theSteppers->proc_corr && averflag){
             if(Sx > XY_TOLERANCE || Sy > XY_TOLERANCE){
                 LOGDBG("Bad value - not process"); // don't run processing for bad data
             }else
@@ -151,13 +159,50 @@ process_corrections:
     XYnewline();
 }
 
+/**
+ * @brief fastDeviation - process corrections by fast (unstacked) centroid of each frame
+ *      (co-adding delays stacked centroid by `ncoadd` frames, so fast centroids are used instead when `fastcorr`)
+ * @param x, y - fast centroid of current frame (in FITS coordinates of subimage) or negative if star is lost
+ */
+void fastDeviation(float x, float y){
+    static double Xc[NAVER_MAX+1], Yc[NAVER_MAX+1];
+    static int counter = 0;
+    if(!theSteppers){
+        counter = 0;
+        return;
+    }
+    if(theSteppers->ismoving && theSteppers->ismoving()){ // don't mix coordinates before and after moving
+        counter = 0;
+        if(theSteppers->moving) theSteppers->moving();
+        return;
+    }
+    if(x < 0.f || y < 0.f) return;
+    if(counter >= theconf.fastaver) counter = 0; // `fastaver` was decreased
+    Xc[counter] = x; Yc[counter] = y;
+    if(++counter < theconf.fastaver) return;
+    double xx = 0., yy = 0., xsum2 = 0., ysum2 = 0.;
+    for(int i = 0; i < counter; ++i){
+        xx += Xc[i]; yy += Yc[i];
+        xsum2 += Xc[i]*Xc[i]; ysum2 += Yc[i]*Yc[i];
+    }
+    xx /= counter; yy /= counter;
+    double Sx = sqrt(fabs(xsum2/counter - xx*xx)), Sy = sqrt(fabs(ysum2/counter - yy*yy));
+    counter = 0;
+    LOGDBG("fastDeviation(): Average centroid: X=%.1f (+-%.1f), Y=%.1f (+-%.1f)", xx, Sx, yy, Sy);
+    if(Sx > theconf.fasttol || Sy > theconf.fasttol){
+        LOGDBG("Bad value - not process");
+        return;
+    }
+    if(theSteppers->proc_corr) theSteppers->proc_corr(xx, yy);
+}
+
 /**
  * @brief sumAndStat - calculate statistics in region of interest
  * @param I - image (with background calculated)
  * @param mask - labeled mask for objects (or NULL)
  * @param idx - index on labeled mask
  * @param roi - region of interest
- * @param stat - (region - bacground) statistics
+ * @param stat - (region - bacground) statistics, flux and peak value
  * @return total intensity sum
  */
 static float sumAndStat(const Image *I, const size_t *mask, size_t idx, const il_Box *roi, ptstat_t *stat){
@@ -165,6 +210,7 @@ static float sumAndStat(const Image *I, const size_t *mask, size_t idx, const il
     //FNAME();
     float xc = 0., yc = 0.;
     float x2c = 0., y2c = 0., Isum = 0.;
+    Imtype peak = 0;
     int W = I->width;
     //DBG("imw=%d, roi=%d:%d:%d:%d", W, roi->xmin, roi->xmax, roi->ymin, roi->ymax);
     // dumb calculation as paralleling could be much slower
@@ -177,6 +223,7 @@ static float sumAndStat(const Image *I, const size_t *mask, size_t idx, const il
         for(int x = roi->xmin; x <= roi->xmax; ++x, ++Iptr){
             if(maskptr){if(*maskptr++ != idx) continue;}
             if(*Iptr <= I->background) continue;
+            if(*Iptr > peak) peak = *Iptr;
             float intens = (float)(*Iptr - I->background);
             float xw = x * intens, yw = y * intens;
             xc += xw;
@@ -191,6 +238,8 @@ static float sumAndStat(const Image *I, const size_t *mask, size_t idx, const il
         stat->yc = yc / Isum;
         stat->xsigma = x2c/Isum - stat->xc*stat->xc;
         stat->ysigma = y2c/Isum - stat->yc*stat->yc;
+        stat->flux = Isum;
+        stat->peak = peak;
     }
     //DBG("xc=%g, yc=%g, xs=%g, ys=%g", stat->xc, stat->yc, stat->xsigma, stat->ysigma);
     return Isum;
@@ -199,11 +248,170 @@ static float sumAndStat(const Image *I, const size_t *mask, size_t idx, const il
 #define MAX(a, b)   ((a) > (b) ? (a) : (b))
 #define MIN(a, b)   ((a) < (b) ? (a) : (b))
 
+// reference stars for ensemble centroid
+static struct{
+    int N;                      // amount of reference stars (0 - not initialized)
+    int K;                      // value of `theconf.ensemble` they were chosen with
+    double x[ENSEMBLE_MAX];     // their positions
+    double y[ENSEMBLE_MAX];
+    double I[ENSEMBLE_MAX];     // and intensities
+    double dx, dy;              // last shift of ensemble relative to reference positions
+} ensref = {0};
+
+static int compDbl(const void *a, const void *b){
+    double d = *(const double*)a - *(const double*)b;
+    return (d < 0.) ? -1 : (d > 0.) ? 1 : 0;
+}
+
+// median of `n` values (array `arr` will be sorted)
+static double dblmedian(double *arr, int n){
+    qsort(arr, n, sizeof(double), compDbl);
+    if(n & 1) return arr[n/2];
+    return (arr[n/2 - 1] + arr[n/2]) / 2.;
+}
+
+/**
+ * @brief ensembleCentroid - calculate position of main star by flux-weighted shift of `theconf.ensemble` stars
+ * @param objs - sorted objects of current frame
+ * @param N    - their amount
+ * @return FALSE if can't calculate (reference stars absent or not found); TRUE if found and
+ *      objs[0] now is the main star with position corrected by ensemble shift
+ */
+static int ensembleCentroid(object *objs, int N){
+    int K = theconf.ensemble;
+    if(K < 2){
+        ensref.N = 0;
+        return FALSE;
+    }
+    if(N < 2) return FALSE;
+    if(K > N) K = N;
+    if(ensref.N < 2 || ensref.K != theconf.ensemble){ // (re)initialize reference stars
+        for(int i = 0; i < K; ++i){
+            ensref.x[i] = objs[i].xc; ensref.y[i] = objs[i].yc;
+            ensref.I[i] = objs[i].Isum;
+        }
+        ensref.N = K;
+        ensref.K = theconf.ensemble;
+        ensref.dx = ensref.dy = 0.;
+        LOGDBG("ensembleCentroid(): new %d reference stars", K);
+        return FALSE;
+    }
+    int match[ENSEMBLE_MAX], nmatched = 0;
+    uint8_t used[ENS_MAXOBJ] = {0}; // flags of already matched objects
+    int Nused = MIN(N, ENS_MAXOBJ);
+    double dx[ENSEMBLE_MAX], dy[ENSEMBLE_MAX], mx[ENSEMBLE_MAX], my[ENSEMBLE_MAX];
+    for(int i = 0; i < ensref.N; ++i){
+        match[i] = -1;
+        double xp = ensref.x[i] + ensref.dx, yp = ensref.y[i] + ensref.dy;
+        double r2min = ENS_MATCHRAD * ENS_MATCHRAD;
+        for(int j = 0; j < Nused; ++j){
+            if(used[j]) continue;
+            double ddx = objs[j].xc - xp, ddy = objs[j].yc - yp, r2 = ddx*ddx + ddy*ddy;
+            if(r2 > r2min) continue;
+            if(fabs(objs[j].Isum - ensref.I[i]) / (objs[j].Isum + ensref.I[i]) > ENS_FLUXTOL) continue;
+            r2min = r2; match[i] = j;
+        }
+        if(match[i] < 0) continue;
+        used[match[i]] = 1;
+        dx[i] = mx[nmatched] = objs[match[i]].xc - ensref.x[i];
+        dy[i] = my[nmatched] = objs[match[i]].yc - ensref.y[i];
+        ++nmatched;
+    }
+    if(match[0] < 0 || nmatched < 2){
+        LOGDBG("ensembleCentroid(): only %d of %d stars matched; reinit", nmatched, ensref.N);
+        ensref.N = 0;
+        return FALSE;
+    }
+    // per-star outliers rejection by median shift
+    double medx = dblmedian(mx, nmatched), medy = dblmedian(my, nmatched);
+    double sx = 0., sy = 0., sw = 0.;
+    int ngood = 0;
+    for(int i = 0; i < ensref.N; ++i){
+        if(match[i] < 0) continue;
+        if(fabs(dx[i] - medx) > ENS_OUTLIER || fabs(dy[i] - medy) > ENS_OUTLIER){
+            DBG("star %d is outlier: dx=%g, dy=%g", i, dx[i], dy[i]);
+            match[i] = (i == 0) ? match[0] : -1; // main star keeps its place even if it's outlier
+            continue;
+        }
+        double w = objs[match[i]].Isum;
+        sx += w * dx[i]; sy += w * dy[i]; sw += w;
+        ++ngood;
+    }
+    if(ngood < 2 || sw <= 0.){
+        LOGDBG("ensembleCentroid(): too few good stars (%d)", ngood);
+        return FALSE;
+    }
+    ensref.dx = sx / sw; ensref.dy = sy / sw;
+    // refine reference positions by residuals to decrease their own noise
+    for(int i = 0; i < ensref.N; ++i){
+        if(match[i] < 0) continue;
+        ensref.x[i] += ENS_ANCHOR_ALPHA * (dx[i] - ensref.dx);
+        ensref.y[i] += ENS_ANCHOR_ALPHA * (dy[i] - ensref.dy);
+    }
+    if(match[0]){ // move main star to the first place
+        object tmp = objs[0];
+        objs[0] = objs[match[0]];
+        objs[match[0]] = tmp;
+    }
+    objs[0].xc = ensref.x[0] + ensref.dx;
+    objs[0].yc = ensref.y[0] + ensref.dy;
+    DBG("Ensemble of %d stars: shift (%g, %g), main star @ (%g, %g)", ngood, ensref.dx, ensref.dy, objs[0].xc, objs[0].yc);
+    return TRUE;
+}
+
+/**
+ * @brief quickCentroid - fast centroid in ROI around given position (without binarization and labeling)
+ * @param I - image (its background would be recalculated)
+ * @param x, y (io) - expected star position on input and its centroid on output (in FITS coordinates)
+ * @return FALSE if star not found
+ */
+int quickCentroid(Image *I, float *x, float *y){
+    if(!I || !x || !y || *x < 0.f || *y < 0.f) return FALSE;
+    int W = I->width, H = I->height, x0 = (int)*x, y0 = (int)Image_fitsY(I, *y);
+    if(x0 >= W || y0 < 0 || y0 >= H) return FALSE;
+    if(!calc_background(I)) return FALSE;
+    il_Box roi = {.xmin = MAX(x0 - ROI_SIZE/2, 0),
+                  .xmax = MIN(x0 + ROI_SIZE/2, W-1),
+                  .ymin = MAX(y0 - ROI_SIZE/2, 0),
+                  .ymax = MIN(y0 + ROI_SIZE/2, H-1)};
+    ptstat_t stat;
+    if(sumAndStat(I, NULL, 0, &roi, &stat) <= 0.) return FALSE;
+    double WdH = stat.xsigma/stat.ysigma;
+    if(isnan(WdH) || isinf(WdH) || WdH < theconf.minwh || WdH > theconf.maxwh) return FALSE;
+    *x = stat.xc; *y = Image_fitsY(I, stat.yc);
+    I->stat.flux = stat.flux; // photometry for exposition control
+    I->stat.peak = stat.peak;
+    return TRUE;
+}
+
+// times of last process_file() stages (seconds)
+static double stagetimes[STAGE_AMOUNT] = {0};
+static const char *stagenames[STAGE_AMOUNT] = {
+    [STAGE_BACKGROUND] = "background",
+    [STAGE_ROI] = "roi",
+    [STAGE_BINARIZE] = "binarize",
+    [STAGE_EROSION] = "erosion",
+    [STAGE_DILATION] = "dilation",
+    [STAGE_LABELING] = "labeling",
+    [STAGE_DEVIATION] = "deviation",
+    [STAGE_OUTPUT] = "output",
+    [STAGE_TOTAL] = "total",
+};
+
+const double *getStageTimes(){ return stagetimes; }
+const char *getStageName(procstage s){
+    if(s < 0 || s >= STAGE_AMOUNT) return NULL;
+    return stagenames[s];
+}
+
 void process_file(Image *I){
     static double lastTproc = 0.;
     static int prev_x = -1, prev_y = -1;
-    static object *Objects = NULL;
-    static size_t Nallocated = 0;
+    static il_Arena arena = {0}; // temporary arrays of current frame
+    object *Objects = NULL;
+    double tbegin = sl_dtime(), tmark = tbegin;
+#define STAGE(s) do{double t = sl_dtime(); stagetimes[s] += t - tmark; tmark = t;}while(0)
+    memset(stagetimes, 0, sizeof(stagetimes));
 #ifdef EBUG
     double t0 = sl_dtime(), tlast = t0;
 #define DELTA(p) do{double t = sl_dtime(); DBG("---> %s @ %gms (delta: %gms)", p, (t-t0)*1e3, (t-tlast)*1e3); tlast = t;}while(0)
@@ -219,13 +427,34 @@ void process_file(Image *I){
         WARNX("No image");
         return;
     }
+    latency_newframe(I);
     int W = I->width, H = I->height;
+    size_t binsz = (size_t)((W + 7) / 8) * H;
+    // binary images, labels and "remark" array
+    il_Arena_reset(&arena, 3*binsz + (size_t)W*H*sizeof(size_t)*5/4);
+    if(theSteppers && theSteppers->ismoving && theSteppers->ismoving()){
+        // correctors are moving: coordinates are useless, so only track star and save decimated preview
+        static int nmoving = 0;
+        float x = prev_x, y = (prev_y < 0) ? -1.f : Image_fitsY(I, prev_y);
+        if(quickCentroid(I, &x, &y)){
+            prev_x = (int)x; prev_y = (int)Image_fitsY(I, y);
+            xc = x + theconf.xoff; yc = y + theconf.yoff;
+        }
+        STAGE(STAGE_ROI);
+        if(++nmoving % MOVING_PREVIEW_DECIM == 0) Image_write_jpg(I, GP->outputjpg, theconf.equalize);
+        DELTA("Moving: quick centroid");
+        // don't mix coordinates before and after moving in one average; steppers will throw away the first one
+        avercounter = 0;
+        if(theSteppers->moving) theSteppers->moving();
+        goto ENDPROC;
+    }
     //save_fits(I, "fitsout.fits");
     //DELTA("Save original");
     if(calc_background(I)){
         DBG("backgr = %d", I->background);
         theconf.background = I->background;
         DELTA("Got background");
+        STAGE(STAGE_BACKGROUND);
         int objctr = 0;
         if(prev_x > 0 && prev_y > 0){
             // Define ROI bounds
@@ -239,6 +468,7 @@ void process_file(Image *I){
             double sum = sumAndStat(I, NULL, 0, &roi, &stat);
             if(sum > 0.){
                 I->stat = stat;
+                I->stat.yc = Image_fitsY(I, stat.yc);
                 if( fabsf(stat.xc - prev_x) > XY_TOLERANCE ||
                     fabsf(stat.yc - prev_y) > XY_TOLERANCE){
                     DBG("Bad: was x=%d, y=%d; become x=%g, y=%g ==> need fine calculations", prev_x, prev_y, xc, yc);
@@ -254,15 +484,13 @@ void process_file(Image *I){
                         prev_y = (int)stat.yc;
                         DBG("Simplest centroid, Xc=%g, Yc=%g", stat.xc, stat.yc);
                         objctr = 1;
-                        if(!Objects){
-                            Objects = (object*)malloc(sizeof(object));
-                            Nallocated = 1;
-                        }
+                        Objects = il_Arena_alloc(&arena, sizeof(object));
                         Objects[0] = (object){
                             .area = area, .Isum = sum,
-                            .WdivH = WdH, .xc = stat.xc, .yc = stat.yc,
-                            .xsigma = stat.xsigma, .ysigma = stat.ysigma
+                            .WdivH = WdH, .xc = stat.xc, .yc = Image_fitsY(I, stat.yc),
+                            .xsigma = stat.xsigma, .ysigma = stat.ysigma, .peak = stat.peak
                         };
+                        STAGE(STAGE_ROI);
                         goto SKIP_FULL_PROCESS; // Skip full image processing
                     }else{
                         DBG("BAD image: WdH=%g, area=%g, xsigma=%g, ysigma=%g", WdH, area, stat.xsigma, stat.ysigma);
@@ -270,43 +498,50 @@ void process_file(Image *I){
                 }
             }
         }
-        uint8_t *ibin = Im2bin(I, I->background);
+        STAGE(STAGE_ROI);
+        uint8_t *ibin = Im2bin_to(I, I->background, il_Arena_alloc(&arena, binsz));
         DELTA("Made binary");
+        STAGE(STAGE_BINARIZE);
         if(ibin){
             if(theconf.writedebugimgs){
                 Image *Itmp = bin2Im(ibin, I->width, I->height);
+                Itmp->orient = I->orient;
                 Image_write_jpg(Itmp, "binary.jpg", 1);
                 Image_free(&Itmp);
                 DELTA("save binary");
             }
-            uint8_t *er = il_erosionN(ibin, W, H, theconf.Nerosions);
-            FREE(ibin);
+            // three buffers in turn: ibin -> er (via tmp) -> opn (via ibin)
+            uint8_t *tmp = il_Arena_alloc(&arena, binsz);
+            uint8_t *er = il_erosionN_to(ibin, il_Arena_alloc(&arena, binsz), tmp, W, H, theconf.Nerosions);
             DELTA("Erosion");
+            STAGE(STAGE_EROSION);
             if(theconf.writedebugimgs){
                 Image *Itmp = bin2Im(er, I->width, I->height);
+                Itmp->orient = I->orient;
                 Image_write_jpg(Itmp, "erosion.jpg", 1);
                 Image_free(&Itmp);
                 DELTA("Save erosion");
             }
-            uint8_t *opn = il_dilationN(er, W, H, theconf.Ndilations);
-            FREE(er);
+            uint8_t *opn = il_dilationN_to(er, tmp, ibin, W, H, theconf.Ndilations);
             DELTA("Opening");
+            STAGE(STAGE_DILATION);
             if(theconf.writedebugimgs){
                 Image *Itmp = bin2Im(opn, I->width, I->height);
+                Itmp->orient = I->orient;
                 Image_write_jpg(Itmp, "opening.jpg", 1);
                 Image_free(&Itmp);
                 DELTA("Save opening");
             }
-            il_ConnComps *cc = NULL;
-            size_t *S = il_cclabel4(opn, W, H, &cc);
-            FREE(opn);
-            if(S && cc) DBG("Nobj=%zd", cc->Nobj-1);
-            if(S && cc && cc->Nobj > 1){ // Nobj = amount of objects + 1
+            il_ConnComps ccomps = {0}, *cc = &ccomps;
+            size_t *S = NULL;
+            if(opn){
+                size_t *labels = il_Arena_alloc(&arena, (size_t)W*H*sizeof(size_t));
+                S = theconf.cclabel8 ? il_cclabel8_to(opn, W, H, labels, cc, &arena) : il_cclabel4_to(opn, W, H, labels, cc, &arena);
+            }
+            if(S) DBG("Nobj=%zd", cc->Nobj-1);
+            if(S && cc->Nobj > 1){ // Nobj = amount of objects + 1
                 DBGLOG("Nobj=%zd", cc->Nobj-1);
-                if(Nallocated < cc->Nobj-1){
-                    Nallocated = cc->Nobj-1;
-                    Objects = realloc(Objects, Nallocated*sizeof(object));
-                }
+                Objects = il_Arena_alloc(&arena, (cc->Nobj-1)*sizeof(object));
                 I->stat.area = cc->boxes[1].area;
                 for(size_t i = 1; i < cc->Nobj; ++i){
                     il_Box *b = &cc->boxes[i];
@@ -323,8 +558,8 @@ void process_file(Image *I){
                         }
                         Objects[objctr++] = (object){
                             .area = b->area, .Isum = sum,
-                            .WdivH = wh, .xc = stat.xc, .yc = stat.yc,
-                            .xsigma = stat.xsigma, .ysigma = stat.ysigma
+                            .WdivH = wh, .xc = stat.xc, .yc = Image_fitsY(I, stat.yc),
+                            .xsigma = stat.xsigma, .ysigma = stat.ysigma, .peak = stat.peak
                         };
                     }
                 }
@@ -335,10 +570,14 @@ void process_file(Image *I){
                         qsort(Objects, objctr, sizeof(object), compIntens);
                     else
                         qsort(Objects, objctr, sizeof(object), compDist);
+                    ensembleCentroid(Objects, objctr);
+                }
+                if(objctr){ // photometry of tracked star for exposition control
+                    I->stat.flux = Objects[0].Isum;
+                    I->stat.peak = Objects[0].peak;
                 }
             }
-            FREE(S);
-            FREE(cc);
+            STAGE(STAGE_LABELING);
         }
 SKIP_FULL_PROCESS:
         DBGLOG("T%.2f, N=%d\n", sl_dtime(), objctr);
@@ -358,6 +597,7 @@ SKIP_FULL_PROCESS:
             getDeviation(Objects); // calculate dX/dY and process corrections
         }
         DELTA("prepare image");
+        STAGE(STAGE_DEVIATION);
         { // prepare image and save jpeg
             uint8_t *outp = NULL;
             if(theconf.equalize)
@@ -397,11 +637,15 @@ SKIP_FULL_PROCESS:
         xc = -1.; yc = -1.;
         Image_write_jpg(I, GP->outputjpg, theconf.equalize);
     }
+    STAGE(STAGE_OUTPUT);
     DBGLOG("Image saved");
+ENDPROC:
     ++ImNumber;
     if(lastTproc > 1.) FPS = 1. / (sl_dtime() - lastTproc);
     lastTproc = sl_dtime();
+    stagetimes[STAGE_TOTAL] = lastTproc - tbegin;
     DELTA("End");
+#undef STAGE
 }
 
 static char *localimages(const char *messageid, int isdir, char *buf, int buflen){
@@ -409,8 +653,16 @@ static char *localimages(const char *messageid, int isdir, char *buf, int buflen
     if(!impath){
         if(!realpath(GP->outputjpg, impath)) impath = strdup(GP->outputjpg);
     }
-    snprintf(buf, buflen, "{ \"%s\": \"%s\", \"camstatus\": \"watch %s\", \"impath\": \"%s\", \"xcenter\": %.1f, \"ycenter\": %.1f }",
+    int l = snprintf(buf, buflen, "{ \"%s\": \"%s\", \"camstatus\": \"watch %s\", \"impath\": \"%s\", \"xcenter\": %.1f, \"ycenter\": %.1f",
              MESSAGEID, messageid, isdir ? "directory" : "file", impath, xc, yc);
+    if(isdir && l > 0 && l < buflen){ // decoding pipeline metrics
+        dirpipestat st;
+        dirpipe_stat(&st);
+        l += snprintf(buf + l, buflen - l, ", \"files\": %" PRIu64 ", \"decoded\": %" PRIu64 ", \"notimages\": %" PRIu64
+                      ", \"dropped\": %" PRIu64 ", \"processed\": %" PRIu64 ", \"backlog\": %d, \"tdecode\": %.1f",
+                      st.files, st.decoded, st.failed, st.dropped, st.processed, st.backlog, st.tdecode * 1e3);
+    }
+    if(l > 0 && l < buflen) snprintf(buf + l, buflen - l, " }");
     return buf;
 }
 static char *watchdr(const char *messageid, char *buf, int buflen){
@@ -425,7 +677,8 @@ int process_input(InputType tp, char *name){
     if(tp == T_DIRECTORY){
         imagedata = watchdr;
         return watch_directory(name, process_file);
-    }else if(tp == T_CAPT_GRASSHOPPER || tp == T_CAPT_BASLER || tp == T_CAPT_HIKROBOT || tp == T_CAPT_TOUPCAM){
+    }else if(tp == T_CAPT_GRASSHOPPER || tp == T_CAPT_BASLER || tp == T_CAPT_HIKROBOT || tp == T_CAPT_TOUPCAM
+             || tp == T_CAPT_SIMULATOR){
         camera *cam = NULL;
         switch(tp){
             case T_CAPT_GRASSHOPPER:
@@ -448,6 +701,9 @@ int process_input(InputType tp, char *name){
                 cam = &Toupcam;
 #endif
                 break;
+            case T_CAPT_SIMULATOR:
+                cam = &SimCam;
+                break;
             default: return FALSE;
         }
         if(!setCamera(cam)){
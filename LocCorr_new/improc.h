@@ -26,6 +26,32 @@
 // tolerance of deviations by X and Y axis (if sigmaX or sigmaY greater, values considered to be wrong)
 #define XY_TOLERANCE                (5.)
 #define ROI_SIZE                    (200)
+// save each N'th preview while correctors are moving
+#define MOVING_PREVIEW_DECIM        (10)
+// ensemble centroid: max distance (pix) between predicted and found star position
+#define ENS_MATCHRAD                (10.)
+// max relative flux difference |I1-I2|/(I1+I2) for matched stars
+#define ENS_FLUXTOL                 (0.5)
+// stars with shift differs from median more than this value (pix) are outliers
+#define ENS_OUTLIER                 (1.5)
+// max amount of objects (from sorted list) to search reference stars
+#define ENS_MAXOBJ                  (256)
+// weight of new position when refining reference stars positions
+#define ENS_ANCHOR_ALPHA            (0.1)
+
+// stages of process_file() for timing
+typedef enum{
+    STAGE_BACKGROUND,   // background calculation
+    STAGE_ROI,          // simplest centroid in ROI around previous position
+    STAGE_BINARIZE,
+    STAGE_EROSION,
+    STAGE_DILATION,
+    STAGE_LABELING,     // connected components labeling and centroids calculation
+    STAGE_DEVIATION,    // deviations calculation and corrections
+    STAGE_OUTPUT,       // preparing and writing of output JPEG
+    STAGE_TOTAL,        // whole process_file()
+    STAGE_AMOUNT
+} procstage;
 
 extern volatile atomic_bool stopwork;
 extern volatile atomic_ullong ImNumber;
@@ -39,5 +65,9 @@ void closeXYlog();
 int XYcomment(char *cmnt);
 double getFramesPerS();
 void getcenter(float *x, float *y);
+int quickCentroid(Image *I, float *x, float *y);
+void fastDeviation(float x, float y);
+const double *getStageTimes();
+const char *getStageName(procstage s);
 
 #endif // IMPROC_H__
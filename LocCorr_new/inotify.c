@@ -17,109 +17,379 @@
  */
 
 #include <errno.h>
+#include <limits.h> // NAME_MAX
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> // strlen
+#include <sys/epoll.h>
 #include <sys/inotify.h>
-#include <sys/select.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "config.h"
 #include "debug.h"
 #include "imagefile.h"
+#include "improc.h" // stopwork
+#include "inotify.h"
 
-static char filenm[FILENAME_MAX];
+// buffer for inotify events and max amount of events in it
+#define INOT_BUFSZ      (64*1024)
+#define INOT_MAXEV      (INOT_BUFSZ / sizeof(struct inotify_event))
+// pause between attempts to watch removed file or directory, us
+#define INOT_REWATCH_US (100000)
+
+// handler of changed file name
+typedef void (*chfn_t)(const char *fname);
+
+typedef struct{
+    const char *name;   // file or directory to watch
+    int isdir;
+    int ifd;            // inotify descriptor (non-blocking)
+    int efd;            // epoll descriptor
+    int wd;             // watch descriptor or -1 if watched object removed
+    int nfailed;        // amount of failed attempts to add watch
+} watcher;
+
+static int addwatch(watcher *w){
+    uint32_t mask = IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF;
+    if(w->isdir) mask |= IN_MOVED_TO | IN_ONLYDIR; // files could be renamed after writing
+    w->wd = inotify_add_watch(w->ifd, w->name, mask);
+    if(w->wd < 0){
+        if(w->nfailed++ == 0){
+            WARN("inotify_add_watch(%s)", w->name);
+            LOGWARN("Can't watch %s, wait for it", w->name);
+        }
+        return FALSE;
+    }
+    if(w->nfailed) LOGMSG("Watch %s again", w->name);
+    w->nfailed = 0;
+    return TRUE;
+}
 
-// handle inotify event IN_CLOSE_WRITE
 /**
- * @brief handle_events - handle inotify event IN_CLOSE_WRITE
- * @param name  - directory or file name
- * @param fd    - inotify init descriptor
- * @return 1 if file was changed and ready to be processed, 0 if not changed, -1 if removed
+ * @brief drain - read all pending inotify events (while there's space in buffer)
+ * @param fd    - inotify descriptor
+ * @param buf   - buffer
+ * @param bufsz - its size
+ * @return amount of bytes read
  */
-static int changed(const char *name, int fd, uint32_t mask){
-    struct inotify_event buf[10] = {0};
-    ssize_t len = read(fd, buf, sizeof buf);
-    if(len == -1 && errno != EAGAIN){
-        WARN("inotify read()");
-        return -1;
-    }
-    DBG("got: %zd", len);
-    if(len < 1) return 0; // not ready
-    uint32_t bm = buf[0].mask;
-    buf[0].mask = 0;
-    int i = 9;
-    for(; i > -1; --i){ // find last changed file
-        DBG("%d: mask=%04x; len=%u", i, buf[i].mask, buf[i].len);
-        if(buf[i].mask & IN_IGNORED || buf[i].len < 1) continue;
-        DBG("%d: name=%s", i, buf[i].name);
-    }
-    if(i == -1){
-        DBG("NO names found");
-        return -1;
-    }
-    if(bm & mask){
-        if(name){
-            snprintf(filenm, FILENAME_MAX, "%s/%s", name, buf[i].name); // full path
-        }else{
-            snprintf(filenm, FILENAME_MAX, "%s", buf[i].name); // file name
+static size_t drain(int fd, char *buf, size_t bufsz){
+    size_t got = 0;
+    while(bufsz - got >= sizeof(struct inotify_event) + NAME_MAX + 1){
+        ssize_t l = read(fd, buf + got, bufsz - got);
+        if(l < 0){
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN) WARN("inotify read()");
+            break;
         }
+        if(l == 0) break;
+        got += (size_t)l;
+    }
+    return got;
+}
+
+/**
+ * @brief parse - decode inotify events (each has variable length) and coalesce repeated writes
+ * @param w       - watcher
+ * @param buf     - events
+ * @param len     - length of `buf`
+ * @param names (o) - names of changed files in order of last changes (NULL for coalesced)
+ * @param rewatch (o) - set to 1 if watched object was removed
+ * @return amount of records in `names`
+ */
+static int parse(watcher *w, const char *buf, size_t len, const char **names, int *rewatch){
+    int n = 0;
+    const char *end = buf + len;
+    for(const char *ptr = buf; ptr + sizeof(struct inotify_event) <= end;){
+        const struct inotify_event *ev = (const struct inotify_event*)ptr;
+        ptr += sizeof(struct inotify_event) + ev->len;
+        if(ptr > end) break; // kernel gives only whole events
+        DBG("wd=%d, mask=0x%08x, name=%s", ev->wd, ev->mask, ev->len ? ev->name : "");
+        if(ev->mask & IN_Q_OVERFLOW){
+            LOGWARN("inotify queue overflow: some files lost");
+            continue;
+        }
+        if(ev->wd != w->wd) continue; // old watch
+        if(ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)){
+            *rewatch = 1;
+            continue;
+        }
+        if(!(ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) || (ev->mask & IN_ISDIR)) continue;
+        const char *nm = w->name;
+        if(w->isdir){
+            if(!ev->len || !*ev->name) continue;
+            nm = ev->name;
+        }
+        for(int i = 0; i < n; ++i) // the same file written again: only the last write matters
+            if(names[i] && 0 == strcmp(names[i], nm)){ names[i] = NULL; break; }
+        names[n++] = nm;
+    }
+    return n;
+}
+
+// give changed file (full path) to handler
+static void handle(watcher *w, const char *nm, chfn_t onchange){
+    if(!onchange) return;
+    if(!w->isdir){
+        onchange(w->name);
+        return;
+    }
+    char path[FILENAME_MAX];
+    snprintf(path, FILENAME_MAX, "%s/%s", w->name, nm);
+    onchange(path);
+}
+
+/**
+ * @brief watch_any - wait for written files and give their names to handler
+ * @param name     - file or directory name
+ * @param onchange - handler
+ * @param isdir    - ==1 if `name` is a directory
+ * @return 0 when stopped, 1 if inotify can't be used
+ */
+static int watch_any(const char *name, chfn_t onchange, int isdir){
+    static char buf[INOT_BUFSZ] __attribute__((aligned(__alignof__(struct inotify_event))));
+    static const char *names[INOT_MAXEV];
+    watcher w = {.name = name, .isdir = isdir, .wd = -1};
+    w.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(w.ifd < 0){
+        WARN("inotify_init1()");
+        return 1;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = w.ifd};
+    w.efd = epoll_create1(EPOLL_CLOEXEC);
+    if(w.efd < 0 || epoll_ctl(w.efd, EPOLL_CTL_ADD, w.ifd, &ev)){
+        WARN("epoll");
+        if(w.efd > -1) close(w.efd);
+        close(w.ifd);
         return 1;
     }
-    DBG("IN_IGNORED");
-    return -1; // IN_IGNORED (file removed)
+    int replaced = FALSE; // watched file was removed or renamed
+    while(!stopwork){
+        if(w.wd < 0){
+            if(!addwatch(&w)){
+                usleep(INOT_REWATCH_US);
+                continue;
+            }
+            if(replaced && !isdir) handle(&w, NULL, onchange); // new file is on its place
+            replaced = FALSE;
+        }
+        int n = epoll_wait(w.efd, &ev, 1, 1000);
+        if(n < 0 && errno != EINTR){
+            WARN("epoll_wait()");
+            usleep(INOT_REWATCH_US);
+        }
+        if(n < 1) continue;
+        size_t len = drain(w.ifd, buf, INOT_BUFSZ);
+        int rewatch = 0;
+        int N = parse(&w, buf, len, names, &rewatch);
+        if(N && isdir && theconf.dirpolicy == DIRPOLICY_NEWEST) // only the last file (never coalesced)
+            handle(&w, names[N-1], onchange);
+        else for(int i = 0; i < N; ++i)
+            if(names[i]) handle(&w, names[i], onchange);
+        if(rewatch){
+            DBG("%s removed", name);
+            inotify_rm_watch(w.ifd, w.wd); // could be already removed by kernel
+            w.wd = -1;
+            replaced = TRUE;
+        }
+    }
+    close(w.efd);
+    close(w.ifd);
+    return 0;
 }
 
-static int initinot(const char *name, int *filed, uint32_t mask){
-    static int fd = -1, wd = -1;
-    if(wd > -1){
-        inotify_rm_watch(fd, wd);
-        wd = -1; fd = -1;
+/*
+ * Decoding pipeline of directory mode:
+ * inotify reader thread -> bounded backlog of files -> pool of decoding workers ->
+ * -> processing stage (caller of watch_directory) in order of files appearance or newest-wins
+ */
+
+typedef enum{
+    JOB_FREE,       // empty slot
+    JOB_QUEUED,     // file waits for decoding
+    JOB_DECODING,   // worker reads file
+    JOB_READY       // image (or NULL if file isn't an image) waits for processing
+} jobstate;
+
+typedef struct{
+    jobstate state;
+    uint64_t seqno;             // number of file in order of appearance
+    char name[FILENAME_MAX];
+    Image *I;
+} decjob;
+
+static struct{
+    decjob *jobs;               // backlog slots
+    int njobs;
+    uint64_t nextseq;           // seqno of next file got from inotify
+    uint64_t nextout;           // files with less seqno are processed or dropped
+    pthread_mutex_t mutex;
+    pthread_cond_t jobcond;     // new file in backlog
+    pthread_cond_t freecond;    // free slot appeared
+    pthread_cond_t readycond;   // new decoded image
+    dirpipestat stat;
+    double tdecsum;             // sum of decoding times
+} pipe_ = {.mutex = PTHREAD_MUTEX_INITIALIZER, .jobcond = PTHREAD_COND_INITIALIZER,
+           .freecond = PTHREAD_COND_INITIALIZER, .readycond = PTHREAD_COND_INITIALIZER};
+
+// free slot and its image (call with locked mutex)
+static void freejob(decjob *j, int dropped){
+    if(dropped) ++pipe_.stat.dropped;
+    Image_free(&j->I);
+    j->state = JOB_FREE;
+    pthread_cond_signal(&pipe_.freecond);
+}
+
+// find queued or ready job with the least seqno (call with locked mutex)
+static decjob *oldestjob(jobstate state){
+    decjob *o = NULL;
+    for(int i = 0; i < pipe_.njobs; ++i){
+        decjob *j = &pipe_.jobs[i];
+        if(j->state == state && (!o || j->seqno < o->seqno)) o = j;
     }
-    if(fd == -1) fd = inotify_init();//1(IN_NONBLOCK);
-    if(fd == -1){
-       WARN("inotify_init()");
-       return 0;
+    return o;
+}
+
+// inotify handler: put file name into backlog
+static void pipeline_put(const char *fname){
+    pthread_mutex_lock(&pipe_.mutex);
+    ++pipe_.stat.files;
+    decjob *slot = NULL;
+    while(!slot){
+        for(int i = 0; i < pipe_.njobs; ++i) if(pipe_.jobs[i].state == JOB_FREE){ slot = &pipe_.jobs[i]; break; }
+        if(slot) break;
+        if(theconf.dirpolicy == DIRPOLICY_NEWEST){ // throw away the oldest file which isn't decoding now
+            decjob *o = oldestjob(JOB_QUEUED);
+            if(!o) o = oldestjob(JOB_READY);
+            if(o){ freejob(o, o->state == JOB_QUEUED || o->I); continue; }
+        } // in-order policy or all workers are busy: wait
+        pthread_cond_wait(&pipe_.freecond, &pipe_.mutex);
     }
-    if(-1 == (wd = inotify_add_watch(fd, name, mask))){
-        WARN("inotify_add_watch()");
-        return 0;
+    snprintf(slot->name, FILENAME_MAX, "%s", fname);
+    slot->seqno = pipe_.nextseq++;
+    slot->I = NULL;
+    slot->state = JOB_QUEUED;
+    pthread_cond_signal(&pipe_.jobcond);
+    pthread_mutex_unlock(&pipe_.mutex);
+}
+
+// take next job for decoding (call with locked mutex): the oldest one or the newest if newest-wins
+static decjob *nextjob(){
+    decjob *n = NULL;
+    for(int i = 0; i < pipe_.njobs; ++i){
+        decjob *j = &pipe_.jobs[i];
+        if(j->state != JOB_QUEUED) continue;
+        if(j->seqno < pipe_.nextout){ freejob(j, 1); continue; } // newer image already processed
+        if(!n) n = j;
+        else if(theconf.dirpolicy == DIRPOLICY_NEWEST){ if(j->seqno > n->seqno) n = j; }
+        else if(j->seqno < n->seqno) n = j;
+    }
+    return n;
+}
+
+static void *decworker(_U_ void *par){
+    pthread_mutex_lock(&pipe_.mutex);
+    while(!stopwork){
+        decjob *j = nextjob();
+        if(!j){
+            pthread_cond_wait(&pipe_.jobcond, &pipe_.mutex);
+            continue;
+        }
+        j->state = JOB_DECODING;
+        pthread_mutex_unlock(&pipe_.mutex);
+        double t0 = sl_dtime();
+        Image *I = Image_read(j->name); // slot can't be touched by others while decoding
+        double t = sl_dtime() - t0;
+        pthread_mutex_lock(&pipe_.mutex);
+        pipe_.tdecsum += t;
+        if(I){
+            I->seqno = j->seqno;
+            ++pipe_.stat.decoded;
+        }else{
+            DBG("Changed file %s isn't an image", j->name);
+            ++pipe_.stat.failed;
+        }
+        j->I = I;
+        j->state = JOB_READY;
+        if(j->seqno < pipe_.nextout) freejob(j, !!I);
+        else pthread_cond_broadcast(&pipe_.readycond);
     }
-    if(filed) *filed = fd;
-    return wd;
+    pthread_mutex_unlock(&pipe_.mutex);
+    return NULL;
 }
 
-static int watch_any(const char *name, void (*process)(Image*), uint32_t mask){
-    int fd = -1, wd = -1;
+/**
+ * @brief pipeline_get - get next image for processing
+ * @param timeout - max time to wait, seconds
+ * @return image or NULL if timeout
+ */
+static Image *pipeline_get(double timeout){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    double t = ts.tv_sec + ts.tv_nsec * 1e-9 + timeout;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - (double)ts.tv_sec) * 1e9);
+    Image *I = NULL;
+    pthread_mutex_lock(&pipe_.mutex);
     while(1){
-        if(wd < 1 || fd < 1){
-            wd = initinot(name, &fd, mask);
-            if(wd < 1){
-                usleep(1000);
-                continue;
-            }
+        int newest = (theconf.dirpolicy == DIRPOLICY_NEWEST);
+        decjob *r = NULL;
+        for(int i = 0; i < pipe_.njobs; ++i){
+            decjob *j = &pipe_.jobs[i];
+            if(j->state == JOB_FREE) continue;
+            if(newest){ // the newest decoded image
+                if(j->state != JOB_READY) continue;
+                if(!j->I) freejob(j, 0); // file isn't an image
+                else if(!r || j->seqno > r->seqno) r = j;
+            }else if(!r || j->seqno < r->seqno) r = j; // the oldest file in pipeline
         }
-        int ch;
-        if(mask == IN_CLOSE_WRITE)
-            ch = changed(NULL, fd, mask); // only file name
-        else
-            ch = changed(name, fd, mask); // full path
-        if(ch == -1){ sleep(1); wd = -1; continue; } // removed
-        if(ch == 1){ // changed
-            if(process){
-                Image *I = Image_read(filenm);
-                if(!I && (mask & IN_ISDIR)){ // changed file isn't an image
-                    DBG("Changed file isn't an image");
-                    continue;
-                }
-                process(I);
+        if(r && r->state == JOB_READY){
+            pipe_.nextout = r->seqno + 1;
+            I = r->I; r->I = NULL;
+            freejob(r, 0);
+            if(!I) continue; // file isn't an image: take next
+            for(int i = 0; i < pipe_.njobs; ++i){ // throw away older images
+                decjob *j = &pipe_.jobs[i];
+                if(j->state == JOB_READY && j->seqno < pipe_.nextout) freejob(j, !!j->I);
             }
+            break;
         }
+        if(pthread_cond_timedwait(&pipe_.readycond, &pipe_.mutex, &ts)) break;
     }
-    close(fd);
-    return 0;
+    if(I) ++pipe_.stat.processed;
+    pthread_mutex_unlock(&pipe_.mutex);
+    return I;
+}
+
+/**
+ * @brief dirpipe_stat - get statistics of directory mode decoding pipeline
+ * @param s (o) - statistics
+ */
+void dirpipe_stat(dirpipestat *s){
+    if(!s) return;
+    pthread_mutex_lock(&pipe_.mutex);
+    *s = pipe_.stat;
+    s->backlog = 0;
+    for(int i = 0; i < pipe_.njobs; ++i) if(pipe_.jobs[i].state != JOB_FREE) ++s->backlog;
+    uint64_t n = s->decoded + s->failed;
+    s->tdecode = n ? pipe_.tdecsum / n : 0.;
+    pthread_mutex_unlock(&pipe_.mutex);
 }
 
+static void *dirreader(void *name){
+    watch_any((const char*)name, pipeline_put, TRUE);
+    return NULL;
+}
 
+static void (*process_image)(Image*) = NULL;
+// single file mode: read and process synchronously
+static void readandprocess(const char *fname){
+    if(!process_image) return;
+    Image *I = Image_read(fname);
+    process_image(I);
+    Image_free(&I);
+}
 
 int watch_file(const char *name, void (*process)(Image*)){
     DBG("try to watch file %s", name);
@@ -127,7 +397,8 @@ int watch_file(const char *name, void (*process)(Image*)){
         WARNX("Need filename");
         return 1;
     }
-    return watch_any(name, process, IN_CLOSE_WRITE);
+    process_image = process;
+    return watch_any(name, readandprocess, FALSE);
 }
 
 int watch_directory(char *name, void (*process)(Image*)){
@@ -138,5 +409,31 @@ int watch_directory(char *name, void (*process)(Image*)){
     }
     int l = strlen(name) - 1;
     if(name[l] == '/') name[l] = 0;
-    return watch_any(name, process, IN_CLOSE_WRITE|IN_ISDIR);
+    pipe_.njobs = theconf.dirbacklog;
+    pipe_.jobs = MALLOC(decjob, pipe_.njobs);
+    if(theconf.dirworkers > 1 && !fits_is_reentrant()){
+        WARNX("cfitsio isn't reentrant: FITS files will be decoded one by one");
+        LOGWARN("cfitsio isn't reentrant: FITS files will be decoded one by one");
+    }
+    pthread_t thread;
+    for(int i = 0; i < theconf.dirworkers; ++i){
+        if(pthread_create(&thread, NULL, decworker, NULL)){
+            LOGERR("pthread_create() for image decoding failed");
+            ERR("pthread_create()");
+        }
+        pthread_detach(thread);
+    }
+    LOGMSG("Watch directory %s: %d decoding workers, backlog %d", name, theconf.dirworkers, pipe_.njobs);
+    if(pthread_create(&thread, NULL, dirreader, (void*)name)){
+        LOGERR("pthread_create() for inotify reader failed");
+        ERR("pthread_create()");
+    }
+    pthread_detach(thread);
+    while(!stopwork){
+        Image *I = pipeline_get(1.);
+        if(!I) continue;
+        if(process) process(I);
+        Image_free(&I);
+    }
+    return 0;
 }
@@ -20,8 +20,22 @@
 #ifndef INOTIFY_H__
 #define INOTIFY_H__
 
+#include <stdint.h>
+
 #include "fits.h" // Image*
 
+// statistics of directory mode decoding pipeline
+typedef struct{
+    uint64_t files;     // files got from inotify
+    uint64_t decoded;   // files read as images
+    uint64_t failed;    // files which aren't images
+    uint64_t dropped;   // files and images thrown away by backlog policy
+    uint64_t processed; // images given to processing
+    int backlog;        // files in pipeline now
+    double tdecode;     // mean time of file reading, seconds
+} dirpipestat;
+
+void dirpipe_stat(dirpipestat *s);
 int watch_file(const char *name, void (*process)(Image*));
 int watch_directory(char *name, void (*process)(Image*));
 
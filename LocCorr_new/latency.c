@@ -0,0 +1,162 @@
+/*
+ * This file is part of the loccorr project.
+ * Copyright 2024 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// latency accounting: time from exposure to motors' answer for each correction
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "debug.h"
+#include "latency.h"
+
+// intervals between stamps
+typedef struct{
+    const char *name;
+    latstamp from;
+    latstamp to;
+} latinterval;
+
+static const latinterval intervals[] = {
+    {"exposure", LAT_EXPSTART,  LAT_EXPEND},    // exposure itself
+    {"queue",    LAT_EXPEND,    LAT_PROCSTART}, // readout, darks, co-adding, median
+    {"process",  LAT_PROCSTART, LAT_DEVIATION}, // centroid search
+    {"average",  LAT_DEVIATION, LAT_PROCCORR},  // averaging and handing over to steppers
+    {"dispatch", LAT_PROCCORR,  LAT_CMDSENT},   // steppers thread wake up and PID
+    {"answer",   LAT_CMDSENT,   LAT_CMDACK},    // steppers server answer
+    {"total",    LAT_EXPEND,    LAT_CMDACK},    // from photons to accepted correction
+};
+#define NINTERVALS  (sizeof(intervals) / sizeof(intervals[0]))
+
+typedef struct{
+    double sum;
+    double max;
+} latstat_t;
+
+static latrec_t cur = {0};      // record filled by processing thread
+static latrec_t pending = {0};  // coordinates handed over to steppers, not taken yet
+static int havepending = FALSE;
+static latrec_t last = {0};     // last committed record
+static latstat_t stat[NINTERVALS] = {0};
+static double hist[LAT_NHIST];  // last values of total latency
+static uint64_t Ncorr = 0;      // amount of committed corrections
+static pthread_mutex_t lat_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief latency_newframe - start new record for image to process
+ * @param I - image (its exposure start/end or current time if unknown)
+ */
+void latency_newframe(const Image *I){
+    double t = sl_dtime();
+    cur = (latrec_t){0};
+    cur.imno = I->counter;
+    cur.t[LAT_EXPEND] = (I->tend > 0.) ? I->tend : t;
+    cur.t[LAT_EXPSTART] = (I->tstart > 0.) ? I->tstart : cur.t[LAT_EXPEND];
+    cur.t[LAT_PROCSTART] = t;
+}
+
+// stamp current record (call from processing thread only)
+void latency_stamp(latstamp s){
+    if(s < 0 || s >= LAT_AMOUNT) return;
+    cur.t[s] = sl_dtime();
+}
+
+// coordinates of current frame accepted by steppers: store record until correction will be made
+void latency_handoff(){
+    cur.t[LAT_PROCCORR] = sl_dtime();
+    pthread_mutex_lock(&lat_mutex);
+    pending = cur;
+    havepending = TRUE;
+    pthread_mutex_unlock(&lat_mutex);
+}
+
+/**
+ * @brief latency_take - get record of last handed over coordinates
+ * @param r (o) - record
+ * @return FALSE if there's no record
+ */
+int latency_take(latrec_t *r){
+    if(!r) return FALSE;
+    pthread_mutex_lock(&lat_mutex);
+    int ret = havepending;
+    if(ret) *r = pending;
+    havepending = FALSE;
+    pthread_mutex_unlock(&lat_mutex);
+    return ret;
+}
+
+static int cmpdbl(const void *a, const void *b){
+    double d = *(const double*)a - *(const double*)b;
+    return (d > 0.) - (d < 0.);
+}
+
+/**
+ * @brief latency_commit - add record of made correction to statistics and log it
+ * @param r - record with all stamps filled
+ */
+void latency_commit(const latrec_t *r){
+    if(!r) return;
+    char buf[256], *bptr = buf;
+    int l, buflen = sizeof(buf);
+    pthread_mutex_lock(&lat_mutex);
+    last = *r;
+    for(size_t i = 0; i < NINTERVALS; ++i){
+        double d = r->t[intervals[i].to] - r->t[intervals[i].from];
+        stat[i].sum += d;
+        if(d > stat[i].max) stat[i].max = d;
+        l = snprintf(bptr, buflen, " %s=%.1f", intervals[i].name, d * 1e3);
+        if(l > 0 && l < buflen){ buflen -= l; bptr += l; }
+    }
+    hist[Ncorr++ % LAT_NHIST] = r->t[LAT_CMDACK] - r->t[LAT_EXPEND];
+    pthread_mutex_unlock(&lat_mutex);
+    LOGMSG("Latency of image #%" PRIu64 " (ms):%s", r->imno, buf);
+    DBG("Latency of image #%" PRIu64 " (ms):%s", r->imno, buf);
+}
+
+/**
+ * @brief latency_status - latency statistics in JSON
+ * @param messageid - value of "messageid"
+ * @param buf       - buffer for string
+ * @param buflen    - length of `buf`
+ * @return buf
+ */
+char *latency_status(const char *messageid, char *buf, int buflen){
+    if(!buf || buflen < 2) return NULL;
+    if(!messageid) messageid = "unknown";
+    double h[LAT_NHIST], median = 0.;
+    pthread_mutex_lock(&lat_mutex);
+    int nh = (Ncorr < LAT_NHIST) ? (int)Ncorr : LAT_NHIST;
+    memcpy(h, hist, nh * sizeof(double));
+    if(nh){
+        qsort(h, nh, sizeof(double), cmpdbl);
+        median = (nh & 1) ? h[nh/2] : (h[nh/2 - 1] + h[nh/2]) / 2.;
+    }
+    int l = snprintf(buf, buflen, "{ \"%s\": \"%s\", \"corrections\": %" PRIu64 ", \"image\": %" PRIu64
+                     ", \"totalmedian\": %.1f", MESSAGEID, messageid, Ncorr, last.imno, median * 1e3);
+    for(size_t i = 0; i < NINTERVALS && l < buflen; ++i){
+        double d = last.t[intervals[i].to] - last.t[intervals[i].from];
+        l += snprintf(buf + l, buflen - l, ", \"%s\": { \"last\": %.1f, \"mean\": %.1f, \"max\": %.1f }",
+                      intervals[i].name, d * 1e3, Ncorr ? stat[i].sum / Ncorr * 1e3 : 0., stat[i].max * 1e3);
+    }
+    if(l < buflen) snprintf(buf + l, buflen - l, " }\n");
+    pthread_mutex_unlock(&lat_mutex);
+    return buf;
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of the loccorr project.
+ * Copyright 2024 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef LATENCY_H__
+#define LATENCY_H__
+
+#include <stdint.h>
+
+#include "imagefile.h"
+
+// amount of last corrections to calculate median of total latency
+#define LAT_NHIST           (64)
+
+// time stamps of one correction, from exposure to motors' answer
+typedef enum{
+    LAT_EXPSTART,       // exposure start
+    LAT_EXPEND,         // exposure end (or capture() return)
+    LAT_PROCSTART,      // process_file() start
+    LAT_DEVIATION,      // getDeviation() call
+    LAT_PROCCORR,       // coordinates accepted by proc_corr()
+    LAT_CMDSENT,        // first correction command sent to steppers server
+    LAT_CMDACK,         // last correction command acknowledged
+    LAT_AMOUNT
+} latstamp;
+
+typedef struct{
+    uint64_t imno;      // counter of image
+    double t[LAT_AMOUNT];
+} latrec_t;
+
+void latency_newframe(const Image *I);
+void latency_stamp(latstamp s);
+void latency_handoff();
+int latency_take(latrec_t *r);
+void latency_commit(const latrec_t *r);
+char *latency_status(const char *messageid, char *buf, int buflen);
+
+#endif // LATENCY_H__
@@ -24,12 +24,15 @@
 #include <sys/prctl.h>      //prctl
 #include <sys/wait.h>       // wait
 
+#include "calib.h"
 #include "cmdlnopts.h"
 #include "config.h"
 #include "debug.h"
 #include "improc.h"
+#include "replay.h"
 #include "steppers.h"
 #include "socket.h"
+#include "stpsim.h"
 
 static InputType tp;
 static pid_t childpid;
@@ -57,6 +60,7 @@ void signals(int sig){
     DBG("closeXYlog()");
     closeXYlog();
     DBG("EXIT %d", sig);
+    alog_stop(); // write all pending debug messages
     LOGERR("Exit with status %d", sig);
     exit(sig);
 }
@@ -88,6 +92,9 @@ static InputType chk_inp(const char *name){
         case T_PNG:
             printf("png");
         break;
+        case T_PNM:
+            printf("pnm");
+        break;
         case T_GIF:
             printf("gif");
         break;
@@ -112,6 +119,9 @@ static InputType chk_inp(const char *name){
         case T_CAPT_TOUPCAM:
             printf("toupcam camera capture");
         break;
+        case T_CAPT_SIMULATOR:
+            printf("camera simulator capture");
+        break;
         default:
             printf("unsupported type\n");
             return T_WRONG;
@@ -138,8 +148,10 @@ int main(int argc, char *argv[]){
     }
     if(GP->Naveraging < 1 || GP->Naveraging > NAVER_MAX)
         ERRX("Averaging amount should be from 1 to %d", NAVER_MAX);
-    tp = chk_inp(GP->inputname);
-    if(tp == T_WRONG) ERRX("Enter correct image file or directory name");
+    if(!GP->replay){
+        tp = chk_inp(GP->inputname);
+        if(tp == T_WRONG) ERRX("Enter correct image file or directory name");
+    }
     // check ability of saving file
     {
         FILE *f = fopen(GP->outputjpg, "w");
@@ -196,6 +208,13 @@ int main(int argc, char *argv[]){
             theconf.stpserverport = GP->steppersport;
         }
     }
+    if(GP->replay){ // offline processing: no sockets, steppers and guarding process
+        free(self);
+        if(GP->logXYname) openXYlog(GP->logXYname);
+        int n = replay_run(GP->replay, GP->realtime, 1, NULL);
+        closeXYlog();
+        return (n > 0) ? 0 : 1;
+    }
     sl_check4running(self, GP->pidfile);
     DBG("%s started, snippets library version is %s\n", self, sl_libversion());
     free(self); self = NULL;
@@ -220,11 +239,13 @@ int main(int argc, char *argv[]){
         }
     }
     DBGLOG("start thread; capt: %s", GP->inputname);
+    if(GP->stpsim && !stpsim_run(theconf.stpserverport)) ERRX("Can't run steppers simulator");
     if(!(theSteppers = steppers_connect())){
         LOGERR("Steppers server unavailable, can't run");
         WARNX("Steppers server unavailable, can't run");
     }
     if(GP->logXYname) openXYlog(GP->logXYname);
+    dark_load(); // master darks made before restart
     LOGMSG("Start application...");
     LOGDBG("xtag=%g, ytag=%g", theconf.xtarget, theconf.ytarget);
     openIOport(GP->ioport);
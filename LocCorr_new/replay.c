@@ -0,0 +1,192 @@
+/*
+ * This file is part of the loccorr project.
+ * Copyright 2021 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <inttypes.h> // PRIx64
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "imagefile.h"
+#include "improc.h"
+#include "replay.h"
+#include "steppers.h"
+
+// FNV-1a 64 bit
+#define FNV_OFFSET      (0xcbf29ce484222325ULL)
+#define FNV_PRIME       (0x100000001b3ULL)
+
+// index of file reading time in statistics arrays
+#define STAGE_READ      (STAGE_AMOUNT)
+
+typedef struct{
+    char *name;         // full path
+    double t;           // modification time
+} frame_t;
+
+// dummy steppers: process_file() shouldn't send corrections
+static steppersproc nosteppers = {0};
+
+static uint64_t fnv1a(uint64_t h, int32_t val){
+    for(int i = 0; i < 4; ++i){ // little endian order
+        h ^= (uint8_t)(val & 0xff);
+        h *= FNV_PRIME;
+        val >>= 8;
+    }
+    return h;
+}
+
+static int compDbl(const void *a, const void *b){
+    double d = *(const double*)a - *(const double*)b;
+    return (d < 0.) ? -1 : (d > 0.) ? 1 : 0;
+}
+static int compFrames(const void *a, const void *b){
+    return strcmp(((const frame_t*)a)->name, ((const frame_t*)b)->name);
+}
+
+static int addframe(frame_t **frames, int *N, int *Nall, const char *name){
+    struct stat st;
+    if(stat(name, &st) || !S_ISREG(st.st_mode)) return FALSE;
+    InputType tp = chkinput(name);
+    if(tp == T_WRONG || tp == T_DIRECTORY) return FALSE;
+    if(*N == *Nall){
+        *Nall += 1024;
+        *frames = realloc(*frames, *Nall * sizeof(frame_t));
+        if(!*frames) ERR("realloc()");
+    }
+    (*frames)[*N].name = strdup(name);
+    (*frames)[*N].t = st.st_mtim.tv_sec + st.st_mtim.tv_nsec * 1e-9;
+    ++(*N);
+    return TRUE;
+}
+
+/**
+ * @brief getframes - make list of image files to replay
+ * @param path - directory (all images in it sorted by name) or single file
+ * @param N (o) - amount of frames
+ * @return array of frames or NULL
+ */
+static frame_t *getframes(const char *path, int *N){
+    frame_t *frames = NULL;
+    int Nall = 0;
+    *N = 0;
+    InputType tp = chkinput(path);
+    if(tp == T_DIRECTORY){
+        DIR *d = opendir(path);
+        if(!d){
+            WARN("opendir(%s)", path);
+            return NULL;
+        }
+        struct dirent *de;
+        char fname[FILENAME_MAX];
+        while((de = readdir(d)) && *N < REPLAY_MAXFILES){
+            if(de->d_name[0] == '.') continue;
+            snprintf(fname, FILENAME_MAX, "%s/%s", path, de->d_name);
+            addframe(&frames, N, &Nall, fname);
+        }
+        closedir(d);
+        if(*N) qsort(frames, *N, sizeof(frame_t), compFrames);
+    }else addframe(&frames, N, &Nall, path);
+    if(!*N){
+        free(frames);
+        frames = NULL;
+    }
+    return frames;
+}
+
+static void prstat(const char *name, double *arr, int N){
+    qsort(arr, N, sizeof(double), compDbl);
+    #define PCT(p)  (arr[(int)ceil((p) * N) - 1] * 1e3)
+    printf("%-12s%10.3f%10.3f%10.3f%10.3f%10.3f\n", name, PCT(0.5), PCT(0.9), PCT(0.99),
+           arr[N-1] * 1e3, arr[0] * 1e3);
+    LOGMSG("replay: %s p50=%.3f, p90=%.3f, p99=%.3f, max=%.3fms", name, PCT(0.5), PCT(0.9), PCT(0.99), arr[N-1] * 1e3);
+    #undef PCT
+}
+
+/**
+ * @brief replay_run - push recorded frames through process_file() without sockets, steppers and inotify
+ * @param path - directory with images or single image
+ * @param realtime - !=0 to replay at recorded timestamps (files modification time)
+ * @param npasses - amount of passes over frames sequence
+ * @param digest (o) - digest of detected centroids (FNV-1a over centroids in 0.01px) or NULL
+ * @return amount of processed frames or -1 if failed
+ */
+int replay_run(const char *path, int realtime, int npasses, uint64_t *digest){
+    if(!path) return -1;
+    if(npasses < 1) npasses = 1;
+    int Nfiles;
+    frame_t *frames = getframes(path, &Nfiles);
+    if(!frames){
+        WARNX("No images to replay in %s", path);
+        return -1;
+    }
+    green("Replay %d frames from %s (%d passes%s)\n", Nfiles, path, npasses, realtime ? ", realtime" : "");
+    LOGMSG("Replay %d frames from %s (%d passes)", Nfiles, path, npasses);
+    theSteppers = &nosteppers;
+    int Ntot = Nfiles * npasses, Nproc = 0;
+    double *T[STAGE_AMOUNT + 1];
+    for(int i = 0; i <= STAGE_AMOUNT; ++i){
+        T[i] = MALLOC(double, Ntot);
+    }
+    uint64_t h = FNV_OFFSET;
+    double tstart = sl_dtime();
+    for(int pass = 0; pass < npasses && !stopwork; ++pass){
+        double t0 = sl_dtime();
+        for(int i = 0; i < Nfiles && !stopwork; ++i){
+            if(realtime){ // wait for recorded time
+                double dt = (frames[i].t - frames[0].t) - (sl_dtime() - t0);
+                if(dt > 0.) usleep((useconds_t)(dt * 1e6));
+            }
+            double tr = sl_dtime();
+            Image *I = Image_read(frames[i].name);
+            if(!I){
+                WARNX("Can't read %s", frames[i].name);
+                continue;
+            }
+            T[STAGE_READ][Nproc] = sl_dtime() - tr;
+            process_file(I);
+            Image_free(&I);
+            const double *st = getStageTimes();
+            for(int s = 0; s < STAGE_AMOUNT; ++s) T[s][Nproc] = st[s];
+            float x, y;
+            getcenter(&x, &y);
+            h = fnv1a(h, (int32_t)lroundf(x * 100.f));
+            h = fnv1a(h, (int32_t)lroundf(y * 100.f));
+            ++Nproc;
+        }
+    }
+    double ttot = sl_dtime() - tstart;
+    if(Nproc){
+        green("\nProcessed %d frames in %.3fs: %.2f frames per second\n", Nproc, ttot, Nproc / ttot);
+        LOGMSG("replay: %d frames in %.3fs (%.2f fps)", Nproc, ttot, Nproc / ttot);
+        green("%-12s%10s%10s%10s%10s%10s\n", "stage, ms", "p50", "p90", "p99", "max", "min");
+        prstat("read", T[STAGE_READ], Nproc);
+        for(int s = 0; s < STAGE_AMOUNT; ++s) prstat(getStageName(s), T[s], Nproc);
+        green("Centroids digest: %016" PRIx64 "\n", h);
+        LOGMSG("replay: centroids digest %016" PRIx64, h);
+    }
+    if(digest) *digest = h;
+    for(int i = 0; i <= STAGE_AMOUNT; ++i) FREE(T[i]);
+    for(int i = 0; i < Nfiles; ++i) free(frames[i].name);
+    free(frames);
+    theSteppers = NULL;
+    return Nproc;
+}
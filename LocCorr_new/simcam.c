@@ -0,0 +1,310 @@
+/*
+ * This file is part of the loccorr project.
+ * Copyright 2021 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// synthetic camera: star field with drift, periodic error, seeing, noise, hot pixels and gradient
+
+#include <float.h> // FLT_EPSILON
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "debug.h"
+#include "simcam.h"
+
+// star of field (positions relative to the main star, in loccorr coordinates)
+typedef struct{
+    double dx, dy;
+    double flux;        // relative flux
+} simstar;
+
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct{
+    int connected;
+    float exptime;      // exposition time, ms
+    float gain;         // gain, dB
+    float brightness;   // bias level
+    frameformat geom;   // current geometry
+    double t0;          // connection time
+    double tlast;       // time of last frame
+    double x0, y0;      // starting position of main star
+    double offx, offy;  // offset made by corrector (from `simcam_offset`)
+    simstar *stars;     // field stars (the first is main)
+    int Nstars;
+    int *hotx, *hoty;   // hot pixels coordinates
+    int Nhot;
+    float *frame;       // rendered frame
+    uint8_t *buf;       // output buffer
+    int bufsz;          // size of buffers (pixels)
+    uint64_t rng;       // random generator state
+    uint64_t frameno;
+} sim = {0};
+
+static float noisetbl[SIM_NOISETBL];
+
+// xorshift64*
+static uint64_t rnd(uint64_t *s){
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545F4914F6CDD1DULL;
+}
+// uniform in (0, 1]
+static double urnd(uint64_t *s){
+    return ((rnd(s) >> 11) + 1) * (1. / 9007199254740992.);
+}
+// normal distribution
+static double grnd(uint64_t *s){
+    return sqrt(-2. * log(urnd(s))) * cos(2. * M_PI * urnd(s));
+}
+
+// generate field stars (the first star is main, other - random)
+static void mkstars(){
+    int N = theconf.simnstars;
+    if(N < 1) N = 1;
+    if(N == sim.Nstars) return;
+    FREE(sim.stars);
+    sim.stars = MALLOC(simstar, N);
+    uint64_t s = SIM_SEED;
+    sim.stars[0] = (simstar){.dx = 0., .dy = 0., .flux = 1.};
+    for(int i = 1; i < N; ++i){
+        sim.stars[i].dx = SIM_WIDTH * urnd(&s) - sim.x0;
+        sim.stars[i].dy = SIM_HEIGHT * urnd(&s) - sim.y0;
+        sim.stars[i].flux = SIM_FIELD_MINFLUX + (1. - SIM_FIELD_MINFLUX) * urnd(&s);
+    }
+    sim.Nstars = N;
+    DBG("Generated %d stars", N);
+}
+
+// generate hot pixels
+static void mkhot(){
+    int N = theconf.simhotpix;
+    if(N == sim.Nhot) return;
+    FREE(sim.hotx);
+    FREE(sim.hoty);
+    sim.Nhot = N;
+    if(N < 1) return;
+    sim.hotx = MALLOC(int, N);
+    sim.hoty = MALLOC(int, N);
+    uint64_t s = ~SIM_SEED;
+    for(int i = 0; i < N; ++i){
+        sim.hotx[i] = (int)(rnd(&s) % SIM_WIDTH);
+        sim.hoty[i] = (int)(rnd(&s) % SIM_HEIGHT);
+    }
+}
+
+static void sdisconnect(){
+    pthread_mutex_lock(&sim_mutex);
+    sim.connected = FALSE;
+    FREE(sim.frame);
+    FREE(sim.buf);
+    FREE(sim.stars);
+    FREE(sim.hotx);
+    FREE(sim.hoty);
+    sim.bufsz = sim.Nstars = sim.Nhot = 0;
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+static int sconnect(){
+    pthread_mutex_lock(&sim_mutex);
+    if(!sim.connected){
+        sim.rng = SIM_SEED;
+        for(int i = 0; i < SIM_NOISETBL; ++i) noisetbl[i] = (float)grnd(&sim.rng);
+        sim.geom = (frameformat){.w = SIM_WIDTH, .h = SIM_HEIGHT, .xoff = 0, .yoff = 0};
+        sim.x0 = (theconf.xtarget > 0.) ? theconf.xtarget : SIM_WIDTH / 2.;
+        sim.y0 = (theconf.ytarget > 0.) ? theconf.ytarget : SIM_HEIGHT / 2.;
+        sim.offx = sim.offy = 0.;
+        sim.t0 = sim.tlast = sl_dtime();
+        sim.frameno = 0;
+        if(sim.exptime < FLT_EPSILON) sim.exptime = 1.f;
+        sim.connected = TRUE;
+        LOGMSG("Camera simulator connected, main star @ (%g, %g)", sim.x0, sim.y0);
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return TRUE;
+}
+
+// render star with peak value `peak` at (x, y) of current frame
+static void drawstar(float *frame, int W, int H, double x, double y, double peak){
+    double fwhm = theconf.simfwhm, R, a2;
+    int moffat = theconf.simprofile;
+    if(moffat){
+        double alpha = fwhm / (2. * sqrt(pow(2., 1. / SIM_MOFFAT_BETA) - 1.));
+        a2 = alpha * alpha;
+        R = SIM_MOFFAT_RADIUS * fwhm;
+    }else{
+        double sigma = fwhm / 2.3548;
+        a2 = 2. * sigma * sigma;
+        R = SIM_GAUSS_RADIUS * fwhm;
+    }
+    int xmin = (int)floor(x - R), xmax = (int)ceil(x + R);
+    int ymin = (int)floor(y - R), ymax = (int)ceil(y + R);
+    if(xmax < 0 || ymax < 0 || xmin >= W || ymin >= H) return;
+    if(xmin < 0) xmin = 0;
+    if(ymin < 0) ymin = 0;
+    if(xmax >= W) xmax = W - 1;
+    if(ymax >= H) ymax = H - 1;
+    for(int iy = ymin; iy <= ymax; ++iy){
+        float *row = &frame[iy * W];
+        double ry2 = (iy - y) * (iy - y);
+        for(int ix = xmin; ix <= xmax; ++ix){
+            double r2 = ((ix - x) * (ix - x) + ry2) / a2;
+            row[ix] += (float)(moffat ? peak * pow(1. + r2, -SIM_MOFFAT_BETA) : peak * exp(-r2));
+        }
+    }
+}
+
+static Image *scapture(){
+    pthread_mutex_lock(&sim_mutex);
+    if(!sim.connected){
+        pthread_mutex_unlock(&sim_mutex);
+        return NULL;
+    }
+    // wait for end of exposition or frame rate limit
+    double period = sim.exptime / 1000.;
+    if(theconf.simfps > 0 && period < 1. / theconf.simfps) period = 1. / theconf.simfps;
+    double tnext = sim.tlast + period, t = sl_dtime();
+    if(tnext > t){
+        pthread_mutex_unlock(&sim_mutex);
+        usleep((useconds_t)((tnext - t) * 1e6));
+        pthread_mutex_lock(&sim_mutex);
+        t = sl_dtime();
+    }
+    sim.tlast = t;
+    mkstars();
+    mkhot();
+    int W = sim.geom.w, H = sim.geom.h, wh = W * H;
+    if(wh > sim.bufsz){
+        FREE(sim.frame);
+        FREE(sim.buf);
+        sim.frame = MALLOC(float, wh);
+        sim.buf = MALLOC(uint8_t, wh);
+        sim.bufsz = wh;
+    }
+    // exposure and gain scaling
+    double scale = sim.exptime * pow(10., sim.gain / 20.);
+    double transp = theconf.simtransp;
+    // background: bias, sky and gradient by X
+    float *frame = sim.frame;
+    float bias = sim.brightness, sky = (float)(theconf.simsky * scale * transp);
+    float grad = (float)(theconf.simgradient * scale / 1000.);
+    int xoff = sim.geom.xoff, yoff = sim.geom.yoff;
+    OMP_FOR()
+    for(int y = 0; y < H; ++y){
+        float *row = &frame[y * W];
+        for(int x = 0; x < W; ++x) row[x] = bias + sky + grad * (x + xoff);
+    }
+    // main star position: drift, periodic error (by X), seeing and corrections
+    double tm = t - sim.t0;
+    double xc = sim.x0 + theconf.simdriftx * tm + sim.offx + theconf.simseeing * grnd(&sim.rng);
+    double yc = sim.y0 + theconf.simdrifty * tm + sim.offy + theconf.simseeing * grnd(&sim.rng);
+    if(theconf.simpeperiod > 0.) xc += theconf.simpeamp * sin(2. * M_PI * tm / theconf.simpeperiod);
+    double peak = theconf.simflux * scale * transp;
+    for(int i = 0; i < sim.Nstars; ++i){
+        simstar *s = &sim.stars[i];
+        drawstar(frame, W, H, xc + s->dx - xoff, yc + s->dy - yoff, peak * s->flux);
+    }
+    float hot = (float)(SIM_HOTRATE * scale);
+    for(int i = 0; i < sim.Nhot; ++i){
+        int x = sim.hotx[i] - xoff, y = sim.hoty[i] - yoff;
+        if(x < 0 || y < 0 || x >= W || y >= H) continue;
+        frame[y * W + x] += hot;
+    }
+    // add read and shot noise and convert to 8 bit (rows are stored top-down like real cameras do)
+    float rn2 = (float)(theconf.simnoise * theconf.simnoise);
+    uint64_t fno = sim.frameno++;
+    uint8_t *buf = sim.buf;
+    OMP_FOR()
+    for(int y = 0; y < H; ++y){
+        const float *row = &frame[y * W];
+        uint8_t *out = &buf[(H - 1 - y) * W];
+        uint64_t s = (fno * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)(y + 1) * 0xBF58476D1CE4E5B9ULL);
+        int nidx = (int)(rnd(&s) & (SIM_NOISETBL - 1));
+        for(int x = 0; x < W; ++x){
+            float v = row[x], n = noisetbl[(nidx + x) & (SIM_NOISETBL - 1)];
+            v += n * sqrtf(rn2 + (v > 0.f ? v : 0.f));
+            out[x] = (v < 0.f) ? 0 : (v > 255.f) ? 255 : (uint8_t)(v + 0.5f);
+        }
+    }
+    Image *I = u8toImage(buf, W, H, W);
+    I->tend = t;
+    I->tstart = t - sim.exptime / 1000.;
+    pthread_mutex_unlock(&sim_mutex);
+    return I;
+}
+
+static int ssetbrightness(float b){
+    sim.brightness = b;
+    return TRUE;
+}
+static int ssetexp(float e){
+    if(e < FLT_EPSILON) return FALSE;
+    sim.exptime = e;
+    return TRUE;
+}
+static int ssetgain(float g){
+    if(g < 0.f || g > SIM_GAINMAX) return FALSE;
+    sim.gain = g;
+    return TRUE;
+}
+static float sgetmaxgain(){
+    return SIM_GAINMAX;
+}
+static int ssetgeometry(frameformat *fmt){
+    if(!fmt || fmt->w < 1 || fmt->h < 1) return FALSE;
+    if(fmt->w > SIM_WIDTH) fmt->w = SIM_WIDTH;
+    if(fmt->h > SIM_HEIGHT) fmt->h = SIM_HEIGHT;
+    if(fmt->xoff < 0) fmt->xoff = 0;
+    if(fmt->yoff < 0) fmt->yoff = 0;
+    if(fmt->xoff + fmt->w > SIM_WIDTH) fmt->xoff = SIM_WIDTH - fmt->w;
+    if(fmt->yoff + fmt->h > SIM_HEIGHT) fmt->yoff = SIM_HEIGHT - fmt->h;
+    pthread_mutex_lock(&sim_mutex);
+    sim.geom = *fmt;
+    pthread_mutex_unlock(&sim_mutex);
+    DBG("Simulator geometry: %dx%d @ (%d, %d)", fmt->w, fmt->h, fmt->xoff, fmt->yoff);
+    return TRUE;
+}
+static int sgetgeomlimits(frameformat *max, frameformat *step){
+    if(max) *max = (frameformat){.w = SIM_WIDTH, .h = SIM_HEIGHT, .xoff = SIM_WIDTH - 1, .yoff = SIM_HEIGHT - 1};
+    if(step) *step = (frameformat){.w = 1, .h = 1, .xoff = 1, .yoff = 1};
+    return TRUE;
+}
+
+/**
+ * @brief simcam_offset - move all stars (e.g. by simulated corrector)
+ * @param dx, dy - offset in pixels
+ */
+void simcam_offset(double dx, double dy){
+    pthread_mutex_lock(&sim_mutex);
+    sim.offx += dx;
+    sim.offy += dy;
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+camera SimCam = {
+    .disconnect = sdisconnect,
+    .connect = sconnect,
+    .capture = scapture,
+    .setbrightness = ssetbrightness,
+    .setexp = ssetexp,
+    .setgain = ssetgain,
+    .getmaxgain = sgetmaxgain,
+    .setgeometry = ssetgeometry,
+    .getgeomlimits = sgetgeomlimits,
+};
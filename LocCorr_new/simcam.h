@@ -0,0 +1,49 @@
+/*
+ * This file is part of the loccorr project.
+ * Copyright 2021 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef SIMCAM_H__
+#define SIMCAM_H__
+
+#include "cameracapture.h" // `camera`
+
+#define SIMCAM_CAPT_NAME    "simulator"
+
+// full sensor size
+#define SIM_WIDTH           (1920)
+#define SIM_HEIGHT          (1200)
+// max gain, dB
+#define SIM_GAINMAX         (48.f)
+// Moffat profile power index
+#define SIM_MOFFAT_BETA     (2.5)
+// star image radius (in FWHM) for Gaussian and Moffat profiles
+#define SIM_GAUSS_RADIUS    (2.)
+#define SIM_MOFFAT_RADIUS   (5.)
+// size of table with normally distributed noise (should be power of 2)
+#define SIM_NOISETBL        (65536)
+// hot pixels dark current (ADU/ms at zero gain)
+#define SIM_HOTRATE         (1.)
+// field stars: seed of generator and minimal relative flux
+#define SIM_SEED            (0x5eed5eedULL)
+#define SIM_FIELD_MINFLUX   (0.05)
+
+extern camera SimCam;
+
+void simcam_offset(double dx, double dy);
+
+#endif // SIMCAM_H__
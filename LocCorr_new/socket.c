@@ -30,10 +30,12 @@
 #include <sys/syscall.h> // syscall
 #include <unistd.h>     // daemon
 
+#include "calib.h"
 #include "cmdlnopts.h"
 #include "config.h"
 #include "debug.h"
 #include "improc.h"
+#include "latency.h"
 #include "socket.h"
 #include "steppers.h"
 
@@ -66,12 +68,16 @@ typedef struct{
 
 static char *helpmsg(const char *messageid, char *buf, int buflen);
 static char *stepperstatus(const char *messageid, char *buf, int buflen);
+static char *steppercmdstat(const char *messageid, char *buf, int buflen);
 static char *getimagedata(const char *messageid, char *buf, int buflen);
 // should be in sorted order
 static getter getterHandlers[] = {
+    {"darkstatus", darkstatus, "Get status of master darks"},
     {"help", helpmsg, "List avaiable commands"},
     {"imdata", getimagedata, "Get image data (status, path, FPS, counter)"},
+    {"latency", latency_status, "Get latency from exposure to correction by stages (ms)"},
     {"settings", listconf, "List current configuration"},
+    {"stpcmdstat", steppercmdstat, "Get round trip statistics of steppers server commands (ms)"},
     {"stpserv", stepperstatus, "Get status of steppers server"},
     {NULL, NULL, NULL}
 };
@@ -81,9 +87,15 @@ static char *setfocusstate(const char *state, char *buf, int buflen);
 static char *moveU(const char *val, char *buf, int buflen);
 static char *moveV(const char *val, char *buf, int buflen);
 static char *addcmnt(const char *cmnt, char *buf, int buflen);
+static char *darkacq(const char *val, char *buf, int buflen);
+static char *darkclear(const char *val, char *buf, int buflen);
+static char *darkload(const char *val, char *buf, int buflen);
 // should be in sorted order
 static setter setterHandlers[] = {
     {"comment", addcmnt, "Add comment to XY log file"},
+    {"darkacq", darkacq, "Acquire master dark by N frames (close the shutter before!)"},
+    {"darkclear", darkclear, "Remove all master darks (and their files)"},
+    {"darkload", darkload, "Replace master darks by saved ones"},
     {"focus", setfocusstate, "Move focus to given value"},
     {"moveU", moveU, "Relative moving by U axe"},
     {"moveV", moveV, "Relative moving by V axe"},
@@ -129,6 +141,10 @@ static char *stepperstatus(const char *messageid, char *buf, int buflen){
     if(theSteppers && theSteppers->stepstatus) return theSteppers->stepstatus(messageid, buf, buflen);
     return retFAIL(buf, buflen);
 }
+static char *steppercmdstat(const char *messageid, char *buf, int buflen){
+    if(theSteppers && theSteppers->cmdstat) return theSteppers->cmdstat(messageid, buf, buflen);
+    return retFAIL(buf, buflen);
+}
 static char *getimagedata(const char *messageid, char *buf, int buflen){
     if(imagedata) return imagedata(messageid, buf, buflen);
     return retFAIL(buf, buflen);
@@ -160,6 +176,21 @@ static char *addcmnt(const char *cmnt, char *buf, int buflen){
     free(line);
     return ret ? retOK(buf, buflen) : retFAIL(buf, buflen) ;
 }
+static char *darkacq(const char *val, char *buf, int buflen){
+    if(!val) return retFAIL(buf, buflen);
+    char *eptr;
+    long N = strtol(val, &eptr, 10);
+    if(eptr == val || N < 1 || N > DARK_NMAX) return retFAIL(buf, buflen);
+    return dark_acquire((int)N) ? retOK(buf, buflen) : retFAIL(buf, buflen);
+}
+static char *darkclear(_U_ const char *val, char *buf, int buflen){
+    dark_clear();
+    return retOK(buf, buflen);
+}
+static char *darkload(_U_ const char *val, char *buf, int buflen){
+    dark_load();
+    return retOK(buf, buflen);
+}
 
 /*
 static char *rmnl(const char *msg, char *buf, int buflen){
@@ -18,27 +18,43 @@
 
 #define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <math.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <poll.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "debug.h"
 #include "improc.h" // global variable stopwork
+#include "latency.h"
 #include "steppers.h"
 #include "socket.h"
 
 // buffer for socket
 #define BUFLEN  (256)
+// receiving buffer length (should be greater than max answer length)
+#define RBUFLEN (4096)
+// size of commands' hash table (power of 2)
+#define CMDHASH_SZ  (16)
 
 // max time to wait answer "OK" from server
 #define WAITANSTIME         (0.3)
+// max amount of commands waiting for answer
+#define CMDQUEUE_LEN        (64)
+// motors state polling interval while moving and in rest (should be less than STEPPERS_NOANS_TIMEOUT), seconds
+#define POLL_MOVING         (0.02)
+#define POLL_IDLE           (1.)
 
 
 // amount of consequent center coordinates coincidence in `process_targetstate`
@@ -61,6 +77,8 @@ typedef enum{
     STP_GOTOTHEMIDDLE,
     STP_FINDTARGET,
     STP_FIX,
+    STP_CALIBRATE,
+    STP_AUTOTUNE,
     STP_UNDEFINED,
     STP_STATE_AMOUNT
 } STPstate;
@@ -78,6 +96,51 @@ typedef enum{
 } setupstatus;
 static _Atomic setupstatus sstatus = SETUP_NONE; // setup state
 
+// stages of fast calibration
+typedef enum{
+    CALIB_NONE,
+    CALIB_INIT,             // get starting coordinates and move U
+    CALIB_WAITU,            // move V
+    CALIB_WAITV,            // move U and V back
+    CALIB_WAITBACK          // calculate K
+} calibstage;
+static _Atomic calibstage cstage = CALIB_NONE;
+
+// PID autotuning by relay feedback
+typedef struct{
+    int axis;           // tuning axis: Ustepper/Vstepper or -1 to init
+    int p0;             // initial position of axis
+    int h;              // relay amplitude, steps
+    int out;            // relay output: +1/-1
+    int nup;            // amount of upward switches
+    double tup[AT_NCYCLES + 2]; // time of upward switches
+    double emin, emax;  // min/max error (steps) after first upward switch
+    double tstart;      // time of axis tuning start
+} autotune_t;
+static autotune_t at = {.axis = -1};
+
+// online RLS estimator of matrix M: [dX dY]^T = M*[dU dV]^T (K = inv(M))
+typedef struct{
+    double M[2][2];
+    double P[2][2];     // covariance matrix
+    double K[2][2];     // K from last estimation (to check if user changed it)
+    int inited;
+    int Nupd;           // amount of updates
+    int pending;        // waiting for response on correction
+    double du, dv;      // correction applied
+    double x0, y0;      // coordinates before correction
+} rls_t;
+static rls_t rls = {0};
+
+// feed-forward drift model: history of star position without corrections
+typedef struct{
+    double t;           // time
+    double x, y;        // star position minus corrector's shift
+} ffpoint;
+static ffpoint ffhist[FF_NPTS];
+static int ffN = 0, ffidx = 0; // amount of points and index of next point
+static int ffgood = FALSE;      // model fits data
+
 //static int errctr = 0; // sending messages error counter (if > MAX_ERR_CTR, set state to disconnected)
 
 // common global variable for using in several sources (should be inited first)
@@ -109,16 +172,6 @@ typedef enum{
     CMD_AMOUNT
 } steppercmd;
 
-typedef enum{
-    ERR_OK,         // 0 - all OK
-    ERR_BADPAR,     // 1 - parameter's value is wrong
-    ERR_BADVAL,     // 2 - wrong parameter's value
-    ERR_WRONGLEN,   // 3 - wrong message length
-    ERR_BADCMD,     // 4 - unknown command
-    ERR_CANTRUN,    // 5 - can't run given command due to bad parameters or other
-    ERR_AMOUNT      // amount of error codes
-} errcodes;
-
 
 static const char *stp_commands[CMD_AMOUNT] = {
     [CMD_ABSPOS] = "abspos",
@@ -131,6 +184,13 @@ static const char *stp_commands[CMD_AMOUNT] = {
     [CMD_STOP] = "stop",
 };
 
+// perfect hash of commands: index in stp_commands or -1
+static int8_t cmdhash[CMDHASH_SZ];
+// hash function (3*first + last + length) is collision-free for stp_commands
+TRUE_INLINE int hashidx(const char *cmd, size_t len){
+    return (3 * cmd[0] + cmd[len-1] + (int)len) & (CMDHASH_SZ - 1);
+}
+
 static const char* errtxt[ERR_AMOUNT] = {
     [ERR_OK] =   "OK",
     [ERR_BADPAR] =  "BADPAR",
@@ -140,11 +200,46 @@ static const char* errtxt[ERR_AMOUNT] = {
     [ERR_CANTRUN] = "CANTRUN",
 };
 
-static atomic_int LastErr = ERR_OK;
-static sl_sock_t *serialsock = NULL;
+// command sent to server (server answers in order of commands receiving)
+typedef struct{
+    uint64_t id;        // request ID (sequence number)
+    steppercmd idx;     // command
+    double tsent;       // time of sending
+    errcodes ans;       // answer
+    uint8_t done;       // answer received (or command lost)
+    uint8_t expired;    // nobody waits for answer after timeout
+} stpreq;
+
+// statistics of commands round trip
+typedef struct{
+    uint64_t N;         // amount of answers
+    uint64_t timeouts;  // amount of timeouts in `wait_answer`
+    uint64_t lost;      // amount of commands without answer
+    double rttsum;      // sum and max of round trip time
+    double rttmax;
+} cmdstat_t;
+
+static stpreq cmdqueue[CMDQUEUE_LEN];
+static uint64_t q_head = 1, q_tail = 1; // next ID to send and the oldest ID waiting for answer
+static cmdstat_t cmdstat[CMD_AMOUNT];
+static pthread_mutex_t q_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t q_cond = PTHREAD_COND_INITIALIZER;
+
+// events for main thread
+typedef enum{
+    EV_COORDS   = 1 << 0,   // new centroid coordinates
+    EV_MOTSTATE = 1 << 1,   // motor state changed
+    EV_USERCMD  = 1 << 2,   // command from user
+} stpevent;
+static unsigned events = 0;
+static pthread_mutex_t ev_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ev_cond = PTHREAD_COND_INITIALIZER;
+static int serialfd = -1; // socket connected to steppers server
 static pthread_t clientthread;
 
 static STPstate state = STP_DISCONN;   // server state
+// state requested by user (STP_UNDEFINED if none), changed by main thread
+static volatile atomic_int reqstate = STP_UNDEFINED;
 // this flag set to TRUE when next Xc,Yc available
 static volatile atomic_bool coordsRdy = FALSE;
 static double Xtarget = 0., Ytarget = 0.;
@@ -166,17 +261,6 @@ static volatile atomic_int motrelsteps[NMOTORS] = {0};
 static volatile atomic_int motstates[NMOTORS] = {0};
 static uint8_t fixerr = 0; // ==1 if can't fixed
 
-// motor states:
-typedef enum{
-    STATE_RELAX,
-    STATE_ACCEL,
-    STATE_MOVE,
-    STATE_MVSLOW,
-    STATE_DECEL,
-    STATE_STALL,
-    STATE_ERR,
-    STATE_NUM
-} motstate;
 static const char *str_states[STATE_NUM] = {
     [STATE_RELAX] = "relax",
     [STATE_ACCEL] = "accelerated",
@@ -192,25 +276,66 @@ TRUE_INLINE int relaxed(int nmotor){return motstates[nmotor] == STATE_RELAX;}
 #define Vposition   (motposition[Vstepper])
 #define Fposition   (motposition[Fstepper])
 
+// absolute time for pthread_cond_timedwait
+static void abstime(struct timespec *ts, double timeout){
+    clock_gettime(CLOCK_REALTIME, ts);
+    double t = ts->tv_sec + ts->tv_nsec * 1e-9 + timeout;
+    ts->tv_sec = (time_t)t;
+    ts->tv_nsec = (long)((t - ts->tv_sec) * 1e9);
+}
+
+// wake up main thread
+static void stp_event(stpevent ev){
+    pthread_mutex_lock(&ev_mutex);
+    events |= ev;
+    pthread_cond_signal(&ev_cond);
+    pthread_mutex_unlock(&ev_mutex);
+}
+
+/**
+ * @brief stp_waitevent - wait for any event
+ * @param timeout - max waiting time (seconds)
+ * @return events mask (0 if timeout)
+ */
+static unsigned stp_waitevent(double timeout){
+    struct timespec ts;
+    abstime(&ts, timeout);
+    pthread_mutex_lock(&ev_mutex);
+    while(!events && !stopwork){
+        if(ETIMEDOUT == pthread_cond_timedwait(&ev_cond, &ev_mutex, &ts)) break;
+    }
+    unsigned ev = events;
+    events = 0;
+    pthread_mutex_unlock(&ev_mutex);
+    return ev;
+}
+
 static int nth_motor_setter(steppercmd idx, int n, int p);
+static uint64_t nth_motor_setter_async(steppercmd idx, int n, int p);
+static void cmd_flush();
 
 static void stp_disc(){
     motorsoff = TRUE;
+    stp_event(EV_USERCMD);
 }
 
 static void stp_disconnect(){
     DBG("Try to disconnect");
     LOGDBG("Try to disconnect");
-    if(serialsock){
+    pthread_mutex_lock(&q_mutex); // don't allow to send anything
+    int fd = serialfd;
+    serialfd = -1;
+    pthread_mutex_unlock(&q_mutex);
+    if(fd > -1){
         DBG("Close socket");
-        sl_sock_delete(&serialsock);
-        if(!pthread_cancel(clientthread)){
-            DBG("Join canceled thread");
-            pthread_join(clientthread, NULL);
-            DBG("OK");
-        }
+        shutdown(fd, SHUT_RDWR); // reading thread will exit
+        DBG("Join reading thread");
+        pthread_join(clientthread, NULL);
+        close(fd);
+        DBG("OK");
         LOGWARN("Stepper server disconnected");
     }
+    cmd_flush();
     state = STP_DISCONN;
 }
 
@@ -234,12 +359,15 @@ static errcodes parser(steppercmd idx, int nmot, int ival){
         break;
         case CMD_STATE:
             if(!goodidx) return ERR_BADPAR;
-            motstates[nmot] = ival;
+            if(motstates[nmot] != ival){
+                motstates[nmot] = ival;
+                stp_event(EV_MOTSTATE);
+            }
             if(chkNmot(nmot)){ // one of our motors - check err or stall
                 if(ival == STATE_STALL || ival == STATE_ERR){
                     WARNX("BAD status of motor %d", nmot);
                     LOGWARN("BAD status of motor %d", nmot);
-                    nth_motor_setter(CMD_EMSTOP, nmot, 1); // tty to clear error
+                    nth_motor_setter_async(CMD_EMSTOP, nmot, 1); // try to clear error (don't wait: we are in reading thread)
                 }
             }
         break;
@@ -265,82 +393,192 @@ static errcodes getecode(const char *msg){
     return e;
 }
 
+// mark request as done (should be called with locked q_mutex)
+static void cmd_finish(stpreq *r, errcodes e, int lost){
+    r->ans = e;
+    r->done = 1;
+    cmdstat_t *st = &cmdstat[r->idx];
+    if(lost){
+        ++st->lost;
+        return;
+    }
+    double rtt = sl_dtime() - r->tsent;
+    ++st->N;
+    st->rttsum += rtt;
+    if(rtt > st->rttmax) st->rttmax = rtt;
+}
+
 /**
- * @brief parse_msg - parse last message
- * @param msg - message received
+ * @brief cmd_complete - got answer for the oldest command in queue
+ * @param idx - index of command for getters' answers (`cmdN=val`) or -1 for error codes
+ * @param e - error code
  */
-static void parse_msg(char *msg){
-    char value[128];
-    if(!msg) return;
-    char *key = get_keyval(msg, value);
-    if(key){
-        int ival = atoi(value);
-        //LOGDBG("key = %s, value = %s (%d)", key, value, ival);
-        size_t l = strlen(key);
-        size_t numpos = strcspn(key, "0123456789");
-        int parno = -1;
-        if(numpos < l){
-            parno = atoi(key + numpos);
-            key[numpos] = 0;
+static void cmd_complete(int idx, errcodes e){
+    pthread_mutex_lock(&q_mutex);
+    if(idx > -1){ // answer contains command name: skip commands with lost answers
+        uint64_t i;
+        for(i = q_tail; i != q_head; ++i)
+            if(cmdqueue[i % CMDQUEUE_LEN].idx == (steppercmd)idx) break;
+        if(i == q_head){ // unsolicited message
+            pthread_mutex_unlock(&q_mutex);
+            return;
         }
-        //DBG("numpos=%zd, parno=%d", numpos, parno);
-        if(parno > -1){ // got motor number
-            if(!chkNmot(parno)){
-                DBG("Not our business");
-                free(key); return;
-            }
+        for(; q_tail != i; ++q_tail){
+            LOGWARN("Lost answer for '%s'", stp_commands[cmdqueue[q_tail % CMDQUEUE_LEN].idx]);
+            cmd_finish(&cmdqueue[q_tail % CMDQUEUE_LEN], ERR_CANTRUN, TRUE);
         }
-        for(int idx = 0; idx < CMD_AMOUNT; ++idx){
-            // search index in commands
-            if(0 == strcmp(stp_commands[idx], key)){ // found our
-                //LOGDBG("OK, idx=%d, cmd=%s", idx, stp_commands[idx]);
-                LastErr = parser(idx, parno, ival);
-                break;
-            }
+    }else{ // error code can't be bound to command: answers of timed out commands are treated as lost
+        // (but the last one in queue could get late answer)
+        while(q_head - q_tail > 1 && cmdqueue[q_tail % CMDQUEUE_LEN].expired){
+            LOGWARN("Lost answer for '%s'", stp_commands[cmdqueue[q_tail % CMDQUEUE_LEN].idx]);
+            cmd_finish(&cmdqueue[q_tail % CMDQUEUE_LEN], ERR_CANTRUN, TRUE);
+            ++q_tail;
         }
-        free(key);
-        return;
-    }else{
+    }
+    if(q_tail != q_head){
+        cmd_finish(&cmdqueue[q_tail % CMDQUEUE_LEN], e, FALSE);
+        ++q_tail;
+        pthread_cond_broadcast(&q_cond);
+    }
+    pthread_mutex_unlock(&q_mutex);
+}
+
+// clear queue after disconnection
+static void cmd_flush(){
+    pthread_mutex_lock(&q_mutex);
+    for(; q_tail != q_head; ++q_tail) cmd_finish(&cmdqueue[q_tail % CMDQUEUE_LEN], ERR_CANTRUN, TRUE);
+    pthread_cond_broadcast(&q_cond);
+    pthread_mutex_unlock(&q_mutex);
+}
+
+// fill commands' hash table, @return FALSE if hash function has collisions
+static int mkcmdhash(){
+    memset(cmdhash, -1, sizeof(cmdhash));
+    for(int i = 0; i < CMD_AMOUNT; ++i){
+        int h = hashidx(stp_commands[i], strlen(stp_commands[i]));
+        if(cmdhash[h] > -1) return FALSE;
+        cmdhash[h] = (int8_t)i;
+    }
+    return TRUE;
+}
+
+// find command by its name (not zero-terminated), @return index or -1
+static int findcmd(const char *cmd, size_t len){
+    if(!len) return -1;
+    int idx = cmdhash[hashidx(cmd, len)];
+    if(idx < 0 || strncmp(stp_commands[idx], cmd, len) || stp_commands[idx][len]) return -1;
+    return idx;
+}
+
+/**
+ * @brief parse_msg - parse message in place (without allocations)
+ * @param msg - zero-terminated message received (without '\n')
+ * @param len - its length
+ */
+static void parse_msg(char *msg, size_t len){
+    while(len && (msg[len-1] == '\r' || msg[len-1] == ' ')) msg[--len] = 0;
+    char *eq = memchr(msg, '=', len);
+    if(!eq){
         DBG("GOT NON-setter %s", msg);
         errcodes e = getecode(msg);
-        if(e != ERR_AMOUNT) LastErr = e; // for checking
+        if(e != ERR_AMOUNT) cmd_complete(-1, e);
+        return;
+    }
+    // `key` is letters, then (optional) motor number
+    char *key = msg;
+    while(key < eq && *key == ' ') ++key;
+    char *p = key;
+    while(p < eq && *p >= 'a' && *p <= 'z') ++p;
+    int idx = findcmd(key, p - key);
+    if(idx < 0) return;
+    int parno = -1;
+    if(p < eq && *p >= '0' && *p <= '9'){
+        parno = 0;
+        while(p < eq && *p >= '0' && *p <= '9') parno = parno * 10 + *p++ - '0';
+    }
+    int ival = (int)strtol(eq + 1, NULL, 10);
+    //DBG("idx=%d, parno=%d, ival=%d", idx, parno, ival);
+    if(parno > -1 && !chkNmot(parno)){
+        DBG("Not our business");
+        return;
     }
+    cmd_complete(idx, parser(idx, parno, ival));
 }
 
 /**
- * @brief send_message - send character string `msg` to serial server, get and parse answer
+ * @brief send_message_async - send character string `msg` to serial server, don't wait for answer
  * @param msg - message (for setters could be like "N=M" or "=M") or NULL (for getters)
- * @return FALSE if failed (should reconnect)
+ * @return request ID or 0 if failed
  */
-static errcodes send_message(steppercmd idx, char *msg){
+static uint64_t send_message_async(steppercmd idx, const char *msg){
     // FNAME();
-    if(!serialsock){
-        WARNX("Not connected to serial socket!");
-        return ERR_CANTRUN;
-    }
     char buf[256];
     size_t msglen;
     if(!msg) msglen = snprintf(buf, 255, "%s\n", stp_commands[idx]);
     else msglen = snprintf(buf, 255, "%s%s\n", stp_commands[idx], msg);
     //DBG("Send message '%s', len %zd", buf, msglen);
-    LastErr = ERR_AMOUNT;
-    if(sl_sock_sendstrmessage(serialsock, buf) != (ssize_t)msglen){
+    pthread_mutex_lock(&q_mutex); // lock before sending to keep the order of queue
+    if(serialfd < 0){
+        pthread_mutex_unlock(&q_mutex);
+        WARNX("Not connected to serial socket!");
+        return 0;
+    }
+    if(q_head - q_tail >= CMDQUEUE_LEN){
+        pthread_mutex_unlock(&q_mutex);
+        WARNX("Commands queue overflow");
+        LOGWARN("send_message_async(): commands queue overflow");
+        return 0;
+    }
+    uint64_t id = q_head;
+    cmdqueue[id % CMDQUEUE_LEN] = (stpreq){.id = id, .idx = idx, .tsent = sl_dtime()};
+    if(send(serialfd, buf, msglen, MSG_NOSIGNAL) != (ssize_t)msglen){
+        pthread_mutex_unlock(&q_mutex);
         WARN("send()");
-        LOGWARN("send_message(): send() failed");
-        return ERR_WRONGLEN;
+        LOGWARN("send_message_async(): send() failed");
+        return 0;
+    }
+    ++q_head;
+    pthread_mutex_unlock(&q_mutex);
+    //LOGDBG("send_message_async(): message '%s' sent", buf);
+    return id;
+}
+
+/**
+ * @brief wait_answer - wait for answer on command
+ * @param id - request ID (from `send_message_async`)
+ * @param timeout - max waiting time (seconds)
+ * @return answer code
+ */
+static errcodes wait_answer(uint64_t id, double timeout){
+    if(!id) return ERR_CANTRUN;
+    struct timespec ts;
+    abstime(&ts, timeout);
+    errcodes e = ERR_CANTRUN;
+    pthread_mutex_lock(&q_mutex);
+    stpreq *r = &cmdqueue[id % CMDQUEUE_LEN];
+    while(r->id == id && !r->done){
+        if(ETIMEDOUT == pthread_cond_timedwait(&q_cond, &q_mutex, &ts)) break;
     }
-    //LOGDBG("send_message(): message '%s' sent", buf);
-    double t0 = sl_dtime();
-    while(sl_dtime() - t0 < STEPPERS_NOANS_TIMEOUT){
-        if(LastErr != ERR_AMOUNT) return LastErr;
+    if(r->id == id){
+        if(r->done) e = r->ans;
+        else{
+            r->expired = 1;
+            ++cmdstat[r->idx].timeouts;
+            LOGWARN("wait_answer(): got NO answer for %s", stp_commands[r->idx]);
+        }
     }
-    LOGWARN("send_message(): got NO answer for %s%s", stp_commands[idx], msg);
-    return ERR_CANTRUN;
+    pthread_mutex_unlock(&q_mutex);
+    return e;
 }
 
-// send command cmd to n'th motor with param p, @return FALSE if failed
-static int nth_motor_setter(steppercmd idx, int n, int p){
-    if(idx < 0 || idx >= CMD_AMOUNT) return FALSE;
+// send message and wait for answer
+static errcodes send_message(steppercmd idx, const char *msg){
+    return wait_answer(send_message_async(idx, msg), STEPPERS_NOANS_TIMEOUT);
+}
+
+// send command cmd to n'th motor with param p, @return request ID or 0 if failed
+static uint64_t nth_motor_setter_async(steppercmd idx, int n, int p){
+    if(idx < 0 || idx >= CMD_AMOUNT) return 0;
     char buf[256];
     if(n < 0){ // setter without number
         snprintf(buf, 255, "=%d", p);
@@ -353,71 +591,103 @@ static int nth_motor_setter(steppercmd idx, int n, int p){
     }else{
         WARNX("Wrong motno %d", n);
         LOGWARN("Wrong motno %d (cmd=%s, setter=%d)", n, stp_commands[idx], p);
+        return 0;
     }
-    if(ERR_OK != send_message(idx, buf)) return FALSE;
+    return send_message_async(idx, buf);
+}
+/**
+ * @brief wait_setter - wait answer for setter sent by `nth_motor_setter_async`
+ * @return FALSE if failed
+ * Moving commands accepted by server mark motor as moving until next state polling,
+ * so coordinates got just after correction won't be trusted
+ */
+static int wait_setter(uint64_t id, steppercmd idx, int n){
+    if(ERR_OK != wait_answer(id, STEPPERS_NOANS_TIMEOUT)) return FALSE;
+    if((idx == CMD_GOTO || idx == CMD_GOTOZ || idx == CMD_RELPOS) && chkNmot(n))
+        motstates[n] = STATE_ACCEL;
     return TRUE;
 }
-// and simplest getter
-static int nth_motor_getter(steppercmd idx, int n){
-    if(idx < 0 || idx >= CMD_AMOUNT) return FALSE;
-    char buf[32], *msg = NULL;
+// send command and wait for answer, @return FALSE if failed
+static int nth_motor_setter(steppercmd idx, int n, int p){
+    return wait_setter(nth_motor_setter_async(idx, n, p), idx, n);
+}
+// and simplest getter, @return request ID or 0 if failed
+static uint64_t nth_motor_getter_async(steppercmd idx, int n){
+    if(idx < 0 || idx >= CMD_AMOUNT) return 0;
+    char buf[32];
     if(n > -1 && n < NMOTORS){
         sprintf(buf, "%d", n);
         //DBG("nth_motor_getter(): %s%d", stp_commands[idx], n);
         //LOGDBG("nth_motor_getter(): %s%d", stp_commands[idx], n);
-        msg = buf;
     }else{
         WARNX("Wrong motno %d", n);
         LOGWARN("nth_motor_getter(): wrong motno %d (cmd=%s)", n, stp_commands[idx]);
+        return 0;
     }
-    if(ERR_OK != send_message(idx, msg)) return FALSE;
-    return TRUE;
-}
-
-// send getter to all motors; return FALSE if failed
-static int chkmots(steppercmd cmd){
-    if( nth_motor_getter(cmd, Ustepper) &&
-        nth_motor_getter(cmd, Vstepper) &&
-        nth_motor_getter(cmd, Fstepper)) return TRUE;
-    return FALSE;
+    return send_message_async(idx, buf);
 }
 
+// send all getters at once and then wait for answers
 static void chkall(){
-    chkmots(CMD_STATE);
-    chkmots(CMD_ABSPOS);
-    chkmots(CMD_RELPOS);
+    const steppercmd cmds[] = {CMD_STATE, CMD_ABSPOS, CMD_RELPOS};
+    const stepperno mots[] = {Ustepper, Vstepper, Fstepper};
+    uint64_t ids[3*3];
+    int n = 0;
+    for(int c = 0; c < 3; ++c)
+        for(int m = 0; m < 3; ++m) ids[n++] = nth_motor_getter_async(cmds[c], mots[m]);
+    for(int i = 0; i < n; ++i) wait_answer(ids[i], STEPPERS_NOANS_TIMEOUT);
 }
 
 /**
  * @brief clientproc - process data received from serial terminal
- * @param par - socket
+ * @param par - socket fd
  * @return NULL
  */
-void *clientproc(void _U_ *par){
+static void *clientproc(void *par){
     FNAME();
-    char rbuf[BUFSIZ];
-    if(!serialsock) return NULL;
-    double t0 = sl_dtime();
-    do{
-        ssize_t got = sl_sock_readline(serialsock, rbuf, BUFSIZ);
-        //LOGDBG("got=%zd", got);
-        if(got < 0 || sl_dtime() - t0 > STEPPERS_NOANS_TIMEOUT){ // disconnected
+    int fd = (int)(intptr_t)par;
+    char rbuf[RBUFLEN + 1];
+    size_t start = 0, end = 0; // unprocessed data in `rbuf`
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    while(1){
+        int r = poll(&pfd, 1, (int)(STEPPERS_NOANS_TIMEOUT * 1000.));
+        if(r < 0){
+            if(errno == EINTR) continue;
+            WARN("poll()");
+            break;
+        }
+        if(r == 0){
             WARNX("Serial server disconnected");
             LOGERR("Serial server disconnected (timeout reached)");
-            if(serialsock) sl_sock_delete(&serialsock);
-            state = STP_DISCONN;
-            return NULL;
-        }else if(got == 0){ // nothing to read from serial port
-            usleep(1000);
-            continue;
+            break;
         }
-        //LOGDBG("clientproc(): got '%s'", rbuf);
-        // process data
-        parse_msg(rbuf);
-        t0 = sl_dtime();
-    } while(serialsock && serialsock->connected);
+        if(end == RBUFLEN){ // move unprocessed data to beginning
+            if(start == 0){
+                WARNX("Too long message from serial server");
+                LOGWARN("clientproc(): too long message, clear buffer");
+                end = 0;
+            }else{
+                memmove(rbuf, rbuf + start, end - start);
+                end -= start;
+                start = 0;
+            }
+        }
+        ssize_t got = read(fd, rbuf + end, RBUFLEN - end);
+        if(got < 1) break; // disconnected
+        end += got;
+        char *line = rbuf + start, *bufend = rbuf + end, *eol;
+        while((eol = memchr(line, '\n', bufend - line))){
+            *eol = 0;
+            parse_msg(line, eol - line);
+            line = eol + 1;
+        }
+        start = line - rbuf;
+        if(start == end) start = end = 0;
+    }
     WARNX("disconnected");
-    if(serialsock) sl_sock_delete(&serialsock);
+    shutdown(fd, SHUT_RDWR);
+    cmd_flush();
+    state = STP_DISCONN;
     return NULL;
 }
 
@@ -431,19 +701,38 @@ static int stp_connect_server(){
     char node[32];
     snprintf(node, 31, "%d", theconf.stpserverport);
     DBG("Try to connect via port %s", node);
-    serialsock = sl_sock_run_client(SOCKT_NETLOCAL, node, 4096);
-    if(!serialsock){
-        DBG("Can't connect to serial server via port %s", node);
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo("127.0.0.1", node, &hints, &res)){
+        DBG("getaddrinfo() failed");
         return FALSE;
     }
-    if(pthread_create(&clientthread, NULL, clientproc, NULL)){
-        sl_sock_delete(&serialsock);
-        LOGWARN("stp_connect_server(): can't create client thread");
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if(fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen)){
+        DBG("Can't connect to serial server via port %s", node);
+        if(fd > -1) close(fd);
+        freeaddrinfo(res);
         return FALSE;
     }
+    freeaddrinfo(res);
+    int one = 1; // send short commands immediately
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) WARN("setsockopt()");
+    pthread_mutex_lock(&q_mutex);
+    serialfd = fd;
+    pthread_mutex_unlock(&q_mutex);
     // register and set max speed; don't check `register` answer as they could be registered already
     state = STP_RELAX;
     sstatus = SETUP_NONE;
+    if(pthread_create(&clientthread, NULL, clientproc, (void*)(intptr_t)fd)){
+        pthread_mutex_lock(&q_mutex);
+        serialfd = -1;
+        pthread_mutex_unlock(&q_mutex);
+        close(fd);
+        state = STP_DISCONN;
+        LOGWARN("stp_connect_server(): can't create client thread");
+        return FALSE;
+    }
     LOGMSG("Connected to stepper server");
     return TRUE;
 }
@@ -654,6 +943,363 @@ static int process_targetstage(double X, double Y){
     return TRUE;
 }
 
+// B = inv(A), @return FALSE if A is singular
+static int inv2(double A[2][2], double B[2][2]){
+    double det = A[0][0]*A[1][1] - A[0][1]*A[1][0];
+    double norm = fabs(A[0][0]) + fabs(A[0][1]) + fabs(A[1][0]) + fabs(A[1][1]);
+    if(!isfinite(det) || fabs(det) < 1e-6 * norm * norm || norm < DBL_EPSILON) return FALSE;
+    B[0][0] = A[1][1] / det; B[0][1] = -A[0][1] / det;
+    B[1][0] = -A[1][0] / det; B[1][1] = A[0][0] / det;
+    return TRUE;
+}
+
+static void getK(double K[2][2]){
+    K[0][0] = theconf.Kxu; K[0][1] = theconf.Kyu;
+    K[1][0] = theconf.Kxv; K[1][1] = theconf.Kyv;
+}
+
+/**
+ * @brief setK - set new Kxu..Kyv by matrix M (dXY = M*dUV)
+ * @return FALSE if K is out of limits
+ */
+static int setK(double M[2][2]){
+    double K[2][2];
+    if(!inv2(M, K)) return FALSE;
+    for(int i = 0; i < 2; ++i) for(int j = 0; j < 2; ++j)
+        if(K[i][j] < KUVMIN || K[i][j] > KUVMAX) return FALSE;
+    theconf.Kxu = K[0][0]; theconf.Kyu = K[0][1];
+    theconf.Kxv = K[1][0]; theconf.Kyv = K[1][1];
+    memcpy(rls.K, K, sizeof(K));
+    return TRUE;
+}
+
+// init estimator by current K
+static void rls_init(){
+    getK(rls.K);
+    if(!inv2(rls.K, rls.M)) memset(rls.M, 0, sizeof(rls.M)); // start from zero
+    rls.P[0][0] = rls.P[1][1] = RLS_P0;
+    rls.P[0][1] = rls.P[1][0] = 0.;
+    rls.Nupd = 0;
+    rls.pending = FALSE;
+    rls.inited = TRUE;
+}
+
+/**
+ * @brief rls_update - refine M (and K) by applied correction and observed response
+ * @param du, dv - steps applied
+ * @param dx, dy - centroid moving
+ */
+static void rls_update(double du, double dv, double dx, double dy){
+    double K[2][2];
+    getK(K);
+    if(!rls.inited || memcmp(K, rls.K, sizeof(K))) rls_init(); // K was changed by user or setup
+    if(fabs(du) + fabs(dv) < RLS_MINSTEPS) return;
+    double lambda = theconf.rlslambda;
+    if(lambda < RLS_LAMBDA_MIN) lambda = RLS_LAMBDA_MIN;
+    double (*M)[2] = rls.M, (*P)[2] = rls.P;
+    double px = M[0][0]*du + M[0][1]*dv, py = M[1][0]*du + M[1][1]*dv; // predicted moving
+    double ex = dx - px, ey = dy - py;
+    if(rls.Nupd >= RLS_MINUPD && sqrt(ex*ex + ey*ey) > RLS_MAXERR + 0.5*sqrt(px*px + py*py)){
+        LOGDBG("RLS: outlier, predicted (%.1f, %.1f), got (%.1f, %.1f)", px, py, dx, dy);
+        return;
+    }
+    double Pphi[2] = {P[0][0]*du + P[0][1]*dv, P[1][0]*du + P[1][1]*dv};
+    double den = lambda + du*Pphi[0] + dv*Pphi[1];
+    double g[2] = {Pphi[0] / den, Pphi[1] / den};
+    for(int j = 0; j < 2; ++j){
+        M[0][j] += ex * g[j];
+        M[1][j] += ey * g[j];
+    }
+    for(int i = 0; i < 2; ++i) for(int j = 0; j < 2; ++j)
+        P[i][j] = (P[i][j] - g[i]*Pphi[j]) / lambda;
+    double tr = P[0][0] + P[1][1];
+    if(tr > RLS_PMAX){ // no excitation: don't let covariance grow infinitely
+        for(int i = 0; i < 2; ++i) for(int j = 0; j < 2; ++j) P[i][j] *= RLS_PMAX / tr;
+    }
+    if(++rls.Nupd < RLS_MINUPD) return;
+    if(setK(M)) LOGDBG("RLS: Kxu=%g, Kyu=%g; Kxv=%g, Kyv=%g", theconf.Kxu, theconf.Kyu, theconf.Kxv, theconf.Kyv);
+    else LOGDBG("RLS: K out of limits, don't change");
+}
+
+/**
+ * @brief process_calibration - fast calibration by three moves: U, V and back both
+ * M = sum(dXY*dUV^T) * inv(sum(dUV*dUV^T))
+ */
+static void process_calibration(){
+    static double X[4], Y[4];
+    static int du, dv;
+    if(!coordsRdy) return;
+    coordsRdy = FALSE;
+    switch(cstage){
+        case CALIB_INIT:
+            X[0] = Xtarget; Y[0] = Ytarget;
+            du = (int)((theconf.maxUpos - theconf.minUpos) * CALIB_FRAC);
+            dv = (int)((theconf.maxVpos - theconf.minVpos) * CALIB_FRAC);
+            if(Uposition + du > theconf.maxUpos) du = -du;
+            if(Vposition + dv > theconf.maxVpos) dv = -dv;
+            if(!nth_motor_setter(CMD_RELPOS, Ustepper, du)) break;
+            LOGMSG("process_calibration(): CALIB_WAITU");
+            cstage = CALIB_WAITU;
+            return;
+        case CALIB_WAITU:
+            X[1] = Xtarget; Y[1] = Ytarget;
+            if(!nth_motor_setter(CMD_RELPOS, Vstepper, dv)) break;
+            LOGMSG("process_calibration(): CALIB_WAITV");
+            cstage = CALIB_WAITV;
+            return;
+        case CALIB_WAITV:
+            X[2] = Xtarget; Y[2] = Ytarget;
+            if(!nth_motor_setter(CMD_RELPOS, Ustepper, -du) ||
+               !nth_motor_setter(CMD_RELPOS, Vstepper, -dv)) break;
+            LOGMSG("process_calibration(): CALIB_WAITBACK");
+            cstage = CALIB_WAITBACK;
+            return;
+        case CALIB_WAITBACK:{
+            X[3] = Xtarget; Y[3] = Ytarget;
+            const double phi[3][2] = {{du, 0.}, {0., dv}, {-du, -dv}};
+            double A[2][2] = {0}, B[2][2] = {0}, Ainv[2][2], M[2][2];
+            for(int k = 0; k < 3; ++k){
+                double d[2] = {X[k+1] - X[k], Y[k+1] - Y[k]};
+                for(int i = 0; i < 2; ++i) for(int j = 0; j < 2; ++j){
+                    A[i][j] += phi[k][i] * phi[k][j];
+                    B[i][j] += d[i] * phi[k][j];
+                }
+            }
+            LOGMSG("process_calibration(): closure error (%.1f, %.1f)", X[3] - X[0], Y[3] - Y[0]);
+            if(!inv2(A, Ainv)) break;
+            for(int i = 0; i < 2; ++i) for(int j = 0; j < 2; ++j)
+                M[i][j] = B[i][0]*Ainv[0][j] + B[i][1]*Ainv[1][j];
+            if(!setK(M)){
+                LOGWARN("process_calibration(): K out of limits");
+                break;
+            }
+            LOGMSG("process_calibration(): Kxu=%g, Kyu=%g; Kxv=%g, Kyv=%g", theconf.Kxu, theconf.Kyu, theconf.Kxv, theconf.Kyv);
+            saveconf(NULL);
+            rls_init();
+            cstage = CALIB_NONE;
+            state = STP_RELAX;
+            return;
+        }
+        default:
+            return;
+    }
+    // some error occured
+    WARNX("Calibration failed");
+    LOGWARN("Calibration failed at stage %d", cstage);
+    cstage = CALIB_NONE;
+    state = STP_RELAX;
+}
+
+/**
+ * @brief ff_addpoint - add star position (corrected by motors' shifts) into drift history
+ * @param X, Y - centroid coordinates
+ */
+static void ff_addpoint(double X, double Y){
+    double K[2][2], M[2][2];
+    getK(K);
+    if(!inv2(K, M)) return;
+    ffpoint *p = &ffhist[ffidx];
+    p->t = sl_dtime();
+    p->x = X - (M[0][0]*Uposition + M[0][1]*Vposition);
+    p->y = Y - (M[1][0]*Uposition + M[1][1]*Vposition);
+    ffidx = (ffidx + 1) % FF_NPTS;
+    if(ffN < FF_NPTS) ++ffN;
+}
+
+// solve n x n linear system A*x = b (Gauss with partial pivoting), @return FALSE if singular
+static int lsolve(int n, double A[4][4], double b[4], double x[4]){
+    for(int c = 0; c < n; ++c){
+        int piv = c;
+        for(int r = c + 1; r < n; ++r) if(fabs(A[r][c]) > fabs(A[piv][c])) piv = r;
+        if(fabs(A[piv][c]) < 1e-12) return FALSE;
+        if(piv != c){
+            for(int k = 0; k < n; ++k){ double t = A[c][k]; A[c][k] = A[piv][k]; A[piv][k] = t; }
+            double t = b[c]; b[c] = b[piv]; b[piv] = t;
+        }
+        for(int r = c + 1; r < n; ++r){
+            double f = A[r][c] / A[c][c];
+            for(int k = c; k < n; ++k) A[r][k] -= f * A[c][k];
+            b[r] -= f * b[c];
+        }
+    }
+    for(int r = n - 1; r > -1; --r){
+        double s = b[r];
+        for(int k = r + 1; k < n; ++k) s -= A[r][k] * x[k];
+        x[r] = s / A[r][r];
+    }
+    return TRUE;
+}
+
+/**
+ * @brief ff_predict - fit drift model (a + b*t [+ c*sin(wt) + d*cos(wt)]) by history and predict shift
+ * @param lead - time of prediction (from now), seconds
+ * @param dx, dy (o) - predicted star shift
+ * @return FALSE if model isn't ready or don't fit data
+ */
+static int ff_predict(double lead, double *dx, double *dy){
+    int periodic = (theconf.ffmode == 2 && theconf.ffperiod > 0.);
+    int n = periodic ? 4 : 2;
+    double window = FF_WINDOW;
+    if(periodic && theconf.ffperiod > window) window = theconf.ffperiod;
+    double tnow = sl_dtime(), w = periodic ? 2. * M_PI / theconf.ffperiod : 0.;
+    double A[4][4] = {0}, bx[4] = {0}, by[4] = {0}, cx[4], cy[4], f[4];
+    int N = 0;
+    #define BASIS(t) do{f[0] = 1.; f[1] = (t); if(periodic){f[2] = sin(w*(t)); f[3] = cos(w*(t));}}while(0)
+    for(int i = 0; i < ffN; ++i){
+        ffpoint *p = &ffhist[i];
+        double t = p->t - tnow;
+        if(t < -window) continue;
+        BASIS(t);
+        for(int r = 0; r < n; ++r){
+            for(int c = 0; c < n; ++c) A[r][c] += f[r] * f[c];
+            bx[r] += f[r] * p->x;
+            by[r] += f[r] * p->y;
+        }
+        ++N;
+    }
+    if(N < FF_MINPTS) return FALSE;
+    double A1[4][4];
+    memcpy(A1, A, sizeof(A));
+    if(!lsolve(n, A, bx, cx) || !lsolve(n, A1, by, cy)) return FALSE;
+    // residuals
+    double rms = 0.;
+    for(int i = 0; i < ffN; ++i){
+        ffpoint *p = &ffhist[i];
+        double t = p->t - tnow;
+        if(t < -window) continue;
+        BASIS(t);
+        double ex = p->x, ey = p->y;
+        for(int k = 0; k < n; ++k){ ex -= cx[k] * f[k]; ey -= cy[k] * f[k]; }
+        rms += ex*ex + ey*ey;
+    }
+    rms = sqrt(rms / N);
+    int good = (rms < FF_MAXRMS);
+    if(good != ffgood){
+        LOGMSG("Feed-forward drift model %s (residuals RMS=%.2f)", good ? "turned on" : "turned off", rms);
+        ffgood = good;
+    }
+    if(!good) return FALSE;
+    // predicted shift: model(lead) - model(0)
+    double sx = 0., sy = 0., f0[4];
+    BASIS(0.);
+    memcpy(f0, f, sizeof(f));
+    BASIS(lead);
+    for(int k = 0; k < n; ++k){ sx += cx[k] * (f[k] - f0[k]); sy += cy[k] * (f[k] - f0[k]); }
+    #undef BASIS
+    if(sqrt(sx*sx + sy*sy) > FF_MAXPRED) return FALSE;
+    *dx = sx; *dy = sy;
+    return TRUE;
+}
+
+// init relay experiment for given axis, @return FALSE if failed
+static int at_initaxis(int axis, double e){
+    int range = (axis == Ustepper) ? theconf.maxUpos - theconf.minUpos : theconf.maxVpos - theconf.minVpos;
+    int pmin = (axis == Ustepper) ? theconf.minUpos : theconf.minVpos;
+    int pmax = (axis == Ustepper) ? theconf.maxUpos : theconf.maxVpos;
+    at.axis = axis;
+    at.p0 = motposition[axis];
+    at.h = (int)(range * AT_RELAY_FRAC);
+    if(at.h < 1) at.h = 1;
+    if(at.p0 - at.h < pmin || at.p0 + at.h > pmax){
+        LOGWARN("Autotune: axis %d too close to limits", axis);
+        return FALSE;
+    }
+    at.out = (e < 0.) ? -1 : 1;
+    at.nup = 0;
+    at.emin = DBL_MAX; at.emax = -DBL_MAX;
+    at.tstart = sl_dtime();
+    LOGMSG("Autotune: start axis %s, relay amplitude %d steps", motornames[axis], at.h);
+    return nth_motor_setter(CMD_GOTO, axis, at.p0 + at.out * at.h);
+}
+
+/**
+ * @brief at_finishaxis - calculate PID parameters by Ziegler-Nichols rules and store them
+ * Ku = 4h/(pi*a), Kp = 0.6*Ku; Ki = 1.2*Ku/Tu; Kd = 0.075*Ku*Tu
+ * @return FALSE if failed
+ */
+static int at_finishaxis(){
+    double a = (at.emax - at.emin) / 2.;
+    double Tu = (at.tup[at.nup - 1] - at.tup[1]) / (at.nup - 2);
+    nth_motor_setter(CMD_GOTO, at.axis, at.p0); // return to initial position
+    if(a < DBL_EPSILON || Tu < DBL_EPSILON){
+        LOGWARN("Autotune: bad oscillations (a=%g, Tu=%g)", a, Tu);
+        return FALSE;
+    }
+    double Ku = 4. * at.h / (M_PI * a);
+    double P = 0.6 * Ku, I = 1.2 * Ku / Tu, D = 0.075 * Ku * Tu;
+    LOGMSG("Autotune: axis %s, a=%.1f steps, Tu=%.2fs, Ku=%.3f -> P=%.3f, I=%.3f, D=%.3f",
+           motornames[at.axis], a, Tu, Ku, P, I, D);
+    #define CLAMP(x, min, max) do{if(x < min) x = min; else if(x > max) x = max;}while(0)
+    CLAMP(P, PID_P_MIN, PID_P_MAX);
+    CLAMP(I, PID_I_MIN, PID_I_MAX);
+    CLAMP(D, PID_D_MIN, PID_D_MAX);
+    #undef CLAMP
+    if(at.axis == Ustepper){
+        theconf.PIDU_P = P; theconf.PIDU_I = I; theconf.PIDU_D = D;
+    }else{
+        theconf.PIDV_P = P; theconf.PIDV_I = I; theconf.PIDV_D = D;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief process_autotune - relay feedback experiment on U and then on V axis
+ * Relay moves axis to p0+h when error (in steps by this axis) > hysteresis and to p0-h when < -hysteresis,
+ * ultimate gain and period are measured by error oscillations
+ */
+static void process_autotune(){
+    if(!coordsRdy) return;
+    coordsRdy = FALSE;
+    if(theconf.xtarget < 1. || theconf.ytarget < 1.){
+        WARNX("Autotune: target coordinates not defined");
+        LOGWARN("Autotune: target coordinates not defined");
+        goto fail;
+    }
+    double xdev = theconf.xtarget - theconf.xoff - Xtarget, ydev = theconf.ytarget - theconf.yoff - Ytarget;
+    double eU = theconf.Kxu * xdev + theconf.Kyu * ydev, eV = theconf.Kxv * xdev + theconf.Kyv * ydev;
+    if(at.axis < 0){
+        if(!at_initaxis(Ustepper, eU)) goto fail;
+        return;
+    }
+    double e = (at.axis == Ustepper) ? eU : eV;
+    if(sl_dtime() - at.tstart > AT_MAXTIME){
+        LOGWARN("Autotune: timeout for axis %s", motornames[at.axis]);
+        goto fail;
+    }
+    if(at.nup > 0){
+        if(e < at.emin) at.emin = e;
+        if(e > at.emax) at.emax = e;
+    }
+    double hyst = at.h * AT_HYST_FRAC;
+    int out = at.out;
+    if(e > hyst) out = 1;
+    else if(e < -hyst) out = -1;
+    if(out == at.out) return;
+    at.out = out;
+    if(out > 0) at.tup[at.nup++] = sl_dtime();
+    if(at.nup < AT_NCYCLES + 2){
+        if(!nth_motor_setter(CMD_GOTO, at.axis, at.p0 + out * at.h)) goto fail;
+        return;
+    }
+    // enough periods
+    if(!at_finishaxis()) goto fail;
+    if(at.axis == Ustepper){
+        if(!at_initaxis(Vstepper, eV)) goto fail;
+        return;
+    }
+    saveconf(NULL);
+    LOGMSG("Autotune: done");
+    at.axis = -1;
+    state = STP_RELAX;
+    return;
+fail:
+    WARNX("Autotune failed");
+    LOGWARN("Autotune failed");
+    if(at.axis > -1) nth_motor_setter(CMD_GOTO, at.axis, at.p0);
+    at.axis = -1;
+    state = STP_RELAX;
+}
+
 /**
  * @brief compute_pid - calculate PID responce for error
  * @param pid - U/V PID parameters
@@ -683,9 +1329,10 @@ static double compute_pid(PIDController *pid, double error, double current_time)
  * @brief try2correct - try to correct position
  * @param dX - delta of X-coordinate in image space
  * @param dY - delta of Y-coordinate in image space
+ * @param lat - latency record of coordinates (or NULL), its commands' stamps filled here
  * @return FALSE if failed (motors are moving etc) or correction out of limits
  */
-static int try2correct(double dX, double dY){
+static int try2correct(double dX, double dY, latrec_t *lat){
     if(!relaxed(Ustepper) || !relaxed(Vstepper)) return FALSE;
     // calculations: make Ki=0, Kd=0; increase Kp until oscillations;
     // now Tu - osc period, Ku=Kp for oscillations; so:
@@ -724,13 +1371,29 @@ static int try2correct(double dX, double dY){
     }
     LOGDBG("try2correct(): move from (%d, %d) to (%d, %d), delta (%.1f, %.1f)",
            Uposition, Vposition, Unew, Vnew, dU, dV);
+    // send both commands at once, then wait for answers
+    uint64_t uid = 0, vid = 0;
+    if(lat) lat->t[LAT_CMDSENT] = sl_dtime();
+    if(usteps) uid = nth_motor_setter_async(CMD_RELPOS, Ustepper, usteps);
+    if(vsteps) vid = nth_motor_setter_async(CMD_RELPOS, Vstepper, vsteps);
     int ret = TRUE;
-    if(usteps) ret = nth_motor_setter(CMD_RELPOS, Ustepper, usteps);
-    if(vsteps) ret &= nth_motor_setter(CMD_RELPOS, Vstepper, vsteps);
+    if(usteps) ret = wait_setter(uid, CMD_RELPOS, Ustepper);
+    if(vsteps) ret &= wait_setter(vid, CMD_RELPOS, Vstepper);
+    if(ret && lat && (usteps || vsteps)){
+        lat->t[LAT_CMDACK] = sl_dtime();
+        latency_commit(lat);
+    }
     if(!ret) LOGWARN("Canserver: cant run corrections");
+    else if(theconf.rlslambda > 0.){ // wait for response to refine K
+        rls.pending = TRUE;
+        rls.du = usteps; rls.dv = vsteps;
+        rls.x0 = Xtarget; rls.y0 = Ytarget;
+    }
     return ret;
 }
 
+static int coordstrusted = TRUE; // FALSE after moving: first coordinates are thrown away
+
 // global variable proc_corr
 /**
  * @brief stp_process_corrections - get XY corrections (in pixels) and move motors to fix them
@@ -738,7 +1401,6 @@ static int try2correct(double dX, double dY){
  * This function called from improc.c each time the corrections calculated (ONLY IF Xtarget/Ytarget > -1)
  */
 static void stp_process_corrections(double X, double Y){
-    static int coordstrusted = TRUE;
     if(!relaxed(Ustepper) || !relaxed(Vstepper)){ // don't process coordinates when moving
         coordstrusted = FALSE;
         coordsRdy = FALSE;
@@ -751,24 +1413,40 @@ static void stp_process_corrections(double X, double Y){
     }
     //DBG("got centroid data: %g, %g", X, Y);
     Xtarget = X; Ytarget = Y;
+    latency_handoff();
     coordsRdy = TRUE;
+    stp_event(EV_COORDS);
 }
 
-// try to change state; @return TRUE if OK
+// try to change state; @return TRUE if OK (new state would be set by main thread)
 static int stp_setstate(STPstate newstate){
-    if(newstate == state) return TRUE;
     if(newstate == STP_DISCONN){
+        reqstate = STP_UNDEFINED;
         stp_disc();
         return TRUE;
     }
     if(state == STP_DISCONN){
         if(!stp_connect_server()) return FALSE;
     }
+    reqstate = newstate;
+    stp_event(EV_USERCMD);
+    return TRUE;
+}
+
+// MAIN THREAD: change state by user request
+static void stp_applystate(STPstate newstate){
+    if(newstate == state) return;
+    DBG("Change state to %d", newstate);
     if(newstate == STP_SETUP || newstate == STP_GOTOTHEMIDDLE){
         sstatus = SETUP_INIT;
     }else sstatus = SETUP_NONE;
+    cstage = (newstate == STP_CALIBRATE) ? CALIB_INIT : CALIB_NONE;
+    if(state == STP_AUTOTUNE && at.axis > -1){ // interrupted: return axis to initial position
+        LOGMSG("Autotune: interrupted");
+        nth_motor_setter(CMD_GOTO, at.axis, at.p0);
+    }
+    at.axis = -1;
     state = newstate;
-    return TRUE;
 }
 
 // get current status (global variable stepstatus)
@@ -826,6 +1504,29 @@ static char *stp_status(const char *messageid, char *buf, int buflen){
         case STP_FIX:
             l = snprintf(bptr, buflen, "\"%s\"", fixerr ? "fixoutofrange" : "fixing");
         break;
+        case STP_CALIBRATE:
+            switch(cstage){
+                case CALIB_INIT:
+                    stage = "init";
+                break;
+                case CALIB_WAITU:
+                    stage = "waitu";
+                break;
+                case CALIB_WAITV:
+                    stage = "waitv";
+                break;
+                case CALIB_WAITBACK:
+                    stage = "waitback";
+                break;
+                default:
+                    stage = "unknown";
+            }
+            l = snprintf(bptr, buflen, "{ \"calibrate\": \"%s\" }", stage);
+        break;
+        case STP_AUTOTUNE:
+            l = snprintf(bptr, buflen, "{ \"autotune\": \"%s\", \"periods\": %d }",
+                         (at.axis > -1) ? motornames[at.axis] : "init", at.nup > 1 ? at.nup - 1 : 0);
+        break;
         default:
             l = snprintf(bptr, buflen, "\"unknown\"");
     }
@@ -844,6 +1545,27 @@ static char *stp_status(const char *messageid, char *buf, int buflen){
     return buf;
 }
 
+// get commands round trip statistics (global variable cmdstat)
+static char *stp_cmdstat(const char *messageid, char *buf, int buflen){
+    int l;
+    char *bptr = buf;
+    l = snprintf(bptr, buflen, "{ \"%s\": \"%s\"", MESSAGEID, messageid);
+    buflen -= l; bptr += l;
+    pthread_mutex_lock(&q_mutex);
+    for(int i = 0; i < CMD_AMOUNT && buflen > 0; ++i){
+        cmdstat_t *st = &cmdstat[i];
+        l = snprintf(bptr, buflen, ", \"%s\": { \"answers\": %" PRIu64 ", \"rttmean\": %.3f, \"rttmax\": %.3f, "
+                     "\"timeouts\": %" PRIu64 ", \"lost\": %" PRIu64 " }", stp_commands[i], st->N,
+                     st->N ? st->rttsum / st->N * 1e3 : 0., st->rttmax * 1e3, st->timeouts, st->lost);
+        buflen -= l; bptr += l;
+    }
+    l = snprintf(bptr, buflen, ", \"waiting\": %" PRIu64, q_head - q_tail);
+    buflen -= l; bptr += l;
+    pthread_mutex_unlock(&q_mutex);
+    if(buflen > 0) snprintf(bptr, buflen, " }\n");
+    return buf;
+}
+
 // commands from client to change status
 static const char* stringstatuses[STP_STATE_AMOUNT] = {
     [STP_DISCONN] = "disconnect",
@@ -852,6 +1574,8 @@ static const char* stringstatuses[STP_STATE_AMOUNT] = {
     [STP_GOTOTHEMIDDLE] = "middle",
     [STP_FINDTARGET] = "findtarget",
     [STP_FIX] = "fix",
+    [STP_CALIBRATE] = "calibrate",
+    [STP_AUTOTUNE] = "autotune",
     [STP_UNDEFINED] = "undefined"
 };
 
@@ -890,12 +1614,19 @@ static char *set_stpstatus(const char *newstatus, char *buf, int buflen){
     return buf;
 }
 
-// MAIN THREAD
+// TRUE if any motor is moving
+static int anymoving(){
+    return (!relaxed(Ustepper) || !relaxed(Vstepper) || !relaxed(Fstepper));
+}
+
+// MAIN THREAD: wakes up by events (coordinates, motors' state, user commands) or for motors polling
 static void *stp_process_states(_U_ void *arg){
     // FNAME();
     static int first = TRUE; // flag for logging when can't reconnect
+    double tpoll = 0.; // time of last motors polling
     while(!stopwork){
-        usleep(10000);
+        double tnext = tpoll + (anymoving() ? POLL_MOVING : POLL_IDLE) - sl_dtime();
+        if(tnext > 0.) stp_waitevent(tnext);
         // check for disconnection flag
         if(motorsoff){
             motorsoff = FALSE;
@@ -910,16 +1641,14 @@ static void *stp_process_states(_U_ void *arg){
             stp_connect_server();
             continue;
         }
-        static double t0 = -1.;
-        if(t0 < 0.) t0 = sl_dtime();
-        if(state != STP_DISCONN){
-            if(sl_dtime() - t0 >= 0.1){ // each 0.1s check state if steppers aren't disconnected
-                t0 = sl_dtime();
-                chkall();
-                if(!relaxed(Ustepper) && !relaxed(Vstepper)) continue;
-                first = TRUE;
-            }else continue;
+        if(sl_dtime() - tpoll >= (anymoving() ? POLL_MOVING : POLL_IDLE)){ // refresh motors' state
+            tpoll = sl_dtime();
+            chkall();
+            first = TRUE;
         }
+        int newstate = atomic_exchange(&reqstate, STP_UNDEFINED);
+        if(newstate != STP_UNDEFINED) stp_applystate((STPstate)newstate);
+        if(!relaxed(Ustepper) && !relaxed(Vstepper)) continue;
         // if we are here, all U/V moving is finished
         // check request to change focus
         if(chfocus){
@@ -966,12 +1695,35 @@ static void *stp_process_states(_U_ void *arg){
                         state = STP_RELAX;
                 }
             break;
+            case STP_CALIBRATE:
+                process_calibration();
+            break;
+            case STP_AUTOTUNE:
+                process_autotune();
+            break;
             case STP_FIX: // process corrections
                 if(coordsRdy){
                     coordsRdy = FALSE;
+                    latrec_t lat;
+                    int haslat = latency_take(&lat);
+                    if(rls.pending){ // first coordinates after correction: refine K
+                        rls.pending = FALSE;
+                        if(theconf.rlslambda > 0.) rls_update(rls.du, rls.dv, Xtarget - rls.x0, Ytarget - rls.y0);
+                    }
                     DBG("GOT AVERAGE -> correct\n");
                     double xtg = theconf.xtarget - theconf.xoff, ytg = theconf.ytarget - theconf.yoff;
                     double xdev = xtg - Xtarget, ydev = ytg - Ytarget;
+                    if(theconf.ffmode){ // add drift predicted for the next correction
+                        static double tprev = -1., lead = 0.;
+                        double tnow = sl_dtime(), fx, fy;
+                        if(tprev > 0. && tnow - tprev < MAX_PID_TIME) lead = lead > 0. ? 0.8*lead + 0.2*(tnow - tprev) : tnow - tprev;
+                        tprev = tnow;
+                        ff_addpoint(Xtarget, Ytarget);
+                        if(lead > 0. && ff_predict(lead, &fx, &fy)){
+                            LOGDBG("Feed-forward: lead=%.2fs, predicted drift (%.2f, %.2f)", lead, fx, fy);
+                            xdev -= fx; ydev -= fy;
+                        }
+                    }
                     double corr = sqrt(xdev*xdev + ydev*ydev);
                     if(theconf.xtarget < 1. || theconf.ytarget < 1. || corr < COORDTOLERANCE){
                         DBG("Target coordinates not defined or correction too small, targ: (%.1f, %.1f); corr: %.1f, %.1f (abs: %.1f)",
@@ -980,7 +1732,7 @@ static void *stp_process_states(_U_ void *arg){
                     }
                     LOGDBG("Current position: U=%d, V=%d, deviations: dX=%.1f, dy=%.1f",
                            Uposition, Vposition, xdev, ydev);
-                    if(!try2correct(xdev, ydev)){
+                    if(!try2correct(xdev, ydev, haslat ? &lat : NULL)){
                         LOGWARN("failed to correct");
                         fixerr = 1;
                         // TODO: do something here
@@ -1012,6 +1764,7 @@ static char *set_pfocus(const char *newstatus, char *buf, int buflen){
         snprintf(buf, buflen, OK);
         newfocpos = newval;
         chfocus = TRUE;
+        stp_event(EV_USERCMD);
     }
     return buf;
 }
@@ -1031,6 +1784,7 @@ static char *Umove(const char *val, char *buf, int buflen){
         return buf;
     }
     dUmove = d;
+    stp_event(EV_USERCMD);
     snprintf(buf, buflen, OK);
     return buf;
 }
@@ -1049,14 +1803,30 @@ static char *Vmove(const char *val, char *buf, int buflen){
         return buf;
     }
     dVmove = d;
+    stp_event(EV_USERCMD);
     snprintf(buf, buflen, OK);
     return buf;
 }
 
+// TRUE if U or V is moving (global variable ismoving)
+static int stp_ismoving(){
+    if(state == STP_DISCONN) return FALSE;
+    return (!relaxed(Ustepper) || !relaxed(Vstepper));
+}
+
+// global variable moving: process_file() skipped frame because of moving
+static void stp_moving(){
+    coordstrusted = FALSE;
+    coordsRdy = FALSE;
+}
+
 static steppersproc steppers = {
     .stepdisconnect = stp_disc,
+    .ismoving = stp_ismoving,
+    .moving = stp_moving,
     .proc_corr = stp_process_corrections,
     .stepstatus = stp_status,
+    .cmdstat = stp_cmdstat,
     .setstepstatus = set_stpstatus,
     .movefocus = set_pfocus,
     .moveByU = Umove,
@@ -1069,6 +1839,11 @@ static steppersproc steppers = {
  */
 steppersproc* steppers_connect(){
     DBG("Try to connect");
+    if(!mkcmdhash()){
+        LOGERR("steppers_connect(): collisions in commands' hash");
+        WARNX("Collisions in commands' hash");
+        return NULL;
+    }
     if(!stp_connect_server()) return NULL;
     if(pthread_create(&processingthread, NULL, stp_process_states, NULL)){
         LOGERR("pthread_create() for steppers server failed");
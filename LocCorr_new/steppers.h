@@ -27,17 +27,70 @@
 // max time interval from previous correction to clear integral/time (seconds)
 #define MAX_PID_TIME    (5.)
 
+// online estimator of K: initial covariance, its max trace, min amount of updates before using results
+#define RLS_P0          (1e-3)
+#define RLS_PMAX        (1.)
+#define RLS_MINUPD      (3)
+// min forgetting factor
+#define RLS_LAMBDA_MIN  (0.5)
+// min correction (steps, |dU|+|dV|) used for estimation and max prediction error (pixels)
+#define RLS_MINSTEPS    (10)
+#define RLS_MAXERR      (5.)
+// steps of calibration moves (part of U/V range)
+#define CALIB_FRAC      (0.1)
+
+// feed-forward drift model: history length, min points for fit, min time window (seconds)
+#define FF_NPTS         (256)
+#define FF_MINPTS       (8)
+#define FF_WINDOW       (60.)
+// max RMS of fit residuals (pixels) and max prediction (pixels)
+#define FF_MAXRMS       (0.5)
+#define FF_MAXPRED      (5.)
+
+// PID autotuning: relay amplitude (part of U/V range) and its hysteresis (part of amplitude)
+#define AT_RELAY_FRAC   (0.005)
+#define AT_HYST_FRAC    (0.1)
+// amount of oscillation periods to measure and max time of tuning for one axis (seconds)
+#define AT_NCYCLES      (4)
+#define AT_MAXTIME      (300.)
+
 // amount of ALL motors
 #define NMOTORS (8)
 
+// error codes of steppers server
+typedef enum{
+    ERR_OK,         // 0 - all OK
+    ERR_BADPAR,     // 1 - parameter's value is wrong
+    ERR_BADVAL,     // 2 - wrong parameter's value
+    ERR_WRONGLEN,   // 3 - wrong message length
+    ERR_BADCMD,     // 4 - unknown command
+    ERR_CANTRUN,    // 5 - can't run given command due to bad parameters or other
+    ERR_AMOUNT      // amount of error codes
+} errcodes;
+
+// motor states:
+typedef enum{
+    STATE_RELAX,
+    STATE_ACCEL,
+    STATE_MOVE,
+    STATE_MVSLOW,
+    STATE_DECEL,
+    STATE_STALL,
+    STATE_ERR,
+    STATE_NUM
+} motstate;
+
 typedef struct{
     void (*proc_corr)(double, double);
     char *(*stepstatus)(const char *messageid, char *buf, int buflen);
+    char *(*cmdstat)(const char *messageid, char *buf, int buflen);
     char *(*setstepstatus)(const char *newstatus, char *buf, int buflen);
     char *(*movefocus)(const char *newstatus, char *buf, int buflen);
     char *(*moveByU)(const char *val, char *buf, int buflen);
     char *(*moveByV)(const char *val, char *buf, int buflen);
     void (*stepdisconnect)();
+    int (*ismoving)();  // TRUE while U or V moving (coordinates would be thrown away)
+    void (*moving)();   // frame got while moving: don't trust next averaged coordinates
 } steppersproc;
 
 steppersproc *steppers_connect();
@@ -0,0 +1,410 @@
+/*
+ * This file is part of the loccorr project.
+ * Copyright 2024 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// local steppers server simulator: the same text protocol as multistepper serial proxy
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "debug.h"
+#include "improc.h" // global variable stopwork
+#include "simcam.h"
+#include "steppers.h"
+#include "stpsim.h"
+
+// input buffer length
+#define RBUFLEN     (1024)
+
+// commands (the same as in steppers.c)
+typedef enum{
+    SCMD_ABSPOS,
+    SCMD_EMSTOP,
+    SCMD_ESW,
+    SCMD_GOTO,
+    SCMD_GOTOZ,
+    SCMD_RELPOS,
+    SCMD_STATE,
+    SCMD_STOP,
+    SCMD_AMOUNT
+} simcmd;
+
+static const char *simcommands[SCMD_AMOUNT] = {
+    [SCMD_ABSPOS] = "abspos",
+    [SCMD_EMSTOP] = "emstop",
+    [SCMD_ESW] = "esw",
+    [SCMD_GOTO] = "goto",
+    [SCMD_GOTOZ] = "gotoz",
+    [SCMD_RELPOS] = "relpos",
+    [SCMD_STATE] = "state",
+    [SCMD_STOP] = "stop",
+};
+
+static const char* errtxt[ERR_AMOUNT] = {
+    [ERR_OK] =   "OK",
+    [ERR_BADPAR] =  "BADPAR",
+    [ERR_BADVAL] = "BADVAL",
+    [ERR_WRONGLEN] = "WRONGLEN",
+    [ERR_BADCMD] = "BADCMD",
+    [ERR_CANTRUN] = "CANTRUN",
+};
+
+typedef struct{
+    double pos;         // physical position (steps from lower end-switch)
+    double v;           // current speed (steps per second), sign is direction
+    double target;      // physical target position
+    int zero;           // physical position of user's zero (abspos = pos - zero)
+    motstate state;
+    double tstart;      // time of moving start
+} simmotor;
+
+static simmotor motors[STPSIM_NMOTORS];
+static int lsock = -1; // listening socket
+static uint64_t rng = 0x57e9517eULL; // xorshift64* state for stalls
+
+// uniform in [0, 1)
+static double urnd(){
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return ((rng * 0x2545F4914F6CDD1DULL) >> 11) * (1. / 9007199254740992.);
+}
+
+TRUE_INLINE int ismoving(simmotor *m){
+    return (m->state != STATE_RELAX && m->state != STATE_STALL && m->state != STATE_ERR);
+}
+
+// end-switches state: bit 0 - lower, bit 1 - upper
+static int esw(simmotor *m){
+    int s = 0;
+    if(m->pos <= 0.) s |= 1;
+    if(m->pos >= STPSIM_TRAVEL) s |= 2;
+    return s;
+}
+
+static void stopped(int n, const char *why){
+    simmotor *m = &motors[n];
+    m->v = 0.;
+    if(m->state != STATE_STALL) m->state = STATE_RELAX;
+    DBG("stpsim: motor %d %s at %ld after %.3fs", n, why, lround(m->pos) - m->zero, sl_dtime() - m->tstart);
+    LOGDBG("stpsim: motor %d %s at %ld after %.3fs", n, why, lround(m->pos) - m->zero, sl_dtime() - m->tstart);
+}
+
+/**
+ * @brief move - recalculate n'th motor position (trapezoidal speed profile)
+ * @param n - motor number
+ * @param dt - time since previous call
+ * @return position change
+ */
+static double move(int n, double dt){
+    simmotor *m = &motors[n];
+    if(!ismoving(m)) return 0.;
+    double old = m->pos;
+    if(theconf.stpsimstall > 0. && urnd() < theconf.stpsimstall * dt){
+        m->state = STATE_STALL;
+        stopped(n, "stalled");
+        LOGWARN("stpsim: motor %d stalled", n);
+        return 0.;
+    }
+    double a = theconf.stpsimaccel, vmax = theconf.stpsimspeed;
+    double d = m->target - old, absv = fabs(m->v);
+    if(fabs(d) < 0.5 && absv <= STPSIM_VMIN){
+        m->pos = m->target;
+        stopped(n, "reached target");
+        return m->pos - old;
+    }
+    if(m->v * d < 0.){ // target changed while moving: brake first
+        absv -= a * dt;
+        if(absv < 0.) absv = 0.;
+        m->v = copysign(absv, m->v);
+        m->state = STATE_DECEL;
+    }else{
+        if(absv * absv / (2. * a) >= fabs(d)){ // braking distance reached
+            absv -= a * dt;
+            if(absv < STPSIM_VMIN){
+                absv = STPSIM_VMIN;
+                m->state = STATE_MVSLOW;
+            }else m->state = STATE_DECEL;
+        }else if(absv < vmax){
+            absv += a * dt;
+            if(absv > vmax) absv = vmax;
+            m->state = STATE_ACCEL;
+        }else{
+            absv = vmax;
+            m->state = STATE_MOVE;
+        }
+        m->v = copysign(absv, d);
+    }
+    double newpos = old + m->v * dt;
+    if(m->v * d > 0. && (m->target - newpos) * m->v <= 0.){ // overshoot
+        m->pos = m->target;
+        stopped(n, "reached target");
+    }else if(newpos <= 0. && m->v < 0.){
+        m->pos = 0.;
+        stopped(n, "stopped by lower end-switch");
+    }else if(newpos >= STPSIM_TRAVEL && m->v > 0.){
+        m->pos = STPSIM_TRAVEL;
+        stopped(n, "stopped by upper end-switch");
+    }else m->pos = newpos;
+    return m->pos - old;
+}
+
+// recalculate all motors and move simulated star by U/V
+static void tick(double dt){
+    double dpos[STPSIM_NMOTORS];
+    for(int i = 0; i < STPSIM_NMOTORS; ++i) dpos[i] = move(i, dt);
+    double dU = dpos[0], dV = dpos[1];
+    if(dU == 0. && dV == 0.) return;
+    double angle = theconf.stpsimangle * M_PI / 180., s = sin(angle), c = cos(angle);
+    double k = theconf.stpsimscale;
+    simcam_offset(k * (c*dU - s*dV), k * (s*dU + c*dV));
+}
+
+static errcodes startmove(simmotor *m, double target){
+    if(m->state == STATE_STALL || m->state == STATE_ERR) return ERR_CANTRUN;
+    m->target = target;
+    if(!ismoving(m)){
+        m->state = STATE_ACCEL;
+        m->tstart = sl_dtime();
+    }
+    return ERR_OK;
+}
+
+// process setter `cmd` for motor `m`
+static errcodes setter(simcmd cmd, simmotor *m, int val){
+    switch(cmd){
+        case SCMD_ABSPOS:
+            if(ismoving(m)) return ERR_CANTRUN;
+            m->zero = lround(m->pos) - val;
+        break;
+        case SCMD_EMSTOP: // stop immediately and clear error
+            m->v = 0.;
+            m->target = m->pos;
+            m->state = STATE_RELAX;
+        break;
+        case SCMD_GOTO:
+            return startmove(m, val + m->zero);
+        case SCMD_GOTOZ:
+            return startmove(m, 0.);
+        case SCMD_RELPOS:
+            return startmove(m, (ismoving(m) ? m->target : m->pos) + val);
+        case SCMD_STOP:
+            if(!ismoving(m)) break;
+            m->target = m->pos + copysign(m->v * m->v / (2. * theconf.stpsimaccel), m->v);
+        break;
+        default: // esw, state
+            return ERR_CANTRUN;
+    }
+    return ERR_OK;
+}
+
+static void reply(int fd, const char *msg){
+    size_t len = strlen(msg);
+    while(len){
+        ssize_t sent = write(fd, msg, len);
+        if(sent < 0){
+            if(errno == EINTR) continue;
+            WARN("write()");
+            return;
+        }
+        msg += sent; len -= sent;
+    }
+}
+
+/**
+ * @brief process_line - parse and run command `cmdN[=val]`
+ * @param fd - client socket
+ * @param line - zero-terminated line without '\n'
+ */
+static void process_line(int fd, char *line){
+    char ans[128];
+    errcodes e = ERR_OK;
+    char *eq = strchr(line, '='), *vptr = NULL, *ep;
+    if(eq){
+        *eq = 0;
+        vptr = eq + 1;
+    }
+    line[strcspn(line, " \t\r")] = 0;
+    if(!*line) return;
+    size_t numpos = strcspn(line, "0123456789");
+    int n = -1;
+    if(line[numpos]){
+        n = (int)strtol(line + numpos, &ep, 10);
+        if(*ep) n = -1;
+        line[numpos] = 0;
+    }
+    simcmd cmd;
+    for(cmd = 0; cmd < SCMD_AMOUNT; ++cmd)
+        if(0 == strcmp(simcommands[cmd], line)) break;
+    if(cmd == SCMD_AMOUNT){
+        e = ERR_BADCMD;
+        goto ret;
+    }
+    if(n < 0 || n >= STPSIM_NMOTORS){
+        e = ERR_BADPAR;
+        goto ret;
+    }
+    simmotor *m = &motors[n];
+    if(!vptr){ // getter
+        int val;
+        switch(cmd){
+            case SCMD_ABSPOS:
+                val = lround(m->pos) - m->zero;
+            break;
+            case SCMD_ESW:
+                val = esw(m);
+            break;
+            case SCMD_GOTO:
+                val = lround(m->target) - m->zero;
+            break;
+            case SCMD_RELPOS:
+                val = lround(m->target - m->pos);
+            break;
+            case SCMD_STATE:
+                val = m->state;
+            break;
+            default: // commands without value
+                e = setter(cmd, m, 0);
+                goto ret;
+        }
+        snprintf(ans, 127, "%s%d=%d\n", simcommands[cmd], n, val);
+        reply(fd, ans);
+        return;
+    }
+    long l = strtol(vptr, &ep, 0);
+    while(*ep == ' ' || *ep == '\r' || *ep == '\t') ++ep;
+    if(ep == vptr || *ep || l > MAXSTEPS*4 || l < -MAXSTEPS*4) e = ERR_BADVAL;
+    else e = setter(cmd, m, (int)l);
+ret:
+    snprintf(ans, 127, "%s\n", errtxt[e]);
+    reply(fd, ans);
+}
+
+// main simulator thread: single client, kinematics recalculated each STPSIM_TICK ms
+static void *stpsim_thread(_U_ void *arg){
+    char rbuf[RBUFLEN];
+    size_t rlen = 0;
+    struct pollfd pfd[2] = {{.fd = lsock, .events = POLLIN}, {.fd = -1, .events = POLLIN}};
+    double tlast = sl_dtime();
+    while(!stopwork){
+        int ready = poll(pfd, 2, STPSIM_TICK);
+        if(ready < 0){
+            if(errno == EINTR) continue;
+            LOGERR("stpsim: poll error: %s", strerror(errno));
+            break;
+        }
+        double t = sl_dtime();
+        tick(t - tlast);
+        tlast = t;
+        if(0 == ready) continue;
+        if(pfd[0].revents & POLLIN){
+            int newsock = accept(lsock, NULL, NULL);
+            if(newsock < 0) WARN("accept()");
+            else{
+                if(pfd[1].fd > -1) close(pfd[1].fd); // only one client allowed
+                pfd[1].fd = newsock;
+                rlen = 0;
+                LOGMSG("stpsim: client connected");
+            }
+        }
+        if(pfd[1].fd < 0 || !(pfd[1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        ssize_t rd = read(pfd[1].fd, rbuf + rlen, RBUFLEN - 1 - rlen);
+        if(rd < 1){
+            LOGMSG("stpsim: client disconnected");
+            close(pfd[1].fd);
+            pfd[1].fd = -1;
+            continue;
+        }
+        rlen += rd;
+        rbuf[rlen] = 0;
+        char *start = rbuf, *eol;
+        while((eol = strchr(start, '\n'))){
+            *eol = 0;
+            process_line(pfd[1].fd, start);
+            start = eol + 1;
+        }
+        rlen -= start - rbuf;
+        if(rlen == RBUFLEN - 1){ // too long line
+            reply(pfd[1].fd, "WRONGLEN\n");
+            rlen = 0;
+        }else memmove(rbuf, start, rlen);
+    }
+    if(pfd[1].fd > -1) close(pfd[1].fd);
+    close(lsock);
+    lsock = -1;
+    DBG("stpsim: thread stopped");
+    return NULL;
+}
+
+/**
+ * @brief stpsim_run - run steppers server simulator at 127.0.0.1:port
+ * @param port - port to listen
+ * @return FALSE if failed
+ */
+int stpsim_run(int port){
+    FNAME();
+    if(lsock > -1) return TRUE; // already running
+    char node[32];
+    snprintf(node, 31, "%d", port);
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if(getaddrinfo("127.0.0.1", node, &hints, &res) != 0){
+        LOGERR("stpsim_run(): getaddrinfo() failed");
+        WARNX("getaddrinfo()");
+        return FALSE;
+    }
+    lsock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int reuseaddr = 1;
+    if(lsock < 0 || setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(int)) == -1 ||
+       bind(lsock, res->ai_addr, res->ai_addrlen) == -1 || listen(lsock, 1) == -1){
+        WARN("Can't open steppers simulator port %s", node);
+        LOGERR("stpsim_run(): can't open port %s", node);
+        if(lsock > -1) close(lsock);
+        lsock = -1;
+        freeaddrinfo(res);
+        return FALSE;
+    }
+    freeaddrinfo(res);
+    for(int i = 0; i < STPSIM_NMOTORS; ++i){ // all motors are in the middle of travel, abspos=0
+        motors[i].pos = motors[i].target = STPSIM_TRAVEL / 2;
+        motors[i].zero = STPSIM_TRAVEL / 2;
+        motors[i].v = 0.;
+        motors[i].state = STATE_RELAX;
+    }
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, stpsim_thread, NULL)){
+        LOGERR("stpsim_run(): pthread_create() failed");
+        WARN("pthread_create()");
+        close(lsock);
+        lsock = -1;
+        return FALSE;
+    }
+    pthread_detach(thread);
+    LOGMSG("Steppers simulator listening at port %s", node);
+    return TRUE;
+}
@@ -0,0 +1,34 @@
+/*
+ * This file is part of the loccorr project.
+ * Copyright 2024 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef STPSIM_H__
+#define STPSIM_H__
+
+// amount of simulated motors (U, V and F)
+#define STPSIM_NMOTORS      (3)
+// full travel between end-switches, steps
+#define STPSIM_TRAVEL       (2*MAXSTEPS)
+// minimal speed (when decelerated near target), steps per second
+#define STPSIM_VMIN         (10.)
+// poll() timeout, ms (kinematics recalculated at least so often)
+#define STPSIM_TICK         (1)
+
+int stpsim_run(int port);
+
+#endif // STPSIM_H__
@@ -27,8 +27,7 @@
 // flags for image processing
 typedef enum{
     IM_SLEEP,
-    IM_STARTED,
-    IM_READY,
+    IM_STARTED,     // continuous acquisition is running
     IM_ERROR
 } imstate_t;
 
@@ -43,7 +42,7 @@ static struct{
     size_t imsz;                // size of current image in bytes
     imstate_t state;            // current state
     uint64_t imseqno;           // number of image from connection
-    uint64_t lastcapno;         // last captured image number
+    framering ring;             // captured frames
 } toupcam = {0};
 
 // array - max ROI; geometry - current ROI
@@ -80,11 +79,10 @@ static const char *errcode(int ecode){
 static void camcancel(){
     FNAME();
     if(!toupcam.hcam) return;
-    int e = Toupcam_Trigger(toupcam.hcam, 0); // stop triggering
-    if(e < 0) WARNX("Can't trigger 0: %s", errcode(e));
-    e = Toupcam_Stop(toupcam.hcam);
+    int e = Toupcam_Stop(toupcam.hcam);
     if(e < 0) WARNX("Can't stop: %s", errcode(e));
     toupcam.state = IM_SLEEP;
+    framering_clear(&toupcam.ring); // frames with old parameters
 }
 
 static void Tdisconnect(){
@@ -108,41 +106,38 @@ static void EventCallback(unsigned nEvent, void _U_ *pCallbackCtx){
     if(!toupcam.hcam || !toupcam.data){ DBG("NO data!"); return; }
     if(nEvent != TOUPCAM_EVENT_IMAGE){ DBG("Not image event"); return; }
     ToupcamFrameInfoV4 info = {0};
+    double tend = sl_dtime();
     pthread_mutex_lock(&toupcam.mutex);
     if(Toupcam_PullImageV4(toupcam.hcam, toupcam.data, 0, 0, 0, &info) < 0){
         DBG("Error pulling image");
         toupcam.state = IM_ERROR;
-    }else{
-        ++toupcam.imseqno;
-        DBG("Image %lu (%dx%d) ready!", toupcam.imseqno, info.v3.width, info.v3.height);
-        toupcam.state = IM_READY;
-        toupcam.imsz = info.v3.height * info.v3.width;
-        geometry.h = info.v3.height;
-        geometry.w = info.v3.width;
+        pthread_mutex_unlock(&toupcam.mutex);
+        return;
     }
+    ++toupcam.imseqno;
+    DBG("Image %lu (%dx%d) ready!", toupcam.imseqno, info.v3.width, info.v3.height);
+    toupcam.imsz = info.v3.height * info.v3.width;
+    geometry.h = info.v3.height;
+    geometry.w = info.v3.width;
+    Image *o = u8toImage(toupcam.data, geometry.w, geometry.h, geometry.w);
     pthread_mutex_unlock(&toupcam.mutex);
+    // camera frames counter shows frames lost by SDK
+    o->seqno = (info.v3.flag & TOUPCAM_FRAMEINFO_FLAG_SEQ) ? (uint64_t)info.v3.seq + 1 : toupcam.imseqno;
+    o->tend = tend;
+    o->tstart = tend - exptimeS;
+    framering_put(&toupcam.ring, o);
 }
 
+// start continuous acquisition (if not started yet)
 static int startexp(){
     FNAME();
     TCHECK();
-    if(toupcam.state == IM_SLEEP){
-        DBG("Sleeping -> start pull mode");
-        if(Toupcam_StartPullModeWithCallback(toupcam.hcam, EventCallback, NULL) < 0){
-            WARNX("Can't run PullMode with Callback!");
-            return FALSE;
-        }
-    }
-    // Ask to trigger for several images (maximal speed available)
-    DBG("Trigger images");
-    int e = Toupcam_Trigger(toupcam.hcam, 100);
-    if(e < 0){
-        DBG("Can't ask for images stream: %s; try 1", errcode(e));
-        e = Toupcam_Trigger(toupcam.hcam, 1);
-        if(e < 0){
-            WARNX("Can't ask for next image: %s", errcode(e));
-            return FALSE;
-        }
+    if(toupcam.state == IM_STARTED) return TRUE;
+    if(toupcam.state == IM_ERROR) camcancel();
+    DBG("Sleeping -> start pull mode");
+    if(Toupcam_StartPullModeWithCallback(toupcam.hcam, EventCallback, NULL) < 0){
+        WARNX("Can't run PullMode with Callback!");
+        return FALSE;
     }
     toupcam.state = IM_STARTED;
     starttime = sl_dtime();
@@ -199,12 +194,12 @@ static int Tconnect(){
     toupcam.data = calloc(array.w * array.h, 1);
 #define OPT(opt, val, comment)  do{DBG(comment); if(Toupcam_put_Option(toupcam.hcam, opt, val) < 0){ DBG("Can't put this option"); }}while(0)
     // 12 frames/sec
-    OPT(TOUPCAM_OPTION_TRIGGER, 1, "Software/simulated trigger mode");
+    OPT(TOUPCAM_OPTION_TRIGGER, 0, "Video (free-run) mode: next exposure overlaps readout");
     OPT(TOUPCAM_OPTION_RAW, 1, "Put to RAW mode");
     OPT(TOUPCAM_OPTION_BINNING, 1, "Set binning to 1x1");
 #undef OPT
     toupcam.state = IM_SLEEP;
-    toupcam.imseqno = toupcam.lastcapno = 0;
+    toupcam.imseqno = 0;
     // 8bit
     if(Toupcam_put_Option(toupcam.hcam, TOUPCAM_OPTION_BITDEPTH, 0) < 0) WARNX("Cant set bitdepth");
     if(Toupcam_put_Option(toupcam.hcam, TOUPCAM_OPTION_PIXEL_FORMAT, TOUPCAM_PIXELFORMAT_RAW8) < 0){
@@ -213,6 +208,7 @@ static int Tconnect(){
         return FALSE;
     }
     pthread_mutex_init(&toupcam.mutex, NULL);
+    framering_init(&toupcam.ring);
     if(!Texp(0.1)){ WARNX("Can't set default exptime"); }
     return TRUE;
 }
@@ -225,24 +221,11 @@ static Image *Tcapture(){
         return NULL;
     }
     DBG("here, exptime=%gs, dstart=%g", exptimeS, (sl_dtime() - starttime));
-    double tremain = 0.;
-    while(toupcam.state != IM_READY){
-        tremain = exptimeS - (sl_dtime() - starttime);
-        if(tremain < -2.0){
-            WARNX("Timeout - failed");
-            camcancel();
-            return NULL;
-        }
-        usleep(100);
+    Image *o = framering_get(&toupcam.ring, exptimeS + TOUPCAM_READOUT_TM);
+    if(!o){
+        WARNX("Timeout - failed (state=%d)", toupcam.state);
+        camcancel();
     }
-    if(toupcam.state != IM_READY){
-        WARNX("State=%d, not ready", toupcam.state);
-        return NULL;
-    }
-    pthread_mutex_lock(&toupcam.mutex);
-    Image *o = u8toImage(toupcam.data, geometry.w, geometry.h, geometry.w);
-    toupcam.lastcapno = toupcam.imseqno;
-    pthread_mutex_unlock(&toupcam.mutex);
     return o;
 }
 
@@ -313,6 +296,7 @@ camera Toupcam = {
     .setexp = Texp,
     .setgain = Tgain,
     .getmaxgain = Tmaxgain,
+    .lineargain = TRUE,
     .setgeometry = Tgeometry,
     .getgeomlimits = Tglimits,
 };